@@ -0,0 +1,63 @@
+#include "programs.h"
+#include "primitives.h"
+#include "test_helpers.h"
+
+#define BODY_ADDRESS 0x3000
+#define LOW_COUNTER_ADDRESS 0x200
+#define HIGH_COUNTER_ADDRESS 0x201
+#define INCREMENT_TABLE_ADDRESS 0x1000
+#define LOW_BRANCH_TABLE_ADDRESS 0x2000
+#define HIGH_BRANCH_TABLE_ADDRESS 0x2100
+
+// Bytes copied by the body calling primitives: the id of primitive_nop and
+// the trigger.
+#define NOP_ID_ADDRESS 0x102
+#define READY_ADDRESS 0x101
+
+void write_loop_program(struct virtual_machine *vm, int call_primitives){
+    WORD *memory = vm->memory;
+    unsigned int address;
+
+    for(int i = 0; i < 256; i++){
+        memory[INCREMENT_TABLE_ADDRESS+i] = (i + 1) & WORD_BIT_MASK;
+        // Middle byte of the jump address taken once the counter wrapped.
+        memory[LOW_BRANCH_TABLE_ADDRESS+i] = i == 0 ? 0x05 : 0x04;
+        memory[HIGH_BRANCH_TABLE_ADDRESS+i] = i == 0 ? 0x06 : 0x04;
+    }
+    memory[LOW_COUNTER_ADDRESS] = 0;
+    memory[HIGH_COUNTER_ADDRESS] = 0;
+    memory[NOP_ID_ADDRESS] = PRIMITIVE_ID_NOPE;
+
+    for(int i = 0; i < LOOP_BODY_LENGTH; i++){
+        unsigned int jump;
+        address = BODY_ADDRESS + 9 * i;
+        jump = i == LOOP_BODY_LENGTH - 1 ? 0x4000 : address + 9;
+        if(!call_primitives){
+            write_instruction(memory, address, 0x8000 + i, 0x8100 + i, jump);
+        } else if(i % 2 == 0){
+            write_instruction(memory, address, NOP_ID_ADDRESS, PRIMITIVE_CALL_ID_ADDRESS, jump);
+        } else{
+            write_instruction(memory, address, READY_ADDRESS, PRIMITIVE_IS_READY_ADDRESS, jump);
+        }
+    }
+    // Low counter: increment and go back to the body unless it wrapped.
+    write_instruction(memory, 0x4000, LOW_COUNTER_ADDRESS, 0x400B, 0x4009);
+    write_instruction(memory, 0x4009, INCREMENT_TABLE_ADDRESS, LOW_COUNTER_ADDRESS, 0x4012);
+    write_instruction(memory, 0x4012, LOW_COUNTER_ADDRESS, 0x401D, 0x401B);
+    write_instruction(memory, 0x401B, LOW_BRANCH_TABLE_ADDRESS, 0x402B, 0x4024);
+    write_instruction(memory, 0x4024, 0x300, 0x300, 0x0000);
+    write_instruction(memory, 0x0400, 0x300, 0x300, BODY_ADDRESS);
+    // High counter: increment and go back to the body unless it wrapped.
+    write_instruction(memory, 0x0500, HIGH_COUNTER_ADDRESS, 0x050B, 0x0509);
+    write_instruction(memory, 0x0509, INCREMENT_TABLE_ADDRESS, HIGH_COUNTER_ADDRESS, 0x0512);
+    write_instruction(memory, 0x0512, HIGH_COUNTER_ADDRESS, 0x051D, 0x051B);
+    write_instruction(memory, 0x051B, HIGH_BRANCH_TABLE_ADDRESS, 0x052B, 0x0524);
+    write_instruction(memory, 0x0524, 0x300, 0x300, 0x0000);
+    // Stop the VM.
+    memory[0x100] = PRIMITIVE_ID_STOP_VM;
+    memory[READY_ADDRESS] = PRIMITIVE_READY;
+    write_instruction(memory, 0x0600, 0x100, PRIMITIVE_CALL_ID_ADDRESS, 0x0609);
+    write_instruction(memory, 0x0609, READY_ADDRESS, PRIMITIVE_IS_READY_ADDRESS, 0x0612);
+    write_instruction(memory, 0x0612, 0x300, 0x300, 0x0612);
+    set_pc_address(vm, BODY_ADDRESS);
+}
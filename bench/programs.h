@@ -0,0 +1,33 @@
+#ifndef BENCH_PROGRAMS_H
+
+#define BENCH_PROGRAMS_H
+
+#include "vm.h"
+#include "memory.h"
+
+/**
+ * Synthetic programs shared by the benchmarks.
+ */
+
+// Number of instructions of the body of the loop program.
+#define LOOP_BODY_LENGTH 256
+
+// Instructions executed by the loop program: 65536 iterations of the body,
+// the low counter and the jump back, plus the high counter every 256
+// iterations.
+#define LOOP_INSTRUCTIONS (65536ULL * (LOOP_BODY_LENGTH + 6) + 256ULL * 5)
+
+// Primitives called by the loop program when its body calls primitive_nop,
+// the last one stopping the VM.
+#define LOOP_PRIMITIVES (65536ULL * LOOP_BODY_LENGTH / 2 + 1)
+
+/**
+ * Writes a program running its body 65536 times, counting iterations with a
+ * 16-bit counter made of two lookup-table counters, then stopping the VM, and
+ * sets the PC of vm to its first instruction.
+ * The body copies bytes around, without any code write, or calls
+ * primitive_nop every 2 instructions when call_primitives is TRUE.
+ */
+void write_loop_program(struct virtual_machine *vm, int call_primitives);
+
+#endif
@@ -0,0 +1,336 @@
+/**
+ * Benchmark suite.
+ *
+ * Runs synthetic programs and images with each engine, and writes for each
+ * of them the best of several repetitions as JSON:
+ *   {"build_type": "Release", "benchmarks": [
+ *     {"name": ..., "engine": ..., "instructions": ..., "primitives": ...,
+ *      "seconds": ..., "instructions_per_second": ...,
+ *      "ns_per_instruction": ..., "primitives_per_second": ...,
+ *      "peak_rss_kib": ...}, ...]}
+ * Each benchmark runs in a child process, so that its peak RSS is its own.
+ * The standard output of the images is discarded, their standard input is
+ * the file given with --input=, empty otherwise. With --replay=, the I/O
+ * primitives of the image are replayed from an I/O log written by
+ * jolly --record-io= (see io_log.h) instead, so that the measure does not
+ * depend on the streams.
+ *
+ * Benchmarks:
+ * - loop: copies bytes in a loop, without code writes nor primitives.
+ * - primitives: the same loop, calling primitive_nop every 2 instructions.
+ * - any other argument is an image file.
+ *
+ * Usage: bench_suite [--repetitions=<n>] [--engine=<engine>] [--output=<file>]
+ *            [--input=<file>|--replay=<log>] <benchmark>
+ *            [[--input=<file>|--replay=<log>] <benchmark>]...
+ * --input= and --replay= apply to the next benchmark only.
+ */
+#include "vm.h"
+#include "memory.h"
+#include "primitives.h"
+#include "trace.h"
+#include "io_log.h"
+#include "log.h"
+#include "programs.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define REPETITIONS_OPTION "--repetitions="
+#define ENGINE_OPTION "--engine="
+#define OUTPUT_OPTION "--output="
+#define INPUT_OPTION "--input="
+#define REPLAY_OPTION "--replay="
+
+#define DEFAULT_REPETITIONS 5
+
+#ifndef JOLLY_BUILD_TYPE
+#define JOLLY_BUILD_TYPE "unknown"
+#endif
+
+struct engine{
+    char *name;
+    int (*run)(struct virtual_machine *vm);
+};
+
+static struct engine engines[] = {
+    { "reference", run },
+    { "fast", run_fast },
+    { "trace", run_trace },
+};
+
+#define ENGINES_COUNT (sizeof(engines) / sizeof(struct engine))
+
+struct benchmark{
+    char *name;
+    char *input_file_name;
+    char *replay_file_name;
+};
+
+/**
+ * Fastest run of a benchmark.
+ */
+struct measurement{
+    unsigned long long instructions;
+    unsigned long long primitives;
+    unsigned long long nanoseconds;
+    long peak_rss_kib;
+};
+
+/**
+ * Creates the VM of the benchmark, reading its standard input from the input
+ * file and discarding its standard output, or replaying its I/O log.
+ * Returns NULL on failure.
+ */
+static struct virtual_machine *create_vm(struct benchmark *benchmark){
+    struct virtual_machine *vm;
+    int loaded;
+
+    if(new_vm(&vm) != VM_OK){
+        return NULL;
+    }
+    if(strcmp(benchmark->name, "loop") == 0 || strcmp(benchmark->name, "primitives") == 0){
+        loaded = create_empty_memory(vm) == VM_OK;
+        if(loaded){
+            write_loop_program(vm, strcmp(benchmark->name, "primitives") == 0);
+        }
+    } else{
+        loaded = load_image(vm, benchmark->name) == VM_OK;
+        if(loaded){
+            load_pc(vm);
+        }
+    }
+    vm->file_streams[PRIMITIVE_FILE_STREAM_STDIN] = fopen(
+        benchmark->input_file_name != NULL ? benchmark->input_file_name : "/dev/null", "r");
+    vm->file_streams[PRIMITIVE_FILE_STREAM_STDOUT] = fopen("/dev/null", "w");
+    if(!loaded || vm->file_streams[PRIMITIVE_FILE_STREAM_STDIN] == NULL
+        || vm->file_streams[PRIMITIVE_FILE_STREAM_STDOUT] == NULL
+        || (benchmark->replay_file_name != NULL && replay_io(vm, benchmark->replay_file_name) != VM_OK)){
+        free_vm(vm);
+        return NULL;
+    }
+    return vm;
+}
+
+/**
+ * Runs the benchmark repetitions times with engine, and stores its fastest
+ * run in measurement.
+ *
+ * Returns 0, -1 if a VM could not be created or its replay diverged.
+ */
+static int measure(struct benchmark *benchmark, struct engine *engine, int repetitions,
+    struct measurement *measurement){
+    struct virtual_machine *vm;
+    struct rusage usage;
+    unsigned long long start, elapsed;
+
+    for(int repetition = 0; repetition < repetitions; repetition++){
+        vm = create_vm(benchmark);
+        if(vm == NULL){
+            return -1;
+        }
+        start = get_monotonic_time();
+        engine->run(vm);
+        elapsed = get_monotonic_time() - start;
+        if(repetition == 0 || elapsed < measurement->nanoseconds){
+            measurement->nanoseconds = elapsed;
+        }
+        measurement->instructions = vm->retired_instructions;
+        measurement->primitives = vm->retired_primitives;
+        if(close_io_log(vm) != VM_OK){
+            free_vm(vm);
+            return -1;
+        }
+        free_vm(vm);
+    }
+    if(measurement->nanoseconds == 0){
+        measurement->nanoseconds = 1;
+    }
+    getrusage(RUSAGE_SELF, &usage);
+    measurement->peak_rss_kib = usage.ru_maxrss;
+    return 0;
+}
+
+/**
+ * Measures the benchmark in a child process.
+ *
+ * Returns 0, -1 if it failed.
+ */
+static int measure_in_child(struct benchmark *benchmark, struct engine *engine, int repetitions,
+    struct measurement *measurement){
+    int descriptors[2];
+    int status, received;
+    pid_t child;
+
+    if(pipe(descriptors) != 0){
+        return -1;
+    }
+    child = fork();
+    if(child < 0){
+        close(descriptors[0]);
+        close(descriptors[1]);
+        return -1;
+    }
+    if(child == 0){
+        close(descriptors[0]);
+        if(measure(benchmark, engine, repetitions, measurement) != 0
+            || write(descriptors[1], measurement, sizeof(struct measurement)) != sizeof(struct measurement)){
+            _exit(1);
+        }
+        _exit(0);
+    }
+    close(descriptors[1]);
+    // Smaller than PIPE_BUF, written at once.
+    received = read(descriptors[0], measurement, sizeof(struct measurement)) == sizeof(struct measurement);
+    close(descriptors[0]);
+    if(waitpid(child, &status, 0) != child || !WIFEXITED(status) || WEXITSTATUS(status) != 0 || !received){
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Returns the file the benchmark reads its input from, NULL if none.
+ */
+static char *get_input_name(struct benchmark *benchmark){
+    return benchmark->replay_file_name != NULL ? benchmark->replay_file_name : benchmark->input_file_name;
+}
+
+/**
+ * Writes the JSON object of the measurement of benchmark with engine.
+ */
+static void write_result(FILE *output, struct benchmark *benchmark, struct engine *engine,
+    struct measurement *measurement){
+    fprintf(output, "{\"name\": \"%s\", \"input\": \"%s\", \"engine\": \"%s\", "
+        "\"instructions\": %llu, \"primitives\": %llu, \"seconds\": %.9f, "
+        "\"instructions_per_second\": %.0f, \"ns_per_instruction\": %.3f, "
+        "\"primitives_per_second\": %.0f, \"peak_rss_kib\": %ld}",
+        benchmark->name, get_input_name(benchmark) != NULL ? get_input_name(benchmark) : "",
+        engine->name, measurement->instructions, measurement->primitives,
+        measurement->nanoseconds / 1e9,
+        measurement->instructions * 1e9 / measurement->nanoseconds,
+        measurement->instructions != 0 ? (double)measurement->nanoseconds / measurement->instructions : 0.0,
+        measurement->primitives * 1e9 / measurement->nanoseconds,
+        measurement->peak_rss_kib);
+}
+
+static char *get_base_name(char *file_name){
+    char *slash = strrchr(file_name, '/');
+    return slash != NULL ? slash + 1 : file_name;
+}
+
+/**
+ * Writes the short name of the benchmark printed in the summary, e.g.
+ * brainfuck.jolly<fibonacci.bf.
+ */
+static void get_label(struct benchmark *benchmark, char *label, size_t size){
+    if(get_input_name(benchmark) != NULL){
+        snprintf(label, size, "%s<%s", get_base_name(benchmark->name),
+            get_base_name(get_input_name(benchmark)));
+    } else{
+        snprintf(label, size, "%s", get_base_name(benchmark->name));
+    }
+}
+
+static void print_usage(void){
+    fprintf(stderr, "Usage: bench_suite [" REPETITIONS_OPTION "<n>] [" ENGINE_OPTION "<engine>] ["
+        OUTPUT_OPTION "<file>] [" INPUT_OPTION "<file>|" REPLAY_OPTION "<log>] <benchmark>...\n");
+    fprintf(stderr, "Benchmarks: loop, primitives, or an image file.\n");
+}
+
+int main(int argc, char **argv){
+    struct benchmark *benchmarks;
+    struct engine *engine;
+    struct measurement measurement;
+    char *input_file_name, *replay_file_name;
+    unsigned int benchmarks_count;
+    int repetitions, failures, first;
+    FILE *output;
+
+    log_set_level(LOG_ERROR);
+
+    repetitions = DEFAULT_REPETITIONS;
+    engine = NULL;
+    output = stdout;
+    input_file_name = NULL;
+    replay_file_name = NULL;
+    benchmarks = (struct benchmark *)malloc(argc * sizeof(struct benchmark));
+    benchmarks_count = 0;
+    if(benchmarks == NULL){
+        return -1;
+    }
+    for(int i = 1; i < argc; i++){
+        if(strncmp(argv[i], REPETITIONS_OPTION, strlen(REPETITIONS_OPTION)) == 0){
+            repetitions = atoi(argv[i] + strlen(REPETITIONS_OPTION));
+        } else if(strncmp(argv[i], ENGINE_OPTION, strlen(ENGINE_OPTION)) == 0){
+            engine = NULL;
+            for(unsigned int j = 0; j < ENGINES_COUNT; j++){
+                if(strcmp(engines[j].name, argv[i] + strlen(ENGINE_OPTION)) == 0){
+                    engine = &engines[j];
+                }
+            }
+            if(engine == NULL){
+                fprintf(stderr, "Unknown engine %s, aborting.\n", argv[i]);
+                print_usage();
+                return -1;
+            }
+        } else if(strncmp(argv[i], OUTPUT_OPTION, strlen(OUTPUT_OPTION)) == 0){
+            output = fopen(argv[i] + strlen(OUTPUT_OPTION), "w");
+            if(output == NULL){
+                fprintf(stderr, "Failed to open %s, aborting.\n", argv[i] + strlen(OUTPUT_OPTION));
+                return -1;
+            }
+        } else if(strncmp(argv[i], INPUT_OPTION, strlen(INPUT_OPTION)) == 0){
+            input_file_name = argv[i] + strlen(INPUT_OPTION);
+        } else if(strncmp(argv[i], REPLAY_OPTION, strlen(REPLAY_OPTION)) == 0){
+            replay_file_name = argv[i] + strlen(REPLAY_OPTION);
+        } else{
+            benchmarks[benchmarks_count].name = argv[i];
+            benchmarks[benchmarks_count].input_file_name = input_file_name;
+            benchmarks[benchmarks_count++].replay_file_name = replay_file_name;
+            input_file_name = NULL;
+            replay_file_name = NULL;
+        }
+    }
+    if(repetitions <= 0 || benchmarks_count == 0){
+        print_usage();
+        return -1;
+    }
+
+    failures = 0;
+    first = 1;
+    fprintf(output, "{\"build_type\": \"%s\", \"benchmarks\": [", JOLLY_BUILD_TYPE);
+    fprintf(stderr, "%-32s %-10s %14s %12s %14s %10s\n",
+        "benchmark", "engine", "instructions", "ns/instr", "primitives/s", "RSS KiB");
+    for(unsigned int i = 0; i < benchmarks_count; i++){
+        for(unsigned int j = 0; j < ENGINES_COUNT; j++){
+            char label[64];
+            if(engine != NULL && engine != &engines[j]){
+                continue;
+            }
+            if(measure_in_child(&benchmarks[i], &engines[j], repetitions, &measurement) != 0){
+                fprintf(stderr, "Failed to run %s with the %s engine.\n", benchmarks[i].name, engines[j].name);
+                failures++;
+                continue;
+            }
+            fprintf(output, "%s\n  ", first ? "" : ",");
+            write_result(output, &benchmarks[i], &engines[j], &measurement);
+            first = 0;
+            get_label(&benchmarks[i], label, sizeof(label));
+            fprintf(stderr, "%-32s %-10s %14llu %12.3f %14.0f %10ld\n",
+                label, engines[j].name,
+                measurement.instructions, (double)measurement.nanoseconds / measurement.instructions,
+                measurement.primitives * 1e9 / measurement.nanoseconds, measurement.peak_rss_kib);
+        }
+    }
+    fprintf(output, "\n]}\n");
+    if(output != stdout){
+        fclose(output);
+    }
+    free(benchmarks);
+    return failures == 0 ? 0 : -1;
+}
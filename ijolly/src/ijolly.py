@@ -78,6 +78,28 @@ class Label(object):
         self.name = name
         self.address = address
 
+
+class Profile(object):
+    """ Executions counted by `jolly --profile=<file>`.
+    """
+    def __init__(self, instructions=0, counts=None, edges=None):
+        self.instructions = instructions
+        # Executions by instruction address.
+        self.counts = counts if counts is not None else {}
+        # Executions by (instruction address, jump address).
+        self.edges = edges if edges is not None else {}
+
+    def count(self, address):
+        return self.counts.get(address, 0)
+
+    def count_range(self, first_address, end_address):
+        """ Executions of the instructions starting in [first_address, end_address[.
+        """
+        return sum(self.count(a) for a in range(first_address, end_address))
+
+    def hot_spots(self, count=10):
+        return sorted(self.counts.items(), key=lambda c: (-c[1], c[0]))[:count]
+
 class InteractiveJolly(object):
     def __init__(self, vm, labels=[]):
         self.vm = vm
@@ -85,6 +107,7 @@ class InteractiveJolly(object):
         self.watchers = []
         self.macros = []
         self.labels = labels
+        self.profile = None
         self.enable_trace = False
 
     def int_print_strategy(self, integer, padding):
@@ -122,6 +145,30 @@ class InteractiveJolly(object):
 
     def load(self, filename):
         self.vm.load_from_file(filename)
+        self.vm.enable_history()
+
+    @property
+    def step(self):
+        return self.vm.history_step()
+
+    def print_step(self):
+        print("Step {0}, pc ".format(self.step), end='')
+        self.print_pc()
+
+    def back(self, count=1):
+        self.goto(max(self.step - count, self.vm.history_first_step()))
+
+    def goto(self, step):
+        """ Rewinds the VM to step when it is in the past, else executes
+            instructions up to it.
+        """
+        if step < self.step:
+            if not self.vm.rewind(step):
+                print("Step {0} is not in the history anymore.".format(step))
+                return
+        else:
+            self.next(step - self.step)
+        self.print_step()
 
     def read_byte(self, address):
         self.int_print_strategy(self.memory[address], 4)
@@ -150,49 +197,106 @@ class InteractiveJolly(object):
         first_address = start_address_wanted - (start_address_wanted % 16)
         for line in range(lines_count):
             first_line_address = first_address + line * 16
+            line_bytes = self.memory[first_line_address:first_line_address + 16]
             print("{0:0{1}x}".format(first_line_address, 8), end='')
             print(" ", end='')
-            for byte_address in range(first_line_address, first_line_address + 16):
+            for byte_address, byte in enumerate(line_bytes, first_line_address):
                 if byte_address == first_line_address + 8:
                     print(" ", end='')
-                to_print = "{0:0{1}x}".format(self.memory[byte_address], 2)
+                to_print = "{0:0{1}x}".format(byte, 2)
                 if byte_address == start_address_wanted:
                     to_print = colored(to_print, attrs=['underline'])
                 print(to_print, end=' ')
             print("|", end='')
-            for byte_address in range(first_line_address, first_line_address + 16):
+            for byte_address, byte in enumerate(line_bytes, first_line_address):
                 to_print = None
-                if self.memory[byte_address] >= 0x21 and self.memory[byte_address] <= 0x7e:
-                    b = bytearray(1)
-                    b[0] = self.memory[byte_address]
-                    to_print = b.decode("ascii")
+                if byte >= 0x21 and byte <= 0x7e:
+                    to_print = chr(byte)
                 else:
                     to_print = '.'
                 if byte_address == start_address_wanted:
                     to_print = colored(to_print, attrs=['underline'])
                 print(to_print, end='')
             print("|", end='')
-            print("")
+            print(self.line_annotation(first_line_address, 16))
     
+    def line_annotation(self, first_address, bytes_count):
+        """ Returns the labels of the addresses of a hexdump line, followed by
+            the executions of its instructions when a profile is loaded.
+        """
+        end_address = first_address + bytes_count
+        annotation = [ l.name for l in sorted(self.labels, key=lambda l: l.address)
+                       if first_address <= l.address < end_address ]
+        if self.profile is not None:
+            executions = self.profile.count_range(first_address, end_address)
+            if executions:
+                annotation.append("{0}x".format(executions))
+        return " " + " ".join(annotation) if annotation else ""
+
+    def label_of(self, address):
+        """ Returns the closest label at or before address as label+offset,
+            None if there is none.
+        """
+        before = [ l for l in self.labels if l.address <= address ]
+        if not before:
+            return None
+        label = max(before, key=lambda l: l.address)
+        if label.address == address:
+            return label.name
+        return label.name + "+" + self.integer_to_string(address - label.address)
+
+    def load_profile(self, filename):
+        self.profile = load_profile(filename)
+
+    def print_hot_spots(self, count=10):
+        if self.profile is None:
+            print("No profile loaded.")
+            return
+        print("Hot spots:")
+        for address, executions in self.profile.hot_spots(count):
+            share = 100.0 * executions / self.profile.instructions if self.profile.instructions else 0
+            print(self.integer_to_string(address, 8), end=' : ')
+            print("{0} ({1:.2f}%)".format(executions, share), end='')
+            label = self.label_of(address)
+            print(" " + label if label else "")
+
     def indirect_hexdump(self, address_pointer, *args, **kwargs):
         address = self.memory.get_address(address_pointer)
         self.hexdump(address, *args, **kwargs)
 
+    def next_until(self, condition, **conditions):
+        """ Executes instructions until condition() holds. The conditions are
+            checked by the C run_until, unless the trace is printed.
+        """
+        if self.enable_trace:
+            while not condition():
+                self.next()
+        else:
+            self.vm.run_until(**conditions)
+
     def nextprim(self, primitive_id=None):
         if primitive_id:
-            while not (self.vm.is_primitive_ready() and self.vm.primitive_call_id() == primitive_id):
-                self.next()
+            self.next_until(lambda: self.vm.is_primitive_ready() and self.vm.primitive_call_id() == primitive_id,
+                            primitive_id=primitive_id)
         else: 
-            while not self.vm.is_primitive_ready():
-                self.next()
+            self.next_until(self.vm.is_primitive_ready, any_primitive=True)
 
     def next_up_to(self, address):
-        while not self.pc_address == address:
-            self.next()
+        self.next_until(lambda: self.pc_address == address, breakpoints=[address])
     
     def next_until_about_to_write(self, address, value=None):
-        print(address)
-        while self.memory.get_instruction(address).to_add != address:
+        """ Executes instructions until the next one writes at address, value
+            if given.
+        """
+        while True:
+            self.next_until(lambda: self.memory.get_instruction(self.pc_address).to_add == address,
+                            watches=[(address, 1)])
+            instruction = self.memory.get_instruction(self.pc_address)
+            if instruction.to_add != address:
+                # The VM stopped or was interrupted.
+                return
+            if value is None or self.memory[instruction.from_add] == value:
+                return
             self.next()
 
     def add_watcher(self, name, address, bytes_count=1):
@@ -280,6 +384,21 @@ class JollyShell(cmd.Cmd):
         """
         self.ijolly.next(*self.parse_args(arg))
 
+    def do_back(self, arg):
+        """Go back a number of instructions specified by the argument: BACK 10 (by default a single instruction).
+        """
+        self.ijolly.back(*self.parse_args(arg))
+
+    def do_goto(self, arg):
+        """Go back or forward to the step specified by the argument, the number of instructions executed since the image was loaded: GOTO 1000.
+        """
+        self.ijolly.goto(*self.parse_args(arg))
+
+    def do_step(self, arg):
+        """Print the current step, the number of instructions executed since the image was loaded.
+        """
+        self.ijolly.print_step()
+
     def do_primready(self, arg):
         print(self.vm.is_primitive_ready())
     
@@ -357,6 +476,25 @@ class JollyShell(cmd.Cmd):
               "Synopsis: hexdump address [lines default: 16]\n\n"
               "Example: ihexdump 0x09002F 32")
 
+    def do_profile(self, arg):
+        self.ijolly.load_profile(arg)
+        print("Loaded profile of {0} instructions.".format(self.ijolly.profile.instructions))
+
+    def help_profile(self):
+        print("Loads a profile written by jolly --profile=<file>.\n"
+              "Once loaded, hexdump prints the executions of the instructions of each line.\n\n"
+              "Synopsis: profile file\n\n"
+              "Example: profile hello_world.prof")
+
+    def do_hotspots(self, arg):
+        self.ijolly.print_hot_spots(*self.parse_args(arg))
+
+    def help_hotspots(self):
+        print("Prints the instructions executed the most according to the loaded profile,\n"
+              "with the closest label before them.\n\n"
+              "Synopsis: hotspots [count default: 10]\n\n"
+              "Example: hotspots 20")
+
     def do_watch(self, arg):
         self.ijolly.add_watcher(*self.parse_args(arg))
 
@@ -422,6 +560,21 @@ def load_labels(file_path):
         for row in csv_reader:
             labels.append(Label(row[0], int(row[1][2:], 16)))
     return labels
+
+def load_profile(file_path):
+    profile = Profile()
+    with open(file_path) as profile_file:
+        for line in profile_file:
+            fields = line.split()
+            if not fields or fields[0].startswith("#"):
+                continue
+            if fields[0] == "instructions":
+                profile.instructions = int(fields[1])
+            elif fields[0] == "pc":
+                profile.counts[int(fields[1], 16)] = int(fields[2])
+            elif fields[0] == "edge":
+                profile.edges[(int(fields[1], 16), int(fields[2], 16))] = int(fields[3])
+    return profile
             
 
 if __name__ == '__main__':
@@ -436,6 +589,8 @@ if __name__ == '__main__':
         ijolly.load(image_file)
         if os.path.exists(image_file+".meta"):
             ijolly.labels = load_labels(image_file+".meta")
+        if os.path.exists(image_file+".prof"):
+            ijolly.load_profile(image_file+".prof")
 
     shell = JollyShell(ijolly)
     shell.cmdloop()
\ No newline at end of file
@@ -1,12 +1,29 @@
 import os
 from cffi import FFI
 
+try:
+    import numpy
+except ImportError:
+    # Only the array helpers need it.
+    numpy = None
+
+ADDRESS_SIZE = 3
+INSTRUCTION_SIZE = 3 * ADDRESS_SIZE
+# Bytes compared at once by diff_snapshots.
+SNAPSHOT_CHUNK_SIZE = 4096
+
 def memory_h_file(jolly_root):
     return os.path.join(jolly_root, "src/lib/includes/memory.h")
 
 def vm_h_file(jolly_root):
     return os.path.join(jolly_root, "src/lib/includes/vm.h")
 
+def history_h_file(jolly_root):
+    return os.path.join(jolly_root, "src/lib/includes/history.h")
+
+def run_until_h_file(jolly_root):
+    return os.path.join(jolly_root, "src/lib/includes/run_until.h")
+
 def lib_file(jolly_root):
     return os.path.join(jolly_root, "build/src/lib/libjolly.1.dylib")
 
@@ -34,6 +51,24 @@ def clean_vm_h_content(file_content):
     "#endif", "#define NULL_VM (struct virtual_machine *) NULL"]
     return clean_source_file(file_content, to_remove)
 
+def clean_history_h_content(file_content):
+    to_remove = ['''#ifndef HISTORY_H
+
+#define HISTORY_H
+
+#include "vm.h"''',
+    "#endif"]
+    return clean_source_file(file_content, to_remove)
+
+def clean_run_until_h_content(file_content):
+    to_remove = ['''#ifndef RUN_UNTIL_H
+
+#define RUN_UNTIL_H
+
+#include "vm.h"''',
+    "#endif"]
+    return clean_source_file(file_content, to_remove)
+
 def build_ffi(jolly_root):
     ffi = FFI()
 
@@ -43,9 +78,59 @@ def build_ffi(jolly_root):
     with open(vm_h_file(jolly_root)) as f:
         ffi.cdef(clean_vm_h_content(f.read()))
 
+    with open(history_h_file(jolly_root)) as f:
+        ffi.cdef(clean_history_h_content(f.read()))
+
+    with open(run_until_h_file(jolly_root)) as f:
+        ffi.cdef(clean_run_until_h_content(f.read()))
+
     lib = ffi.dlopen(lib_file(jolly_root))
     return ffi, lib
 
+def require_numpy():
+    if numpy is None:
+        raise RuntimeError("numpy is needed for memory arrays.")
+
+def decode_addresses(data):
+    """ Decodes the consecutive 24-bit big-endian addresses of data, a
+        bytes-like object or a uint8 array whose length is a multiple of 3,
+        into a uint32 array.
+    """
+    require_numpy()
+    words = numpy.frombuffer(data, dtype=numpy.uint8) if not isinstance(data, numpy.ndarray) else data
+    words = words.reshape(-1, ADDRESS_SIZE).astype(numpy.uint32)
+    return words[:, 0] << 16 | words[:, 1] << 8 | words[:, 2]
+
+def decode_instructions(data):
+    """ Decodes the consecutive instructions of data into a (count, 3) uint32
+        array of their from, to and jump addresses.
+    """
+    return decode_addresses(data).reshape(-1, 3)
+
+def diff_snapshots(before, after):
+    """ Returns the (start, end) ranges of the bytes that differ between two
+        snapshots of the same size (see JollyMemory.snapshot), end excluded,
+        in order.
+    """
+    before = memoryview(before).cast("B")
+    after = memoryview(after).cast("B")
+    if len(before) != len(after):
+        raise ValueError("Snapshots of different sizes.")
+    ranges = []
+    for chunk in range(0, len(before), SNAPSHOT_CHUNK_SIZE):
+        chunk_end = min(chunk + SNAPSHOT_CHUNK_SIZE, len(before))
+        # Most chunks are equal, and compared without leaving C.
+        if before[chunk:chunk_end] == after[chunk:chunk_end]:
+            continue
+        for address in range(chunk, chunk_end):
+            if before[address] == after[address]:
+                continue
+            if ranges and ranges[-1][1] == address:
+                ranges[-1] = (ranges[-1][0], address + 1)
+            else:
+                ranges.append((address, address + 1))
+    return ranges
+
 class JollyVM(object):
     def __init__(self, ffi, lib, memory=None):
         self.ffi = ffi
@@ -54,24 +139,77 @@ class JollyVM(object):
         if self.lib.new_vm(self.__c_vm_pp) != self.lib.VM_OK:
             raise Error("Error while instantiating VM.")
         self.memory = memory
+        self.history_enabled = False
     
     def __c_vm_pointer(self):
         return self.__c_vm_pp[0]
 
     def set_memory(self, memory):
         self.lib.set_memory(self.__c_vm_pointer(), memory._JollyMemory__c_memory_p)
+        memory.attach_vm(self.__c_vm_pointer())
         self.memory = memory
     
     def get_pc_address(self):
         return self.lib.get_pc_address(self.__c_vm_pointer())
 
     def execute_instruction(self):
-        self.lib.execute_instruction(self.__c_vm_pointer())
+        if self.history_enabled:
+            self.lib.execute_recorded_instructions(self.__c_vm_pointer(), 1)
+        else:
+            self.lib.execute_instruction(self.__c_vm_pointer())
     
     def execute_instructions(self, count=1):
         for _ in range(count):
             self.execute_instruction()
 
+    def run_until(self, breakpoints=(), watches=(), primitive_id=None,
+                  any_primitive=False, max_instructions=0):
+        """ Executes instructions in C until the pc is one of breakpoints, an
+            instruction is about to write one of the (address, length) ranges
+            of watches, the primitive primitive_id (any primitive if
+            any_primitive) is ready, or max_instructions were executed (no
+            limit if 0). Returns the run_until_status of run_until.
+        """
+        conditions_pp = self.ffi.new("struct run_conditions **")
+        if self.lib.new_run_conditions(conditions_pp) != self.lib.VM_OK:
+            raise RuntimeError("Error while allocating run conditions.")
+        conditions = conditions_pp[0]
+        try:
+            for address in breakpoints:
+                if self.lib.add_breakpoint(conditions, address) != self.lib.VM_OK:
+                    raise RuntimeError("Error while adding a breakpoint.")
+            for address, length in watches:
+                if self.lib.add_write_watch(conditions, address, length) != self.lib.VM_OK:
+                    raise RuntimeError("Error while watching writes.")
+            if any_primitive:
+                conditions.primitive_id = self.lib.RUN_UNTIL_ANY_PRIMITIVE
+            elif primitive_id is not None:
+                conditions.primitive_id = primitive_id
+            conditions.max_instructions = max_instructions
+            return self.lib.run_until(self.__c_vm_pointer(), conditions)
+        finally:
+            self.lib.free_run_conditions(conditions)
+
+    def enable_history(self, max_size=0):
+        """ Records the instructions executed from now on, so that the VM can
+            be rewound to any of them.
+        """
+        if self.lib.enable_vm_history(self.__c_vm_pointer(), max_size) != self.lib.VM_OK:
+            raise RuntimeError("Error while enabling the history of the VM.")
+        self.history_enabled = True
+
+    def history_step(self):
+        return self.lib.get_history_step(self.__c_vm_pointer())
+
+    def history_first_step(self):
+        return self.lib.get_history_first_step(self.__c_vm_pointer())
+
+    def rewind(self, step):
+        """ Brings the VM back to step, returns False if it is not in the
+            history.
+        """
+        return self.lib.rewind_vm(self.__c_vm_pointer(), step) == self.lib.VM_OK
+
     def load_pc(self):
         self.lib.load_pc(self.__c_vm_pointer())
 
@@ -85,6 +223,10 @@ class JollyVM(object):
         self.lib.load_image(self.__c_vm_pointer(), filename.encode("ascii"))
         self.load_pc()
         self.memory = JollyMemory(self.ffi, self.lib, self.__c_vm_pointer().memory)
+        self.memory.attach_vm(self.__c_vm_pointer())
+        if self.history_enabled:
+            # The memory was replaced.
+            self.enable_history()
 
 class JollyInstruction(object):
     def __init__(self, address, from_add, to_add, jmp_add):
@@ -101,17 +243,75 @@ class JollyMemory(object):
             self.__c_memory_p = ffi.new("WORD[MAX_MEMORY_SIZE]")
         else:
             self.__c_memory_p = cmemory
+        # Reads go through this view of the C memory instead of a cffi call
+        # per byte.
+        self.__view = memoryview(ffi.buffer(self.__c_memory_p, lib.MAX_MEMORY_SIZE))
+        self.__c_vm_p = None
+
+    def attach_vm(self, c_vm_p):
+        """ Sets the VM executing this memory, so that it is notified of the
+            writes done from Python.
+        """
+        self.__c_vm_p = c_vm_p
 
     def __getitem__(self, address):
-        return self.__c_memory_p[address]
+        """ Returns the byte at address, or the bytes of a slice of addresses.
+        """
+        if isinstance(address, slice):
+            return self.__view[address].tobytes()
+        return self.__view[address]
 
     def __setitem__(self, address, byte):
         self.__c_memory_p[address] = byte
+        self.notify_write(address, 1)
+
+    def __len__(self):
+        return len(self.__view)
+
+    def notify_write(self, address, length):
+        """ Tells the VM the length bytes starting at address were written,
+            which writes to view() or array() do not.
+        """
+        if self.__c_vm_p is not None:
+            self.lib.notify_memory_write(self.__c_vm_p, address, length)
+
+    def view(self):
+        """ Returns a memoryview of the memory of the VM, without copying it.
+        """
+        return self.__view
+
+    def array(self):
+        """ Returns a uint8 numpy array of the memory of the VM, without
+            copying it.
+        """
+        require_numpy()
+        return numpy.frombuffer(self.__view, dtype=numpy.uint8)
+
+    def snapshot(self):
+        """ Returns a copy of the memory, to compare with diff_snapshots.
+        """
+        return self.__view.tobytes()
+
+    def changes_since(self, snapshot):
+        """ Returns the (start, end) ranges of bytes written since snapshot.
+        """
+        return diff_snapshots(snapshot, self.__view)
 
     def get_address(self, address):
-        return (self[address] << 16) \
-                |  (self[address+1] << 8) \
-                | self[address+2]
+        return int.from_bytes(self.__view[address:address+ADDRESS_SIZE], "big")
+
+    def get_addresses(self, address, count):
+        """ Returns the count consecutive addresses starting at address as a
+            uint32 numpy array.
+        """
+        return decode_addresses(self.array()[address:address+count*ADDRESS_SIZE])
+
+    def get_instructions(self, address, count):
+        """ Returns the count consecutive instructions starting at address as
+            a (count, 3) uint32 numpy array of their from, to and jump
+            addresses.
+        """
+        return decode_instructions(self.array()[address:address+count*INSTRUCTION_SIZE])
 
     def store_address(self, address, address_to_store):
         self[address] = (address_to_store & 0xFF0000 >> 16)
@@ -44,3 +44,81 @@ def test_next_count(VMMock):
 
     assert vm.execute_instruction.call_count == 5
 
+
+@patch('jollypy.JollyVM')
+def test_back(VMMock):
+    vm = jollypy.JollyVM()
+    vm.history_step.return_value = 10
+    vm.get_pc_address.return_value = 0x20
+    vm.history_first_step.return_value = 0
+    vm.rewind.return_value = True
+    interactive_jolly = ijolly.InteractiveJolly(vm)
+
+    interactive_jolly.back(3)
+
+    vm.rewind.assert_called_once_with(7)
+
+@patch('jollypy.JollyVM')
+def test_back_stops_at_first_step(VMMock):
+    vm = jollypy.JollyVM()
+    vm.history_step.return_value = 10
+    vm.get_pc_address.return_value = 0x20
+    vm.history_first_step.return_value = 4
+    vm.rewind.return_value = True
+    interactive_jolly = ijolly.InteractiveJolly(vm)
+
+    interactive_jolly.back(100)
+
+    vm.rewind.assert_called_once_with(4)
+
+@patch('jollypy.JollyVM')
+def test_goto_future_step(VMMock):
+    vm = jollypy.JollyVM()
+    vm.history_step.return_value = 10
+    vm.get_pc_address.return_value = 0x20
+    interactive_jolly = ijolly.InteractiveJolly(vm)
+
+    interactive_jolly.goto(15)
+
+    assert vm.execute_instruction.call_count == 5
+    assert vm.rewind.call_count == 0
+
+@patch('jollypy.JollyVM')
+def test_nextprim_runs_until_any_primitive(VMMock):
+    vm = jollypy.JollyVM()
+    interactive_jolly = ijolly.InteractiveJolly(vm)
+
+    interactive_jolly.nextprim()
+
+    vm.run_until.assert_called_once_with(any_primitive=True)
+    assert vm.execute_instruction.call_count == 0
+
+@patch('jollypy.JollyVM')
+def test_nextprim_runs_until_primitive_id(VMMock):
+    vm = jollypy.JollyVM()
+    interactive_jolly = ijolly.InteractiveJolly(vm)
+
+    interactive_jolly.nextprim(3)
+
+    vm.run_until.assert_called_once_with(primitive_id=3)
+
+@patch('jollypy.JollyVM')
+def test_next_up_to_runs_until_breakpoint(VMMock):
+    vm = jollypy.JollyVM()
+    interactive_jolly = ijolly.InteractiveJolly(vm)
+
+    interactive_jolly.next_up_to(0x40)
+
+    vm.run_until.assert_called_once_with(breakpoints=[0x40])
+
+@patch('jollypy.JollyVM')
+def test_next_up_to_steps_when_tracing(VMMock):
+    vm = jollypy.JollyVM()
+    vm.get_pc_address.side_effect = [0x10, 0x10, 0x20, 0x20, 0x30]
+    interactive_jolly = ijolly.InteractiveJolly(vm)
+    interactive_jolly.enable_trace = True
+
+    interactive_jolly.next_up_to(0x30)
+
+    assert vm.execute_instruction.call_count == 2
+    assert vm.run_until.call_count == 0
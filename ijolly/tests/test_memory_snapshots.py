@@ -0,0 +1,46 @@
+import sys
+import os
+
+sys.path.insert(1, os.path.join(os.path.dirname(__file__), '..' , 'src'))
+
+import pytest
+
+import jollypy
+
+def test_diff_snapshots_of_equal_memories():
+    memory = bytes(range(256)) * 64
+
+    assert jollypy.diff_snapshots(memory, bytearray(memory)) == []
+
+def test_diff_snapshots_merges_adjacent_bytes():
+    before = bytes(3 * jollypy.SNAPSHOT_CHUNK_SIZE)
+    after = bytearray(before)
+    after[5] = 1
+    after[6] = 2
+    after[8] = 3
+    # Across two chunks.
+    after[jollypy.SNAPSHOT_CHUNK_SIZE - 1] = 4
+    after[jollypy.SNAPSHOT_CHUNK_SIZE] = 5
+    after[-1] = 6
+
+    assert jollypy.diff_snapshots(before, after) == [
+        (5, 7), (8, 9),
+        (jollypy.SNAPSHOT_CHUNK_SIZE - 1, jollypy.SNAPSHOT_CHUNK_SIZE + 1),
+        (3 * jollypy.SNAPSHOT_CHUNK_SIZE - 1, 3 * jollypy.SNAPSHOT_CHUNK_SIZE)]
+
+def test_diff_snapshots_of_different_sizes():
+    with pytest.raises(ValueError):
+        jollypy.diff_snapshots(bytes(4), bytes(5))
+
+def test_decode_addresses():
+    pytest.importorskip("numpy")
+    addresses = jollypy.decode_addresses(bytes([0x12, 0x34, 0x56, 0x00, 0x00, 0x01, 0xFF, 0xFF, 0xFF]))
+
+    assert list(addresses) == [0x123456, 0x000001, 0xFFFFFF]
+
+def test_decode_instructions():
+    pytest.importorskip("numpy")
+    instructions = jollypy.decode_instructions(bytes(range(18)))
+
+    assert instructions.shape == (2, 3)
+    assert list(instructions[1]) == [0x090A0B, 0x0C0D0E, 0x0F1011]
@@ -0,0 +1,54 @@
+import sys
+import os
+
+sys.path.insert(1, os.path.join(os.path.dirname(__file__), '..' , 'src'))
+
+import ijolly
+
+PROFILE_CONTENT = """# jolly profile
+instructions 5
+pc 0x000020 2
+pc 0x000030 2
+pc 0x000010 1
+edge 0x000020 0x000030 2
+edge 0x000030 0x000040 2
+edge 0x000010 0x000020 1
+"""
+
+def write_profile(tmp_path):
+    profile_file = tmp_path / "test.prof"
+    profile_file.write_text(PROFILE_CONTENT)
+    return str(profile_file)
+
+def test_load_profile(tmp_path):
+    profile = ijolly.load_profile(write_profile(tmp_path))
+
+    assert profile.instructions == 5
+    assert profile.count(0x20) == 2
+    assert profile.count(0x40) == 0
+    assert profile.edges[(0x30, 0x40)] == 2
+
+def test_hot_spots():
+    profile = ijolly.Profile(5, {0x10: 1, 0x20: 2, 0x30: 2})
+
+    assert profile.hot_spots(2) == [(0x20, 2), (0x30, 2)]
+
+def test_line_annotation_without_profile():
+    interactive_jolly = ijolly.InteractiveJolly(None, [ijolly.Label("start", 0x12)])
+
+    assert interactive_jolly.line_annotation(0x10, 16) == " start"
+    assert interactive_jolly.line_annotation(0x20, 16) == ""
+
+def test_line_annotation_with_profile(tmp_path):
+    interactive_jolly = ijolly.InteractiveJolly(None, [ijolly.Label("loop", 0x20)])
+    interactive_jolly.load_profile(write_profile(tmp_path))
+
+    assert interactive_jolly.line_annotation(0x10, 16) == " 1x"
+    assert interactive_jolly.line_annotation(0x20, 16) == " loop 2x"
+
+def test_label_of():
+    interactive_jolly = ijolly.InteractiveJolly(None, [ijolly.Label("start", 0x10), ijolly.Label("loop", 0x20)])
+
+    assert interactive_jolly.label_of(0x8) is None
+    assert interactive_jolly.label_of(0x20) == "loop"
+    assert interactive_jolly.label_of(0x29) == "loop+0x9"
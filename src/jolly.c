@@ -1,38 +1,674 @@
 #include "vm.h"
 #include "memory.h"
 #include "primitives.h"
+#include "trace.h"
+#include "idioms.h"
+#include "scheduler.h"
+#include "image.h"
+#include "image_format.h"
+#include "profile.h"
+#include "stats.h"
+#include "io_log.h"
 #include "log.h"
 
 #define ENABLE_LOGGING
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <signal.h>
+
+#define ENGINE_OPTION "--engine="
+#define IDIOM_REPORT_OPTION "--idiom-report"
+#define JOBS_OPTION "--jobs="
+#define STARTUP_TIMING_OPTION "--startup-timing"
+#define CHECKPOINT_ON_SIGNAL_OPTION "--checkpoint-on-signal="
+#define RESTORE_OPTION "--restore="
+#define CONVERT_OPTION "--convert="
+#define PLUGIN_OPTION "--plugin="
+#define ASYNC_IO_OPTION "--async-io"
+#define PROFILE_OPTION "--profile="
+#define STATS_OPTION "--stats"
+#define LOG_LEVEL_OPTION "--log-level="
+#define RECORD_IO_OPTION "--record-io="
+#define REPLAY_IO_OPTION "--replay-io="
+#define SHARED_IMAGE_OPTION "--shared-image="
+
+// Size of the names of checkpoint files, <prefix>.<index>.
+#define CHECKPOINT_FILE_NAME_SIZE 4096
+
+// Size of the names of the shared images of a batch, <name>-<index>.
+#define SHARED_IMAGE_NAME_SIZE 256
+
+// Number of VMs loaded per worker in batch mode, so that a worker always
+// has a VM to steal or to switch to while another one is parked.
+#define JOBS_PER_WORKER 2
+
+/**
+ * Execution engines that can be selected from the command line.
+ */
+struct engine{
+    char *name;
+    int (*run)(struct virtual_machine *vm);
+};
+
+static struct engine engines[] = {
+    { "reference", run },
+    { "fast", run_fast },
+    { "trace", run_trace },
+};
+
+#define ENGINES_COUNT (sizeof(engines) / sizeof(struct engine))
+
+/**
+ * Log levels that can be selected from the command line, in the order of
+ * the log.h levels.
+ */
+static char *log_levels[] = { "trace", "debug", "info", "warn", "error", "fatal" };
+
+#define LOG_LEVELS_COUNT (sizeof(log_levels) / sizeof(char *))
+
+static void print_usage(void){
+    fprintf(stderr, "Usage: jolly [" ENGINE_OPTION "<engine>] [" IDIOM_REPORT_OPTION "] ["
+        STARTUP_TIMING_OPTION "] <image>\n");
+    fprintf(stderr, "       jolly " PROFILE_OPTION "<profile> <image>\n");
+    fprintf(stderr, "       jolly " JOBS_OPTION "<workers> [" ASYNC_IO_OPTION "] ["
+        SHARED_IMAGE_OPTION "<name>] <image>...\n");
+    fprintf(stderr, "       jolly [" CHECKPOINT_ON_SIGNAL_OPTION "<prefix>] <image> | "
+        RESTORE_OPTION "<prefix>\n");
+    fprintf(stderr, "       jolly " CONVERT_OPTION "<segmented image> <image>\n");
+    fprintf(stderr, "Every form accepts " PLUGIN_OPTION "<shared library>, loading extended primitives.\n");
+    fprintf(stderr, "The running forms accept " STATS_OPTION ", printing the primitives called on exit.\n");
+    fprintf(stderr, "Every form accepts " LOG_LEVEL_OPTION "<level>, logging from trace to fatal in the\n"
+        "background (default: error).\n");
+    fprintf(stderr, "Running a single image accepts " RECORD_IO_OPTION "<log>, writing the results of its\n"
+        "I/O primitives, or " REPLAY_IO_OPTION "<log>, reading them back instead of its streams.\n");
+    fprintf(stderr, "With " SHARED_IMAGE_OPTION "<name>, the images of a batch are shared with the other\n"
+        "processes using the same name: the first distinct image is /<name>, the next ones\n"
+        "/<name>-1, /<name>-2... The process that created them removes their names on exit.\n");
+    fprintf(stderr, "Engines:");
+    for(unsigned int i = 0; i < ENGINES_COUNT; i++){
+        fprintf(stderr, " %s", engines[i].name);
+    }
+    fprintf(stderr, " (default: %s)\n", engines[0].name);
+}
+
+/**
+ * Returns the log.h level named name, -1 if there is none.
+ */
+static int find_log_level(char *name){
+    for(unsigned int i = 0; i < LOG_LEVELS_COUNT; i++){
+        if(strcmp(log_levels[i], name) == 0){
+            return i;
+        }
+    }
+    return -1;
+}
+
+static struct engine *find_engine(char *name){
+    for(unsigned int i = 0; i < ENGINES_COUNT; i++){
+        if(strcmp(engines[i].name, name) == 0){
+            return &engines[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * The VM run with --checkpoint-on-signal and the last signal received.
+ */
+static struct virtual_machine *checkpointed_vm;
+static volatile sig_atomic_t checkpoint_signal;
+
+static void request_checkpoint(int signal){
+    checkpoint_signal = signal;
+    vm_interrupt(checkpointed_vm);
+}
+
+/**
+ * Runs vm, writing its next checkpoint to <prefix>.<index> on SIGUSR1, or
+ * on SIGINT and SIGTERM before exiting so that it can be restored later.
+ */
+static int run_with_checkpoints(struct virtual_machine *vm, char *prefix){
+    char file_name[CHECKPOINT_FILE_NAME_SIZE];
+    struct sigaction action;
+
+    checkpointed_vm = vm;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_checkpoint;
+    // A VM waiting for input is checkpointed once the read returns.
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    while(run_for(vm, RUN_FOR_UNLIMITED, RUN_FOR_UNLIMITED) == RUN_FOR_INTERRUPTED){
+        snprintf(file_name, sizeof(file_name), "%s.%u", prefix, vm->checkpoints_count);
+        if(write_checkpoint(vm, file_name) != VM_OK){
+            fprintf(stderr, "Failed to write checkpoint %s.\n", file_name);
+            return -1;
+        }
+        fprintf(stderr, "Wrote checkpoint %s.\n", file_name);
+        if(checkpoint_signal != SIGUSR1){
+            return 0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Restores the VM from the chain <prefix>.0, <prefix>.1... written by
+ * --checkpoint-on-signal.
+ */
+static int restore_from_prefix(struct virtual_machine **vm, char *prefix){
+    char **file_names;
+    unsigned int count;
+    int result;
+
+    file_names = NULL;
+    count = 0;
+    while(1){
+        char **grown;
+        char file_name[CHECKPOINT_FILE_NAME_SIZE];
+        snprintf(file_name, sizeof(file_name), "%s.%u", prefix, count);
+        if(access(file_name, R_OK) != 0){
+            break;
+        }
+        grown = (char **)realloc(file_names, (count + 1) * sizeof(char *));
+        if(grown == NULL){
+            break;
+        }
+        file_names = grown;
+        file_names[count++] = strdup(file_name);
+    }
+    result = restore_checkpoint(vm, file_names, count);
+    for(unsigned int i = 0; i < count; i++){
+        free(file_names[i]);
+    }
+    free(file_names);
+    return result;
+}
+
+/**
+ * Runs vm, counting the executions of its instructions, then writes them to
+ * profile_file_name and prints the hottest ones.
+ */
+static int run_with_profile(struct virtual_machine *vm, char *profile_file_name){
+    struct profile *profile;
+    int result;
+
+    if(new_profile(&profile) != VM_OK){
+        fprintf(stderr, "Failed to allocate profile.\n");
+        return -1;
+    }
+    result = 0;
+    if(run_profile(vm, profile) != VM_OK){
+        fprintf(stderr, "Failed to count every instruction, the profile is partial.\n");
+        result = -1;
+    }
+    if(write_profile(profile, profile_file_name) != VM_OK){
+        fprintf(stderr, "Failed to write profile %s.\n", profile_file_name);
+        result = -1;
+    }
+    print_profile_report(profile, stderr, PROFILE_REPORT_COUNT);
+    free_profile(profile);
+    return result;
+}
+
+/**
+ * A VM of a batch and the buffer collecting its standard output, written
+ * at once when it stops so that the outputs of the jobs do not interleave.
+ */
+struct job{
+    struct virtual_machine *vm;
+    FILE *output_stream;
+    char *output;
+    size_t output_size;
+};
+
+/**
+ * Images run by --jobs, loaded as VMs stop.
+ */
+struct batch{
+    struct scheduler *scheduler;
+    char **image_file_names;
+    // Image of each file name, shared by the duplicate names, or NULL if the
+    // file is loaded by each job.
+    struct vm_image **images;
+    // Name of the shared memory objects of the images, NULL if they are not
+    // shared with other processes.
+    char *shared_name;
+    unsigned int images_count;
+    unsigned int next_image;
+    struct job *jobs;
+    unsigned int jobs_count;
+    unsigned int failures;
+    // Value of the async_io field of the VMs.
+    int async_io;
+    // Sum of the statistics of the VMs stopped, NULL if they are not
+    // counted.
+    struct vm_stats *stats;
+    pthread_mutex_t lock;
+};
+
+/**
+ * Loads the next image of the batch in job and adds it to the scheduler.
+ * job->vm stays NULL when there is no image left.
+ */
+static void start_next_job(struct batch *batch, struct job *job){
+    struct virtual_machine *vm;
+    struct vm_image *image;
+    char *image_file_name;
+    int result;
+
+    while(1){
+        pthread_mutex_lock(&batch->lock);
+        job->vm = NULL;
+        if(batch->next_image == batch->images_count){
+            pthread_mutex_unlock(&batch->lock);
+            return;
+        }
+        image = batch->images[batch->next_image];
+        image_file_name = batch->image_file_names[batch->next_image++];
+        pthread_mutex_unlock(&batch->lock);
+
+        if(image != NULL){
+            // Forking only maps the image, its pages are shared by the jobs.
+            result = fork_from_image(&vm, image);
+        } else if((result = new_vm(&vm)) == VM_OK){
+            result = load_image(vm, image_file_name);
+            if(result == VM_OK){
+                load_pc(vm);
+            }
+        }
+        if(vm == NULL){
+            fprintf(stderr, "Failed to create VM for %s.\n", image_file_name);
+        } else if(result != VM_OK){
+            fprintf(stderr, "Failed to load VM memory from %s.\n", image_file_name);
+        } else if((job->output_stream = open_memstream(&job->output, &job->output_size)) == NULL){
+            fprintf(stderr, "Failed to buffer the output of %s.\n", image_file_name);
+        } else{
+            vm->file_streams[PRIMITIVE_FILE_STREAM_STDOUT] = job->output_stream;
+            vm->async_io = batch->async_io;
+            if(batch->stats != NULL && enable_vm_stats(vm) != VM_OK){
+                fprintf(stderr, "Failed to count the primitives of %s.\n", image_file_name);
+            }
+            // Set before the VM can stop.
+            pthread_mutex_lock(&batch->lock);
+            job->vm = vm;
+            pthread_mutex_unlock(&batch->lock);
+            if(scheduler_add(batch->scheduler, vm) == VM_OK){
+                return;
+            }
+            fclose(job->output_stream);
+            free(job->output);
+            fprintf(stderr, "Failed to schedule %s.\n", image_file_name);
+        }
+        if(vm != NULL){
+            free_vm(vm);
+        }
+        pthread_mutex_lock(&batch->lock);
+        batch->failures++;
+        pthread_mutex_unlock(&batch->lock);
+    }
+}
+
+static void finish_job(struct scheduler *scheduler, struct virtual_machine *vm, void *user_data){
+    struct batch *batch = (struct batch *)user_data;
+    struct job *job;
+
+    job = NULL;
+    pthread_mutex_lock(&batch->lock);
+    for(unsigned int i = 0; i < batch->jobs_count && job == NULL; i++){
+        if(batch->jobs[i].vm == vm){
+            job = &batch->jobs[i];
+        }
+    }
+    if(batch->stats != NULL){
+        add_vm_stats(batch->stats, vm);
+    }
+    pthread_mutex_unlock(&batch->lock);
+    fclose(job->output_stream);
+    vm->file_streams[PRIMITIVE_FILE_STREAM_STDOUT] = stdout;
+    fwrite(job->output, 1, job->output_size, stdout);
+    fflush(stdout);
+    free(job->output);
+    free_vm(vm);
+    start_next_job(batch, job);
+}
+
+/**
+ * Writes in name the name of the shared memory object of the image_index-th
+ * distinct image of batch.
+ */
+static void get_shared_image_name(struct batch *batch, unsigned int image_index, char *name){
+    if(image_index == 0){
+        snprintf(name, SHARED_IMAGE_NAME_SIZE, "/%s", batch->shared_name);
+    } else{
+        snprintf(name, SHARED_IMAGE_NAME_SIZE, "/%s-%u", batch->shared_name, image_index);
+    }
+}
+
+/**
+ * Creates the image of each distinct file name in batch->image_file_names,
+ * shared with the other processes when batch->shared_name is set.
+ * The files that cannot be read are left to the jobs, which report them.
+ */
+static void create_batch_images(struct batch *batch){
+    char shared_name[SHARED_IMAGE_NAME_SIZE];
+    unsigned int distinct_count = 0;
+
+    batch->images = (struct vm_image **)calloc(batch->images_count, sizeof(struct vm_image *));
+    if(batch->images == NULL){
+        fprintf(stderr, "Failed to allocate images, aborting.\n");
+        exit(-1);
+    }
+    for(unsigned int i = 0; i < batch->images_count; i++){
+        unsigned int j = 0;
+        while(j < i && strcmp(batch->image_file_names[j], batch->image_file_names[i]) != 0){
+            j++;
+        }
+        if(j < i){
+            batch->images[i] = batch->images[j];
+            continue;
+        }
+        if(batch->shared_name != NULL){
+            get_shared_image_name(batch, distinct_count, shared_name);
+        }
+        distinct_count++;
+        if(new_image(&batch->images[i], batch->image_file_names[i],
+            batch->shared_name != NULL ? shared_name : NULL) != VM_OK){
+            batch->images[i] = NULL;
+        }
+    }
+}
+
+/**
+ * Frees the images of batch, and removes the names of the shared ones this
+ * process created: the processes still using them keep their pages.
+ */
+static void free_batch_images(struct batch *batch){
+    char shared_name[SHARED_IMAGE_NAME_SIZE];
+    unsigned int distinct_count = 0;
+
+    for(unsigned int i = 0; i < batch->images_count; i++){
+        unsigned int j = 0;
+        while(j < i && strcmp(batch->image_file_names[j], batch->image_file_names[i]) != 0){
+            j++;
+        }
+        if(j < i){
+            continue;
+        }
+        if(batch->images[i] != NULL && batch->images[i]->created){
+            get_shared_image_name(batch, distinct_count, shared_name);
+            unlink_shared_image(shared_name);
+        }
+        distinct_count++;
+        if(batch->images[i] != NULL){
+            free_image(batch->images[i]);
+        }
+    }
+    free(batch->images);
+}
+
+/**
+ * Runs the images on workers_count threads, or one per processor if 0.
+ * With async_io, their I/O primitives that may block run on I/O threads.
+ * With stats, the primitives of all the images are printed once they
+ * stopped. With shared_name, the images are shared with other processes.
+ */
+static int run_batch(char **image_file_names, unsigned int images_count, unsigned int workers_count,
+    int async_io, int stats, char *shared_name){
+    struct batch batch;
+    struct vm_stats total;
+    unsigned long long start_time;
+
+    if(workers_count == 0){
+        workers_count = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    // Parked VMs are detected by polling stdin, which must not hide data in
+    // its buffer.
+    setvbuf(stdin, NULL, _IONBF, 0);
+
+    batch.image_file_names = image_file_names;
+    batch.images_count = images_count;
+    batch.shared_name = shared_name;
+    batch.next_image = 0;
+    batch.failures = 0;
+    batch.async_io = async_io;
+    memset(&total, 0, sizeof(total));
+    batch.stats = stats ? &total : NULL;
+    start_time = get_monotonic_time();
+    create_batch_images(&batch);
+    batch.jobs_count = workers_count * JOBS_PER_WORKER;
+    batch.jobs = (struct job *)calloc(batch.jobs_count, sizeof(struct job));
+    pthread_mutex_init(&batch.lock, NULL);
+    if(batch.jobs == NULL || new_scheduler(&batch.scheduler, workers_count,
+        SCHEDULER_DEFAULT_QUANTUM, finish_job, &batch) != VM_OK){
+        fprintf(stderr, "Failed to create scheduler, aborting.\n");
+        exit(-1);
+    }
+    for(unsigned int i = 0; i < batch.jobs_count; i++){
+        start_next_job(&batch, &batch.jobs[i]);
+    }
+    if(scheduler_run(batch.scheduler) != VM_OK){
+        fprintf(stderr, "Failed to start workers, aborting.\n");
+        exit(-1);
+    }
+    free_scheduler(batch.scheduler);
+    if(batch.stats != NULL){
+        // The primitives of the workers add up to more than the time elapsed.
+        print_vm_stats(batch.stats, stderr, (get_monotonic_time() - start_time) * workers_count);
+    }
+    free_batch_images(&batch);
+    free(batch.jobs);
+    pthread_mutex_destroy(&batch.lock);
+    return batch.failures == 0 ? 0 : -1;
+}
 
 int main(int argc, char ** argv){
     struct virtual_machine *jolly;
+    struct engine *engine;
     char *image_file_name;
+    char **image_file_names;
+    unsigned int images_count;
+    char *checkpoint_prefix, *restore_prefix, *converted_file_name, *profile_file_name;
+    char *record_io_file_name, *replay_io_file_name, *shared_name;
+    char *single_image_option;
+    int idiom_report, workers_count, startup_timing, async_io, stats;
+    unsigned long long start_time, created_time, loaded_time, stopped_time;
 
     log_set_level(LOG_ERROR);
 
-    if(argc != 2){
-        fprintf(stderr, "Incorrect number of arguments. Need to specify image file to run, aborting.");
+    engine = &engines[0];
+    image_file_name = NULL;
+    idiom_report = 0;
+    startup_timing = 0;
+    async_io = 0;
+    stats = 0;
+    checkpoint_prefix = NULL;
+    restore_prefix = NULL;
+    converted_file_name = NULL;
+    profile_file_name = NULL;
+    record_io_file_name = NULL;
+    replay_io_file_name = NULL;
+    shared_name = NULL;
+    single_image_option = NULL;
+    workers_count = -1;
+    image_file_names = (char **)malloc(argc * sizeof(char *));
+    images_count = 0;
+    for(int i = 1; i < argc; i++){
+        if(strncmp(argv[i], ENGINE_OPTION, strlen(ENGINE_OPTION)) == 0){
+            single_image_option = ENGINE_OPTION;
+            engine = find_engine(argv[i] + strlen(ENGINE_OPTION));
+            if(engine == NULL){
+                fprintf(stderr, "Unknown engine %s, aborting.\n", argv[i]);
+                print_usage();
+                exit(-1);
+            }
+        } else if(strcmp(argv[i], IDIOM_REPORT_OPTION) == 0){
+            single_image_option = IDIOM_REPORT_OPTION;
+            idiom_report = 1;
+        } else if(strcmp(argv[i], STATS_OPTION) == 0){
+            stats = 1;
+        } else if(strncmp(argv[i], LOG_LEVEL_OPTION, strlen(LOG_LEVEL_OPTION)) == 0){
+            int level = find_log_level(argv[i] + strlen(LOG_LEVEL_OPTION));
+            if(level < 0){
+                fprintf(stderr, "Unknown log level %s, aborting.\n", argv[i]);
+                print_usage();
+                exit(-1);
+            }
+            // Messages are formatted by a background thread, so that
+            // primitive-heavy images are not slowed down by their logs.
+            log_set_level(level);
+            log_set_async(1);
+        } else if(strcmp(argv[i], ASYNC_IO_OPTION) == 0){
+            async_io = 1;
+        } else if(strcmp(argv[i], STARTUP_TIMING_OPTION) == 0){
+            single_image_option = STARTUP_TIMING_OPTION;
+            startup_timing = 1;
+        } else if(strncmp(argv[i], CHECKPOINT_ON_SIGNAL_OPTION, strlen(CHECKPOINT_ON_SIGNAL_OPTION)) == 0){
+            single_image_option = CHECKPOINT_ON_SIGNAL_OPTION;
+            checkpoint_prefix = argv[i] + strlen(CHECKPOINT_ON_SIGNAL_OPTION);
+        } else if(strncmp(argv[i], RESTORE_OPTION, strlen(RESTORE_OPTION)) == 0){
+            single_image_option = RESTORE_OPTION;
+            restore_prefix = argv[i] + strlen(RESTORE_OPTION);
+        } else if(strncmp(argv[i], CONVERT_OPTION, strlen(CONVERT_OPTION)) == 0){
+            single_image_option = CONVERT_OPTION;
+            converted_file_name = argv[i] + strlen(CONVERT_OPTION);
+        } else if(strncmp(argv[i], PROFILE_OPTION, strlen(PROFILE_OPTION)) == 0){
+            single_image_option = PROFILE_OPTION;
+            profile_file_name = argv[i] + strlen(PROFILE_OPTION);
+        } else if(strncmp(argv[i], RECORD_IO_OPTION, strlen(RECORD_IO_OPTION)) == 0){
+            single_image_option = RECORD_IO_OPTION;
+            record_io_file_name = argv[i] + strlen(RECORD_IO_OPTION);
+        } else if(strncmp(argv[i], REPLAY_IO_OPTION, strlen(REPLAY_IO_OPTION)) == 0){
+            single_image_option = REPLAY_IO_OPTION;
+            replay_io_file_name = argv[i] + strlen(REPLAY_IO_OPTION);
+        } else if(strncmp(argv[i], SHARED_IMAGE_OPTION, strlen(SHARED_IMAGE_OPTION)) == 0){
+            shared_name = argv[i] + strlen(SHARED_IMAGE_OPTION);
+        } else if(strncmp(argv[i], PLUGIN_OPTION, strlen(PLUGIN_OPTION)) == 0){
+            if(load_primitive_plugin(argv[i] + strlen(PLUGIN_OPTION)) != VM_OK){
+                fprintf(stderr, "Failed to load plugin %s, aborting.\n", argv[i] + strlen(PLUGIN_OPTION));
+                exit(-1);
+            }
+        } else if(strncmp(argv[i], JOBS_OPTION, strlen(JOBS_OPTION)) == 0){
+            workers_count = atoi(argv[i] + strlen(JOBS_OPTION));
+        } else if(image_file_names != NULL){
+            image_file_names[images_count++] = argv[i];
+        }
+    }
+
+    // Jobs run with run_for, without the options of a single image.
+    if(workers_count >= 0 && images_count > 0 && single_image_option != NULL){
+        fprintf(stderr, "%s does not apply to " JOBS_OPTION ", aborting.\n", single_image_option);
+        print_usage();
+        exit(-1);
+    }
+    if(workers_count >= 0 && images_count > 0){
+        int result = run_batch(image_file_names, images_count, workers_count, async_io, stats, shared_name);
+        free(image_file_names);
+        return result;
+    }
+    if(shared_name != NULL){
+        fprintf(stderr, "%s only applies to " JOBS_OPTION ", aborting.\n", SHARED_IMAGE_OPTION);
+        print_usage();
+        exit(-1);
+    }
+    if(images_count == 1){
+        image_file_name = image_file_names[0];
+    }
+    free(image_file_names);
+
+    if(image_file_name == NULL && restore_prefix == NULL){
+        fprintf(stderr, "Incorrect number of arguments. Need to specify image file to run, aborting.\n");
+        print_usage();
         exit(-1);
     }
 
-    image_file_name = argv[1];
+    start_time = get_monotonic_time();
+    if(restore_prefix != NULL){
+        created_time = start_time;
+        if(restore_from_prefix(&jolly, restore_prefix) != VM_OK){
+            fprintf(stderr, "Failed to restore VM from %s, aborting.\n", restore_prefix);
+            exit(-1);
+        }
+    } else{
+        if(new_vm(&jolly) != VM_OK){
+            fprintf(stderr, "Failed to create VM, aborting.\n");
+            exit(-1);
+        }
+        created_time = get_monotonic_time();
+        if(load_image(jolly, image_file_name) != VM_OK){
+            fprintf(stderr, "Failed to load VM memory from file, aborting.\n");
+            exit(-1);
+        }
+        load_pc(jolly);
+    }
+    loaded_time = get_monotonic_time();
+    log_debug("Loaded PC=0x%06X", get_pc_address(jolly));
+
+    if(converted_file_name != NULL){
+        if(write_segmented_image(jolly->memory, converted_file_name) != VM_OK){
+            fprintf(stderr, "Failed to write %s, aborting.\n", converted_file_name);
+            exit(-1);
+        }
+        free_vm(jolly);
+        return 0;
+    }
 
-    if(new_vm(&jolly) != VM_OK){
-        fprintf(stderr, "Failed to create VM, aborting.\n");
+    if(stats && enable_vm_stats(jolly) != VM_OK){
+        fprintf(stderr, "Failed to allocate statistics, aborting.\n");
         exit(-1);
     }
-    if(load_image(jolly, image_file_name) != VM_OK){
-        fprintf(stderr, "Failed to load VM memory from file, aborting.\n");
+    if(record_io_file_name != NULL && record_io(jolly, record_io_file_name) != VM_OK){
+        fprintf(stderr, "Failed to create I/O log %s, aborting.\n", record_io_file_name);
         exit(-1);
     }
-    load_pc(jolly);
-    log_debug("Loaded PC=0x%06X", get_pc_address(jolly));
-    
-    run(jolly);
+    if(replay_io_file_name != NULL && replay_io(jolly, replay_io_file_name) != VM_OK){
+        fprintf(stderr, "Failed to read I/O log %s, aborting.\n", replay_io_file_name);
+        exit(-1);
+    }
+    if(checkpoint_prefix != NULL){
+        // Checkpoints are taken between the slices of run_for, the engine
+        // options do not apply.
+        if(run_with_checkpoints(jolly, checkpoint_prefix) != 0){
+            exit(-1);
+        }
+    } else if(profile_file_name != NULL){
+        // Profiles are counted by the reference engine, the engine options
+        // do not apply.
+        if(run_with_profile(jolly, profile_file_name) != 0){
+            exit(-1);
+        }
+    } else{
+        engine->run(jolly);
+    }
+    stopped_time = get_monotonic_time();
+    if(startup_timing){
+        fprintf(stderr, "new_vm: %llu us, load_image: %llu us, run: %llu us\n",
+            (created_time - start_time) / 1000,
+            (loaded_time - created_time) / 1000,
+            (stopped_time - loaded_time) / 1000);
+    }
+    if(stats){
+        struct vm_stats vm_stats;
+        get_vm_stats(jolly, &vm_stats);
+        print_vm_stats(&vm_stats, stderr, stopped_time - loaded_time);
+    }
+    if(idiom_report){
+        // Idioms are only used by the fast engine.
+        print_idiom_report(jolly, stderr);
+    }
+    if(close_io_log(jolly) != VM_OK){
+        fprintf(stderr, "I/O log %s failed.\n", record_io_file_name != NULL ?
+            record_io_file_name : replay_io_file_name);
+        free_vm(jolly);
+        return -1;
+    }
 
     free_vm(jolly);
     return 0;
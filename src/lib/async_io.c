@@ -0,0 +1,187 @@
+#include "async_io.h"
+#include "vm.h"
+#include "primitives.h"
+#include "io_log.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#ifdef ENABLE_LOGGING
+#include "log.h"
+#else
+#include "nolog.h"
+#endif
+
+/**
+ * Queue of the requests waiting for an I/O thread, shared by the process.
+ */
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_not_empty = PTHREAD_COND_INITIALIZER;
+// Signaled when a request completes, for finalize_async_io.
+static pthread_cond_t request_completed = PTHREAD_COND_INITIALIZER;
+static struct async_io_request *queue_head = NULL;
+static struct async_io_request *queue_tail = NULL;
+static unsigned int threads_count = 0;
+
+/* Helpers. ------------------------------------------------------------------*/
+static void *run_io_thread(void *argument){
+    struct async_io_request *request;
+    char byte = 0;
+
+    while(1){
+        pthread_mutex_lock(&queue_lock);
+        while(queue_head == NULL){
+            pthread_cond_wait(&queue_not_empty, &queue_lock);
+        }
+        request = queue_head;
+        queue_head = request->next;
+        if(queue_head == NULL){
+            queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&queue_lock);
+
+        // The VM is suspended: nothing else touches its memory.
+        execute_primitive(request->vm);
+
+        pthread_mutex_lock(&queue_lock);
+        // Signaled before the state changes: from then on,
+        // finalize_async_io may free the request.
+        if(write(request->completion_pipe[1], &byte, 1) != 1){
+            log_error("Failed to signal the completion of a primitive.");
+        }
+        request->state = ASYNC_IO_COMPLETED;
+        pthread_cond_broadcast(&request_completed);
+        pthread_mutex_unlock(&queue_lock);
+    }
+    return NULL;
+}
+
+/**
+ * Starts the I/O threads that are not running yet. Called with queue_lock.
+ * Returns VM_ALLOCATION_FAILED if none is running.
+ */
+static int start_io_threads(void){
+    pthread_t thread;
+
+    while(threads_count < ASYNC_IO_THREADS_COUNT){
+        if(pthread_create(&thread, NULL, run_io_thread, NULL) != 0){
+            log_error("Failed to start I/O thread %u.", threads_count);
+            break;
+        }
+        pthread_detach(thread);
+        threads_count++;
+    }
+    return threads_count > 0 ? VM_OK : VM_ALLOCATION_FAILED;
+}
+
+static struct async_io_request *new_request(struct virtual_machine *vm){
+    struct async_io_request *request;
+
+    request = (struct async_io_request *)malloc(sizeof(struct async_io_request));
+    if(request == NULL){
+        return NULL;
+    }
+    if(pipe(request->completion_pipe) != 0){
+        free(request);
+        return NULL;
+    }
+    request->vm = vm;
+    request->state = ASYNC_IO_IDLE;
+    request->next = NULL;
+    return request;
+}
+
+/* Implementation. -----------------------------------------------------------*/
+int is_async_primitive(struct virtual_machine *vm){
+    // Replayed primitives do not touch the streams.
+    if(!is_primitive_ready(vm) || is_replaying_io(vm)){
+        return 0;
+    }
+    switch(get_primitive_call_id(vm)){
+        case(PRIMITIVE_ID_OPEN_FILE):
+        case(PRIMITIVE_ID_CLOSE_FILE):
+        case(PRIMITIVE_ID_READ_BLOCK):
+        case(PRIMITIVE_ID_WRITE_BLOCK):
+        case(PRIMITIVE_ID_READ_UNTIL):
+            return 1;
+        case(PRIMITIVE_ID_GET_CHAR):
+            // Characters already available are cheaper to read here.
+            return get_blocking_input_descriptor(vm) != -1;
+        default:
+            return 0;
+    }
+}
+
+int submit_async_primitive(struct virtual_machine *vm){
+    if(vm->async_request == NULL){
+        vm->async_request = new_request(vm);
+        if(vm->async_request == NULL){
+            return VM_ALLOCATION_FAILED;
+        }
+    }
+    pthread_mutex_lock(&queue_lock);
+    if(start_io_threads() != VM_OK){
+        pthread_mutex_unlock(&queue_lock);
+        return VM_ALLOCATION_FAILED;
+    }
+    vm->async_request->state = ASYNC_IO_SUBMITTED;
+    vm->async_request->next = NULL;
+    if(queue_tail == NULL){
+        queue_head = vm->async_request;
+    } else{
+        queue_tail->next = vm->async_request;
+    }
+    queue_tail = vm->async_request;
+    pthread_cond_signal(&queue_not_empty);
+    pthread_mutex_unlock(&queue_lock);
+    return VM_OK;
+}
+
+int resume_async_primitive(struct virtual_machine *vm){
+    int state;
+    char byte;
+
+    if(vm->async_request == NULL){
+        return ASYNC_IO_IDLE;
+    }
+    pthread_mutex_lock(&queue_lock);
+    state = vm->async_request->state;
+    if(state == ASYNC_IO_COMPLETED){
+        vm->async_request->state = ASYNC_IO_IDLE;
+    }
+    pthread_mutex_unlock(&queue_lock);
+    if(state == ASYNC_IO_COMPLETED){
+        // Written before the state changed.
+        if(read(vm->async_request->completion_pipe[0], &byte, 1) != 1){
+            log_error("Failed to read the completion of a primitive.");
+        }
+    }
+    return state;
+}
+
+int get_async_completion_descriptor(struct virtual_machine *vm){
+    int state;
+
+    if(vm->async_request == NULL){
+        return -1;
+    }
+    pthread_mutex_lock(&queue_lock);
+    state = vm->async_request->state;
+    pthread_mutex_unlock(&queue_lock);
+    return state == ASYNC_IO_IDLE ? -1 : vm->async_request->completion_pipe[0];
+}
+
+void finalize_async_io(struct virtual_machine *vm){
+    if(vm->async_request == NULL){
+        return;
+    }
+    pthread_mutex_lock(&queue_lock);
+    while(vm->async_request->state == ASYNC_IO_SUBMITTED){
+        pthread_cond_wait(&request_completed, &queue_lock);
+    }
+    pthread_mutex_unlock(&queue_lock);
+    close(vm->async_request->completion_pipe[0]);
+    close(vm->async_request->completion_pipe[1]);
+    free(vm->async_request);
+    vm->async_request = NULL;
+}
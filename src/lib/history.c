@@ -0,0 +1,457 @@
+#include "history.h"
+#include "vm.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Largest record of a step before its ranges: the flags, 2 varints of up to
+// 5 bytes, the overwritten byte and the varint count of ranges.
+#define STEP_RECORD_MAX_SIZE 17
+// Largest header of a range: 2 varints.
+#define RANGE_HEADER_MAX_SIZE 10
+// Initial capacity of the buffers of a history.
+#define HISTORY_INITIAL_CAPACITY 0x10000
+
+/**
+ * A decoded step record.
+ */
+struct history_step{
+    size_t offset;
+    unsigned int flags;
+    unsigned int pc_address;
+    unsigned int write_address;
+    WORD old_byte;
+    unsigned int ranges_count;
+    const unsigned char *ranges;
+    /**
+     * Program counter and written address of the previous step.
+     */
+    unsigned int previous_pc_address;
+    unsigned int previous_write_address;
+};
+
+/* Helpers. ------------------------------------------------------------------*/
+static inline unsigned char *write_varint(unsigned char *output, unsigned int value){
+    while(value >= 0x80){
+        *output++ = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    *output++ = value;
+    return output;
+}
+
+static inline const unsigned char *read_varint(const unsigned char *input, unsigned int *value){
+    unsigned int shift = 0;
+
+    *value = 0;
+    do{
+        *value |= (*input & 0x7F) << shift;
+        shift += 7;
+    } while(*input++ & 0x80);
+    return input;
+}
+
+/**
+ * Encodes the difference between 2 addresses so that small negative
+ * differences are small numbers too.
+ */
+static inline unsigned int encode_delta(unsigned int previous, unsigned int current){
+    int delta = (int)(current - previous);
+    return ((unsigned int)delta << 1) ^ (unsigned int)(delta >> 31);
+}
+
+static inline unsigned int decode_delta(unsigned int previous, unsigned int encoded){
+    return previous + ((encoded >> 1) ^ -(encoded & 1));
+}
+
+/**
+ * Makes buffer hold at least size bytes.
+ */
+static int reserve(unsigned char **buffer, size_t *capacity, size_t size){
+    unsigned char *grown;
+    size_t grown_capacity;
+
+    if(size <= *capacity){
+        return VM_OK;
+    }
+    grown_capacity = *capacity != 0 ? *capacity : HISTORY_INITIAL_CAPACITY;
+    while(grown_capacity < size){
+        grown_capacity *= 2;
+    }
+    grown = (unsigned char *)realloc(*buffer, grown_capacity);
+    if(grown == NULL){
+        return VM_ALLOCATION_FAILED;
+    }
+    *buffer = grown;
+    *capacity = grown_capacity;
+    return VM_OK;
+}
+
+/**
+ * Drops every record, the history starting at the current step.
+ */
+static void start_over(struct vm_history *history){
+    history->size = 0;
+    history->blocks_count = 0;
+    history->first_step = history->steps;
+    history->pending_size = 0;
+    history->pending_ranges = 0;
+    history->incomplete = 0;
+}
+
+/**
+ * Drops the oldest half of the blocks.
+ */
+static void drop_oldest_blocks(struct vm_history *history){
+    size_t dropped, offset;
+
+    dropped = history->blocks_count / 2;
+    offset = history->blocks[dropped].offset;
+    memmove(history->records, history->records + offset, history->size - offset);
+    history->size -= offset;
+    memmove(history->blocks, history->blocks + dropped,
+        (history->blocks_count - dropped) * sizeof(struct history_block));
+    history->blocks_count -= dropped;
+    for(size_t i = 0; i < history->blocks_count; i++){
+        history->blocks[i].offset -= offset;
+    }
+    history->first_step += dropped * HISTORY_BLOCK_STEPS;
+}
+
+/**
+ * Starts a block at the current step.
+ */
+static int add_block(struct vm_history *history){
+    struct history_block *blocks;
+    size_t capacity;
+
+    if(history->blocks_count == history->blocks_capacity){
+        capacity = history->blocks_capacity != 0 ? 2 * history->blocks_capacity : HISTORY_BLOCK_STEPS;
+        blocks = (struct history_block *)realloc(history->blocks, capacity * sizeof(struct history_block));
+        if(blocks == NULL){
+            return VM_ALLOCATION_FAILED;
+        }
+        history->blocks = blocks;
+        history->blocks_capacity = capacity;
+    }
+    history->blocks[history->blocks_count].offset = history->size;
+    history->blocks[history->blocks_count].pc_address = history->pc_address;
+    history->blocks[history->blocks_count].write_address = history->write_address;
+    history->blocks_count++;
+    return VM_OK;
+}
+
+/**
+ * Appends the record of the step that executed the instruction at
+ * pc_address, which overwrote old_byte at write_address, followed by the
+ * pending ranges.
+ */
+static int add_record(struct vm_history *history, unsigned int flags,
+    unsigned int pc_address, unsigned int write_address, WORD old_byte){
+    unsigned char *record;
+
+    if((history->steps - history->first_step) % HISTORY_BLOCK_STEPS == 0
+        && add_block(history) != VM_OK){
+        return VM_ALLOCATION_FAILED;
+    }
+    if(reserve(&history->records, &history->capacity,
+        history->size + STEP_RECORD_MAX_SIZE + history->pending_size) != VM_OK){
+        return VM_ALLOCATION_FAILED;
+    }
+    if(history->pending_ranges != 0){
+        flags |= HISTORY_STEP_WRITES;
+    }
+    record = history->records + history->size;
+    *record++ = flags;
+    record = write_varint(record, encode_delta(history->pc_address, pc_address));
+    record = write_varint(record, encode_delta(history->write_address, write_address));
+    *record++ = old_byte;
+    if(flags & HISTORY_STEP_WRITES){
+        record = write_varint(record, history->pending_ranges);
+        memcpy(record, history->pending, history->pending_size);
+        record += history->pending_size;
+    }
+    history->size = record - history->records;
+    return VM_OK;
+}
+
+/**
+ * Executes an instruction, and the primitive before it if one is ready,
+ * recording them.
+ */
+static void record_step(struct virtual_machine *vm, struct vm_history *history){
+    unsigned int flags, pc_address, write_address;
+    WORD old_byte;
+
+    flags = 0;
+    pc_address = get_pc_address(vm);
+    if(is_primitive_ready(vm)){
+        int running = vm->status == VIRTUAL_MACHINE_RUN;
+        flags |= HISTORY_STEP_PRIMITIVE;
+        // Its writes are recorded by notify_memory_write.
+        execute_primitive(vm);
+        if(running && vm->status != VIRTUAL_MACHINE_RUN){
+            flags |= HISTORY_STEP_STOPPED;
+        }
+    }
+    write_address = vm->pc[TO_ADDRESS_HIGH_OFFSET] << DOUBLE_WORD_SIZE
+        | vm->pc[TO_ADDRESS_MIDDLE_OFFSET] << WORD_SIZE
+        | vm->pc[TO_ADDRESS_LOW_OFFSET];
+    old_byte = vm->memory[write_address];
+    execute_instruction(vm);
+    history->shadow[write_address] = vm->memory[write_address];
+
+    if(history->incomplete || add_record(history, flags, pc_address, write_address, old_byte) != VM_OK){
+        history->steps++;
+        start_over(history);
+    } else{
+        history->steps++;
+        history->pending_size = 0;
+        history->pending_ranges = 0;
+        if(history->size > history->max_size && history->blocks_count > 1){
+            drop_oldest_blocks(history);
+        }
+    }
+    history->pc_address = pc_address;
+    history->write_address = write_address;
+}
+
+/**
+ * Decodes the record at record, the previous step having executed the
+ * instruction at pc_address and written at write_address. Returns the end
+ * of the record.
+ */
+static const unsigned char *decode_step(const unsigned char *record, struct history_step *step,
+    unsigned int pc_address, unsigned int write_address){
+    unsigned int encoded, address, length;
+
+    step->previous_pc_address = pc_address;
+    step->previous_write_address = write_address;
+    step->flags = *record++;
+    record = read_varint(record, &encoded);
+    step->pc_address = decode_delta(pc_address, encoded);
+    record = read_varint(record, &encoded);
+    step->write_address = decode_delta(write_address, encoded);
+    step->old_byte = *record++;
+    step->ranges_count = 0;
+    step->ranges = NULL;
+    if(step->flags & HISTORY_STEP_WRITES){
+        record = read_varint(record, &step->ranges_count);
+        step->ranges = record;
+        for(unsigned int i = 0; i < step->ranges_count; i++){
+            record = read_varint(record, &address);
+            record = read_varint(record, &length);
+            record += length;
+        }
+    }
+    return record;
+}
+
+/**
+ * Decodes the steps of the block at index into steps, returns their number.
+ */
+static unsigned int decode_block(struct vm_history *history, size_t index, struct history_step *steps){
+    struct history_block *block = &history->blocks[index];
+    const unsigned char *record, *end;
+    unsigned int pc_address, write_address, count;
+
+    record = history->records + block->offset;
+    end = history->records + (index + 1 < history->blocks_count ? history->blocks[index + 1].offset : history->size);
+    pc_address = block->pc_address;
+    write_address = block->write_address;
+    count = 0;
+    while(record < end){
+        steps[count].offset = record - history->records;
+        record = decode_step(record, &steps[count], pc_address, write_address);
+        pc_address = steps[count].pc_address;
+        write_address = steps[count].write_address;
+        count++;
+    }
+    return count;
+}
+
+/**
+ * Writes bytes back at address, in the memory and its copy.
+ */
+static void restore_bytes(struct virtual_machine *vm, unsigned int address,
+    const unsigned char *bytes, unsigned int length){
+    memcpy(vm->memory + address, bytes, length);
+    memcpy(vm->history->shadow + address, bytes, length);
+    notify_memory_write(vm, address, length);
+}
+
+/**
+ * Restores the count encoded ranges at ranges, last one first as they may
+ * overlap. There are few ranges per step, each one is found from the first.
+ */
+static void undo_ranges(struct virtual_machine *vm, const unsigned char *ranges, unsigned int count){
+    const unsigned char *range;
+    unsigned int address, length;
+
+    while(count-- > 0){
+        range = ranges;
+        for(unsigned int i = 0; i <= count; i++){
+            range = read_varint(range, &address);
+            range = read_varint(range, &length);
+            if(i < count){
+                range += length;
+            }
+        }
+        restore_bytes(vm, address, range, length);
+    }
+}
+
+/**
+ * Undoes the instruction of step, then the writes before it.
+ */
+static void undo_step(struct virtual_machine *vm, struct history_step *step){
+    restore_bytes(vm, step->write_address, &step->old_byte, 1);
+    undo_ranges(vm, step->ranges, step->ranges_count);
+    vm->retired_instructions--;
+    if(step->flags & HISTORY_STEP_PRIMITIVE){
+        vm->retired_primitives--;
+    }
+    if(step->flags & HISTORY_STEP_STOPPED){
+        vm->status = VIRTUAL_MACHINE_RUN;
+    }
+}
+
+/* Implementation. -----------------------------------------------------------*/
+int enable_vm_history(struct virtual_machine *vm, size_t max_size){
+    struct vm_history *history;
+
+    if(vm->memory == NULL_MEMORY){
+        return VM_MEMORY_UNINITIALIZED;
+    }
+    history = vm->history;
+    if(history == NULL){
+        history = (struct vm_history *)calloc(1, sizeof(struct vm_history));
+        if(history == NULL){
+            return VM_ALLOCATION_FAILED;
+        }
+        history->shadow = (WORD *)malloc(MAX_MEMORY_SIZE);
+        if(history->shadow == NULL){
+            free(history);
+            return VM_ALLOCATION_FAILED;
+        }
+        vm->history = history;
+    }
+    memcpy(history->shadow, vm->memory, MAX_MEMORY_SIZE);
+    history->max_size = max_size != 0 ? max_size : HISTORY_DEFAULT_MAX_SIZE;
+    history->steps = 0;
+    history->pc_address = get_pc_address(vm);
+    history->write_address = 0;
+    history->rewinding = 0;
+    start_over(history);
+    return VM_OK;
+}
+
+void disable_vm_history(struct virtual_machine *vm){
+    if(vm->history == NULL){
+        return;
+    }
+    free(vm->history->records);
+    free(vm->history->blocks);
+    free(vm->history->pending);
+    free(vm->history->shadow);
+    free(vm->history);
+    vm->history = NULL;
+}
+
+int execute_recorded_instructions(struct virtual_machine *vm, unsigned long long count){
+    if(vm->history == NULL){
+        return VM_HISTORY_UNAVAILABLE;
+    }
+    for(unsigned long long i = 0; i < count; i++){
+        record_step(vm, vm->history);
+    }
+    return VM_OK;
+}
+
+void record_memory_write(struct virtual_machine *vm, unsigned int address, unsigned int length){
+    struct vm_history *history = vm->history;
+    unsigned char *range;
+    unsigned int end, start;
+
+    if(history->rewinding || address >= MAX_MEMORY_SIZE){
+        return;
+    }
+    end = length > MAX_MEMORY_SIZE - address ? MAX_MEMORY_SIZE : address + length;
+    // Only the bytes that changed are kept, as runs.
+    for(unsigned int i = address; i < end; i++){
+        if(vm->memory[i] == history->shadow[i]){
+            continue;
+        }
+        start = i;
+        while(i < end && vm->memory[i] != history->shadow[i]){
+            i++;
+        }
+        if(!history->incomplete){
+            if(reserve(&history->pending, &history->pending_capacity,
+                history->pending_size + RANGE_HEADER_MAX_SIZE + (i - start)) != VM_OK){
+                history->incomplete = 1;
+            } else{
+                range = history->pending + history->pending_size;
+                range = write_varint(range, start);
+                range = write_varint(range, i - start);
+                memcpy(range, history->shadow + start, i - start);
+                history->pending_size = range + (i - start) - history->pending;
+                history->pending_ranges++;
+            }
+        }
+        memcpy(history->shadow + start, vm->memory + start, i - start);
+    }
+}
+
+unsigned long long get_history_step(struct virtual_machine *vm){
+    return vm->history != NULL ? vm->history->steps : 0;
+}
+
+unsigned long long get_history_first_step(struct virtual_machine *vm){
+    return vm->history != NULL ? vm->history->first_step : 0;
+}
+
+int rewind_vm(struct virtual_machine *vm, unsigned long long step){
+    struct vm_history *history = vm->history;
+    struct history_step steps[HISTORY_BLOCK_STEPS];
+    struct history_step *target;
+    size_t first_block, index;
+    unsigned long long block_step;
+    unsigned int count;
+
+    if(history == NULL || step < history->first_step || step > history->steps){
+        return VM_HISTORY_UNAVAILABLE;
+    }
+    if(step == history->steps){
+        return VM_OK;
+    }
+    history->rewinding = 1;
+    undo_ranges(vm, history->pending, history->pending_ranges);
+    history->pending_size = 0;
+    history->pending_ranges = 0;
+    history->incomplete = 0;
+    // Undo the blocks from the last one, then the steps of each block from
+    // its last one.
+    first_block = (step - history->first_step) / HISTORY_BLOCK_STEPS;
+    index = history->blocks_count;
+    do{
+        index--;
+        count = decode_block(history, index, steps);
+        block_step = history->first_step + index * HISTORY_BLOCK_STEPS;
+        while(count > 0 && block_step + count > step){
+            undo_step(vm, &steps[--count]);
+        }
+    } while(index > first_block);
+    history->rewinding = 0;
+
+    // steps holds the first block rewound, its records are dropped from
+    // the target step.
+    target = &steps[step - block_step];
+    history->size = target->offset;
+    history->blocks_count = (step - history->first_step) % HISTORY_BLOCK_STEPS == 0 ? first_block : first_block + 1;
+    history->steps = step;
+    history->pc_address = target->previous_pc_address;
+    history->write_address = target->previous_write_address;
+    set_pc_address(vm, target->pc_address);
+    return VM_OK;
+}
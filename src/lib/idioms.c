@@ -0,0 +1,357 @@
+#include "idioms.h"
+#include "vm.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef ENABLE_LOGGING
+#include "log.h"
+#else
+#include "nolog.h"
+#endif
+
+// Size of a lookup table row: the values a byte can take.
+#define IDIOM_TABLE_ROW_SIZE 256
+
+// Initial capacity of the idiom table.
+#define IDIOMS_INITIAL_CAPACITY 64
+
+static char *idiom_kind_names[IDIOM_KINDS_COUNT] = {
+    "increment",
+    "decrement",
+    "add",
+    "compare",
+    "lookup"
+};
+
+/* Helpers. ------------------------------------------------------------------*/
+static inline unsigned int decode_address(WORD *bytes){
+    return bytes[0] << DOUBLE_WORD_SIZE
+        | bytes[1] << WORD_SIZE
+        | bytes[2];
+}
+
+/**
+ * Returns the kind of idiom reading the table row starting at row.
+ */
+static int classify_table_row(WORD *row){
+    unsigned int counts[IDIOM_TABLE_ROW_SIZE];
+    unsigned int distinct;
+    int is_addition;
+    WORD k;
+
+    k = row[0];
+    is_addition = 1;
+    for(unsigned int i = 0; i < IDIOM_TABLE_ROW_SIZE && is_addition; i++){
+        is_addition = row[i] == ((i + k) & WORD_BIT_MASK);
+    }
+    if(is_addition){
+        if(k == 1){
+            return IDIOM_INCREMENT;
+        }
+        if(k == WORD_BIT_MASK){
+            return IDIOM_DECREMENT;
+        }
+        return IDIOM_ADD;
+    }
+
+    memset(counts, 0, sizeof(counts));
+    distinct = 0;
+    for(unsigned int i = 0; i < IDIOM_TABLE_ROW_SIZE; i++){
+        if(counts[row[i]]++ == 0){
+            distinct++;
+        }
+    }
+    // Two values, one of them for a single index: row[i] tells if i is
+    // equal to this index.
+    for(unsigned int i = 0; distinct == 2 && i < IDIOM_TABLE_ROW_SIZE; i++){
+        if(counts[row[i]] == 1){
+            return IDIOM_COMPARE;
+        }
+    }
+    return IDIOM_LOOKUP;
+}
+
+/**
+ * Returns TRUE if the instruction at pc_address patches the low byte of the
+ * from address of the one it jumps to, which can then be executed with it.
+ */
+static int is_lookup_pair(WORD *memory, unsigned int pc_address){
+    unsigned int to_address, lookup_address;
+
+    // Cheap test on the low bytes first, most of memory is not code.
+    if(memory[pc_address + TO_ADDRESS_LOW_OFFSET]
+        != ((memory[pc_address + JUMP_ADDRESS_LOW_OFFSET] + FROM_ADDRESS_LOW_OFFSET) & WORD_BIT_MASK)){
+        return 0;
+    }
+    to_address = decode_address(memory + pc_address + TO_ADDRESS_HIGH_OFFSET);
+    lookup_address = decode_address(memory + pc_address + JUMP_ADDRESS_HIGH_OFFSET);
+    if(to_address != lookup_address + FROM_ADDRESS_LOW_OFFSET){
+        return 0;
+    }
+    // Neither in the VM-reserved bytes nor overlapping the patching
+    // instruction.
+    return lookup_address > PRIMITIVE_RESULT_POINTER_LOW_ADDRESS
+        && lookup_address + JUMP_ADDRESS_LOW_OFFSET < MAX_MEMORY_SIZE
+        && (lookup_address + JUMP_ADDRESS_LOW_OFFSET < pc_address
+            || lookup_address > pc_address + JUMP_ADDRESS_LOW_OFFSET);
+}
+
+/**
+ * Returns the position in table->by_lookup of the first idiom whose lookup
+ * address is at least address.
+ */
+static unsigned int find_first_lookup(struct idiom_table *table, unsigned int address){
+    unsigned int low, high, middle;
+
+    low = 0;
+    high = table->count;
+    while(low < high){
+        middle = low + (high - low) / 2;
+        if(table->idioms[table->by_lookup[middle]].lookup_address < address){
+            low = middle + 1;
+        } else{
+            high = middle;
+        }
+    }
+    return low;
+}
+
+/**
+ * Returns TRUE if an active idiom keeps the byte at address of its lookup
+ * instruction.
+ */
+static int is_idiom_byte(struct idiom_table *table, unsigned int address){
+    unsigned int first;
+
+    first = address >= JUMP_ADDRESS_LOW_OFFSET ? address - JUMP_ADDRESS_LOW_OFFSET : 0;
+    for(unsigned int i = find_first_lookup(table, first); i < table->count; i++){
+        struct idiom *idiom = &table->idioms[table->by_lookup[i]];
+        if(idiom->lookup_address + TO_ADDRESS_HIGH_OFFSET > address){
+            break;
+        }
+        if(idiom->active){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Reads the lookup instruction of idiom from memory.
+ */
+static void read_lookup_instruction(struct idiom *idiom, WORD *memory){
+    WORD *lookup;
+
+    lookup = memory + idiom->lookup_address;
+    idiom->to_address = decode_address(lookup + TO_ADDRESS_HIGH_OFFSET);
+    idiom->jump_address = decode_address(lookup + JUMP_ADDRESS_HIGH_OFFSET);
+    idiom->kind = classify_table_row(memory
+        + (decode_address(lookup + FROM_ADDRESS_HIGH_OFFSET) & ~WORD_BIT_MASK));
+}
+
+/**
+ * Adds the idiom whose patching instruction is at pc_address to table, at
+ * position in table->by_lookup.
+ * Returns its index, or table->count if it could not be stored.
+ */
+static unsigned int add_idiom(struct idiom_table *table, WORD *memory, unsigned int pc_address, unsigned int position){
+    struct idiom *idiom;
+    unsigned int index;
+
+    if(table->count == table->capacity){
+        unsigned int capacity = table->capacity ? 2 * table->capacity : IDIOMS_INITIAL_CAPACITY;
+        struct idiom *idioms;
+        unsigned int *by_lookup;
+
+        idioms = (struct idiom *)realloc(table->idioms, capacity * sizeof(struct idiom));
+        if(idioms == NULL){
+            return table->count;
+        }
+        table->idioms = idioms;
+        by_lookup = (unsigned int *)realloc(table->by_lookup, capacity * sizeof(unsigned int));
+        if(by_lookup == NULL){
+            return table->count;
+        }
+        table->by_lookup = by_lookup;
+        table->capacity = capacity;
+    }
+    index = table->count++;
+    idiom = &table->idioms[index];
+    idiom->pc_address = pc_address;
+    idiom->lookup_address = decode_address(memory + pc_address + JUMP_ADDRESS_HIGH_OFFSET);
+    idiom->hits = 0;
+    memmove(table->by_lookup + position + 1, table->by_lookup + position,
+        (index - position) * sizeof(unsigned int));
+    table->by_lookup[position] = index;
+    return index;
+}
+
+/**
+ * Installs idiom, of index index, in the decoded-instruction cache of vm,
+ * where its patching instruction was just decoded.
+ */
+static void install_idiom(struct virtual_machine *vm, struct idiom *idiom, unsigned int index){
+    struct decoded_instruction *instruction;
+    unsigned char *owners;
+
+    // The bytes of the patching instruction were owned when it was decoded:
+    // writing them drops its entry, as for any decoded instruction.
+    instruction = get_decoded_instruction(vm, idiom->pc_address);
+    instruction->to_address = idiom->lookup_address + FROM_ADDRESS_LOW_OFFSET;
+    instruction->jump_address = index;
+    instruction->valid = DECODED_IDIOM;
+
+    // The to and jump addresses of the lookup instruction are kept in the
+    // idiom. Its from address is read when the idiom is executed.
+    owners = vm->decoded_owners + idiom->lookup_address;
+    for(unsigned int offset = TO_ADDRESS_HIGH_OFFSET; offset <= JUMP_ADDRESS_LOW_OFFSET; offset++){
+        owners[offset] = DECODED_OWNER_IDIOM;
+    }
+    idiom->active = 1;
+}
+
+/**
+ * Stops using idiom, of index index: its patching instruction is decoded
+ * again when executed.
+ */
+static void drop_idiom(struct virtual_machine *vm, struct idiom *idiom, unsigned int index){
+    struct decoded_instruction *instruction;
+    unsigned char *owners;
+
+    idiom->active = 0;
+    // The entry may have been decoded again since, maybe as another idiom.
+    instruction = get_decoded_instruction(vm, idiom->pc_address);
+    if(instruction->valid == DECODED_IDIOM && instruction->jump_address == index){
+        instruction->valid = DECODED_INVALID;
+    }
+    // Other instructions may overlap those bytes, and other idioms keep them.
+    owners = vm->decoded_owners + idiom->lookup_address;
+    for(unsigned int offset = TO_ADDRESS_HIGH_OFFSET; offset <= JUMP_ADDRESS_LOW_OFFSET; offset++){
+        if(owners[offset] == DECODED_OWNER_IDIOM
+            && !is_idiom_byte(vm->idioms, idiom->lookup_address + offset)){
+            owners[offset] = DECODED_OWNER_SHARED;
+        }
+    }
+}
+
+/* Implementation. -----------------------------------------------------------*/
+int enable_idioms(struct virtual_machine *vm){
+    flush_idioms(vm);
+    vm->idioms = (struct idiom_table *)calloc(1, sizeof(struct idiom_table));
+    if(vm->idioms == NULL){
+        return VM_MEMORY_ALLOCATION_FAILED;
+    }
+    return VM_OK;
+}
+
+int install_idiom_at(struct virtual_machine *vm, unsigned int pc_address){
+    struct idiom_table *table = vm->idioms;
+    unsigned int lookup_address, position, index;
+
+    if(table == NULL || !is_lookup_pair(vm->memory, pc_address)){
+        return 0;
+    }
+    // The same pair may have been dropped since it was found.
+    lookup_address = decode_address(vm->memory + pc_address + JUMP_ADDRESS_HIGH_OFFSET);
+    position = find_first_lookup(table, lookup_address);
+    for(index = table->count; position < table->count; position++){
+        struct idiom *idiom = &table->idioms[table->by_lookup[position]];
+        if(idiom->lookup_address != lookup_address){
+            break;
+        }
+        if(idiom->pc_address == pc_address){
+            index = table->by_lookup[position];
+            break;
+        }
+    }
+    if(index == table->count){
+        index = add_idiom(table, vm->memory, pc_address, position);
+        if(index == table->count){
+            log_error("Not enough memory to store an idiom, running without it.");
+            return 0;
+        }
+    }
+    read_lookup_instruction(&table->idioms[index], vm->memory);
+    install_idiom(vm, &table->idioms[index], index);
+    return 1;
+}
+
+void drop_idioms_at(struct virtual_machine *vm, unsigned int address){
+    struct idiom_table *table = vm->idioms;
+    unsigned int first;
+
+    if(table == NULL){
+        return;
+    }
+    first = address >= JUMP_ADDRESS_LOW_OFFSET ? address - JUMP_ADDRESS_LOW_OFFSET : 0;
+    for(unsigned int i = find_first_lookup(table, first); i < table->count; i++){
+        unsigned int index = table->by_lookup[i];
+        if(table->idioms[index].lookup_address + TO_ADDRESS_HIGH_OFFSET > address){
+            break;
+        }
+        if(table->idioms[index].active){
+            drop_idiom(vm, &table->idioms[index], index);
+            log_debug("Dropped the idiom at %06x.", table->idioms[index].pc_address);
+        }
+    }
+}
+
+void flush_idioms(struct virtual_machine *vm){
+    struct idiom_table *table = vm->idioms;
+
+    if(table == NULL){
+        return;
+    }
+    if(vm->decoded_pages != NULL){
+        for(unsigned int i = 0; i < table->count; i++){
+            if(table->idioms[i].active){
+                drop_idiom(vm, &table->idioms[i], i);
+            }
+        }
+    }
+    log_debug("Flushed %d idioms.", table->count);
+    free(table->idioms);
+    free(table->by_lookup);
+    free(table);
+    vm->idioms = NULL;
+}
+
+void get_idiom_statistics(struct virtual_machine *vm, struct idiom_statistics *statistics){
+    memset(statistics, 0, sizeof(struct idiom_statistics));
+    if(vm->idioms == NULL){
+        return;
+    }
+    for(unsigned int i = 0; i < vm->idioms->count; i++){
+        struct idiom *idiom = &vm->idioms->idioms[i];
+        statistics->matched[idiom->kind]++;
+        statistics->saved_dispatches[idiom->kind] += idiom->hits;
+    }
+}
+
+char *get_idiom_kind_name(int kind){
+    if(kind < 0 || kind >= IDIOM_KINDS_COUNT){
+        return "unknown";
+    }
+    return idiom_kind_names[kind];
+}
+
+void print_idiom_report(struct virtual_machine *vm, FILE *stream){
+    struct idiom_statistics statistics;
+    unsigned long long saved_dispatches;
+    unsigned int matched;
+
+    get_idiom_statistics(vm, &statistics);
+    matched = 0;
+    saved_dispatches = 0;
+    fprintf(stream, "Idioms:\n");
+    for(int kind = 0; kind < IDIOM_KINDS_COUNT; kind++){
+        fprintf(stream, "  %-10s %8u matched %12llu dispatches saved\n",
+            get_idiom_kind_name(kind), statistics.matched[kind],
+            statistics.saved_dispatches[kind]);
+        matched += statistics.matched[kind];
+        saved_dispatches += statistics.saved_dispatches[kind];
+    }
+    fprintf(stream, "  %-10s %8u matched %12llu dispatches saved\n",
+        "total", matched, saved_dispatches);
+}
@@ -0,0 +1,718 @@
+#define _GNU_SOURCE
+
+#include "image.h"
+#include "image_format.h"
+#include "vm.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef ENABLE_LOGGING
+#include "log.h"
+#else
+#include "nolog.h"
+#endif
+
+// Size of the chunks copied to memory files. All-zero chunks are skipped so
+// that they stay holes.
+#define IMAGE_CHUNK_SIZE 0x1000
+
+// Bits of the entries of /proc/self/pagemap.
+#define PAGE_MAP_PRESENT (1ULL << 63)
+#define PAGE_MAP_SWAPPED (1ULL << 62)
+#define PAGE_MAP_FILE (1ULL << 61)
+
+/* Helpers. ------------------------------------------------------------------*/
+static int create_memory_file(void){
+#ifdef __linux__
+    return memfd_create("jolly-image", MFD_CLOEXEC);
+#else
+    static unsigned int counter;
+    char name[64];
+    int descriptor;
+
+    snprintf(name, sizeof(name), "/jolly-%d-%u", (int)getpid(), counter++);
+    descriptor = shm_open(name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+    if(descriptor >= 0){
+        shm_unlink(name);
+    }
+    return descriptor;
+#endif
+}
+
+static int is_zero(WORD *bytes, unsigned int length){
+    for(unsigned int i = 0; i < length; i++){
+        if(bytes[i] != 0){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Writes length bytes at offset of descriptor, unless they are all 0.
+ */
+static int write_chunk(int descriptor, WORD *bytes, unsigned int length, unsigned int offset){
+    if(is_zero(bytes, length)){
+        return VM_OK;
+    }
+    if(pwrite(descriptor, bytes, length, offset) != (ssize_t)length){
+        return VM_ALLOCATION_FAILED;
+    }
+    return VM_OK;
+}
+
+/**
+ * Fills the memory file with the segmented image read from file.
+ */
+static int fill_from_segmented_file(int descriptor, FILE *file){
+    WORD *memory;
+    int result;
+
+    memory = (WORD *)mmap(NULL, MAX_MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, descriptor, 0);
+    if(memory == MAP_FAILED){
+        return VM_ALLOCATION_FAILED;
+    }
+    // The pages of zero regions are never touched and stay holes.
+    result = read_segmented_image(file, memory);
+    munmap(memory, MAX_MEMORY_SIZE);
+    return result;
+}
+
+/**
+ * Fills the memory file with the content of the file at filename.
+ */
+static int fill_from_file(int descriptor, char *filename){
+    WORD chunk[IMAGE_CHUNK_SIZE];
+    ssize_t length;
+    unsigned int offset;
+    FILE *segmented_file;
+    int file, result;
+
+    if(ftruncate(descriptor, MAX_MEMORY_SIZE) != 0){
+        return VM_ALLOCATION_FAILED;
+    }
+    file = open(filename, O_RDONLY);
+    if(file < 0){
+        log_error("File does not exist %s", filename);
+        return VM_IMAGE_LOAD_FAILED;
+    }
+    if(pread(file, chunk, IMAGE_FORMAT_MAGIC_SIZE, 0) == IMAGE_FORMAT_MAGIC_SIZE
+        && is_segmented_image(chunk)){
+        segmented_file = fdopen(file, "rb");
+        if(segmented_file == NULL){
+            close(file);
+            return VM_IMAGE_LOAD_FAILED;
+        }
+        result = fill_from_segmented_file(descriptor, segmented_file);
+        fclose(segmented_file);
+        return result;
+    }
+    offset = 0;
+    while(offset < MAX_MEMORY_SIZE){
+        unsigned int wanted = MAX_MEMORY_SIZE - offset < IMAGE_CHUNK_SIZE ? MAX_MEMORY_SIZE - offset : IMAGE_CHUNK_SIZE;
+        length = read(file, chunk, wanted);
+        if(length < 0){
+            close(file);
+            return VM_IMAGE_LOAD_FAILED;
+        }
+        if(length == 0){
+            break;
+        }
+        if(write_chunk(descriptor, chunk, length, offset) != VM_OK){
+            close(file);
+            return VM_ALLOCATION_FAILED;
+        }
+        offset += length;
+    }
+    close(file);
+    return VM_OK;
+}
+
+/**
+ * Fills the memory file with memory.
+ */
+static int fill_from_memory(int descriptor, WORD *memory){
+    if(ftruncate(descriptor, MAX_MEMORY_SIZE) != 0){
+        return VM_ALLOCATION_FAILED;
+    }
+    for(unsigned int offset = 0; offset < MAX_MEMORY_SIZE; offset += IMAGE_CHUNK_SIZE){
+        unsigned int length = MAX_MEMORY_SIZE - offset < IMAGE_CHUNK_SIZE ? MAX_MEMORY_SIZE - offset : IMAGE_CHUNK_SIZE;
+        if(write_chunk(descriptor, memory + offset, length, offset) != VM_OK){
+            return VM_ALLOCATION_FAILED;
+        }
+    }
+    return VM_OK;
+}
+
+/**
+ * Opens the shared memory object named shared_name, creating and filling it
+ * from filename if needed.
+ * The creator only makes the object readable once it is filled, which tells
+ * the other processes it is ready. Sets *created to TRUE if it created it.
+ */
+static int open_shared_image(char *shared_name, char *filename, int *descriptor, int *created){
+    struct stat status;
+    int result;
+
+    for(unsigned int attempt = 0; attempt < IMAGE_OPEN_ATTEMPTS; attempt++){
+        *descriptor = shm_open(shared_name, O_RDWR | O_CREAT | O_EXCL, S_IWUSR);
+        if(*descriptor >= 0){
+            result = fill_from_file(*descriptor, filename);
+            if(result != VM_OK || fchmod(*descriptor, S_IRUSR | S_IWUSR) != 0){
+                close(*descriptor);
+                shm_unlink(shared_name);
+                return result != VM_OK ? result : VM_IMAGE_LOAD_FAILED;
+            }
+            log_debug("Created shared image %s from %s.", shared_name, filename);
+            *created = 1;
+            return VM_OK;
+        }
+        if(errno != EEXIST){
+            log_error("Failed to create shared image %s.", shared_name);
+            return VM_IMAGE_LOAD_FAILED;
+        }
+        *descriptor = shm_open(shared_name, O_RDONLY, 0);
+        if(*descriptor >= 0){
+            if(fstat(*descriptor, &status) == 0 && (status.st_mode & S_IRUSR)){
+                return VM_OK;
+            }
+            close(*descriptor);
+        }
+        usleep(IMAGE_OPEN_DELAY);
+    }
+    log_error("Shared image %s is not ready.", shared_name);
+    return VM_IMAGE_LOAD_FAILED;
+}
+
+static WORD *map_image(int descriptor){
+    void *memory;
+
+    memory = mmap(NULL, MAX_MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, descriptor, 0);
+    if(memory == MAP_FAILED){
+        return NULL_MEMORY;
+    }
+    return (WORD *)memory;
+}
+
+/**
+ * Reads the entries of /proc/self/pagemap describing the pages_count pages
+ * of memory.
+ * Returns NULL if they are not available.
+ */
+static uint64_t *read_page_map(WORD *memory, unsigned int pages_count, long page_size){
+#ifdef __linux__
+    uint64_t *entries;
+    size_t size;
+    int descriptor;
+
+    descriptor = open("/proc/self/pagemap", O_RDONLY);
+    if(descriptor < 0){
+        return NULL;
+    }
+    size = pages_count * sizeof(uint64_t);
+    entries = (uint64_t *)malloc(size);
+    if(entries != NULL
+        && pread(descriptor, entries, size, (uintptr_t)memory / page_size * sizeof(uint64_t)) != (ssize_t)size){
+        free(entries);
+        entries = NULL;
+    }
+    close(descriptor);
+    return entries;
+#else
+    return NULL;
+#endif
+}
+
+/**
+ * Lists in pages the pages vm wrote to its private mapping of its image, and
+ * returns their number. pages must hold one entry per page of memory.
+ * Every page is listed when they cannot be told apart.
+ */
+static unsigned int find_written_pages(struct virtual_machine *vm, unsigned int *pages, long page_size){
+    uint64_t *entries;
+    WORD *image;
+    unsigned int pages_count, written_count;
+
+    pages_count = (MAX_MEMORY_SIZE + page_size - 1) / page_size;
+    entries = read_page_map(vm->memory, pages_count, page_size);
+    image = NULL_MEMORY;
+    if(entries == NULL){
+        // Compare every page with the image instead.
+        image = (WORD *)mmap(NULL, MAX_MEMORY_SIZE, PROT_READ, MAP_SHARED, vm->image_descriptor, 0);
+        if(image == MAP_FAILED){
+            for(unsigned int page = 0; page < pages_count; page++){
+                pages[page] = page;
+            }
+            return pages_count;
+        }
+    }
+    written_count = 0;
+    for(unsigned int page = 0; page < pages_count; page++){
+        unsigned int offset = page * page_size;
+        unsigned int length = MAX_MEMORY_SIZE - offset < page_size ? MAX_MEMORY_SIZE - offset : page_size;
+        int written;
+        if(entries != NULL){
+            // A written page of a private file mapping is anonymous.
+            written = (entries[page] & PAGE_MAP_SWAPPED)
+                || ((entries[page] & PAGE_MAP_PRESENT) && !(entries[page] & PAGE_MAP_FILE));
+        } else{
+            written = memcmp(vm->memory + offset, image + offset, length) != 0;
+        }
+        if(written){
+            pages[written_count++] = page;
+        }
+    }
+    if(entries != NULL){
+        free(entries);
+    } else{
+        munmap(image, MAX_MEMORY_SIZE);
+    }
+    return written_count;
+}
+
+/**
+ * Copies the pages parent wrote to its private mapping of its image into
+ * destination, another private mapping of the same image.
+ */
+static void copy_written_pages(WORD *destination, struct virtual_machine *parent){
+    unsigned int *pages;
+    unsigned int pages_count;
+    long page_size;
+
+    page_size = sysconf(_SC_PAGESIZE);
+    pages = (unsigned int *)malloc((MAX_MEMORY_SIZE + page_size - 1) / page_size * sizeof(unsigned int));
+    if(pages == NULL){
+        memcpy(destination, parent->memory, MAX_MEMORY_SIZE);
+        return;
+    }
+    pages_count = find_written_pages(parent, pages, page_size);
+    for(unsigned int i = 0; i < pages_count; i++){
+        unsigned int offset = pages[i] * page_size;
+        unsigned int length = MAX_MEMORY_SIZE - offset < page_size ? MAX_MEMORY_SIZE - offset : page_size;
+        memcpy(destination + offset, parent->memory + offset, length);
+    }
+    free(pages);
+}
+
+/**
+ * Moves the memory of vm to a private mapping of a new image holding it.
+ */
+static int adopt_image(struct virtual_machine *vm){
+    WORD *memory;
+    int descriptor;
+
+    descriptor = create_memory_file();
+    if(descriptor < 0){
+        return VM_MEMORY_ALLOCATION_FAILED;
+    }
+    if(fill_from_memory(descriptor, vm->memory) != VM_OK
+        || (memory = map_image(descriptor)) == NULL_MEMORY){
+        close(descriptor);
+        return VM_MEMORY_ALLOCATION_FAILED;
+    }
+    // Same content at another address: the caches indexed by address stay
+    // valid.
+    if(vm->memory_origin == VM_MEMORY_MAPPED){
+        munmap(vm->memory, MAX_MEMORY_SIZE);
+    } else{
+        free(vm->memory);
+    }
+    vm->pc = memory + (vm->pc - vm->memory);
+    vm->memory = memory;
+    vm->memory_origin = VM_MEMORY_MAPPED;
+    vm->image_descriptor = descriptor;
+    return VM_OK;
+}
+
+/**
+ * Makes the memory of vm a private mapping of the memory file.
+ */
+static int attach_image(struct virtual_machine *vm, int image_descriptor){
+    WORD *memory;
+    int descriptor;
+
+    memory = map_image(image_descriptor);
+    if(memory == NULL_MEMORY){
+        return VM_MEMORY_ALLOCATION_FAILED;
+    }
+    descriptor = fcntl(image_descriptor, F_DUPFD_CLOEXEC, 0);
+    if(descriptor < 0){
+        munmap(memory, MAX_MEMORY_SIZE);
+        return VM_MEMORY_ALLOCATION_FAILED;
+    }
+    vm->memory = memory;
+    vm->memory_origin = VM_MEMORY_MAPPED;
+    vm->image_descriptor = descriptor;
+    return VM_OK;
+}
+
+/**
+ * Stores value in the size bytes at bytes, most significant first like the
+ * addresses of the VM.
+ */
+static void store_big_endian(WORD *bytes, unsigned int value, unsigned int size){
+    for(unsigned int i = 0; i < size; i++){
+        bytes[i] = (value >> (WORD_SIZE * (size - 1 - i))) & WORD_BIT_MASK;
+    }
+}
+
+static unsigned int load_big_endian(WORD *bytes, unsigned int size){
+    unsigned int value = 0;
+    for(unsigned int i = 0; i < size; i++){
+        value = value << WORD_SIZE | bytes[i];
+    }
+    return value;
+}
+
+/**
+ * Writes a checkpoint of vm holding the pages_count pages listed in pages.
+ */
+static int write_checkpoint_file(struct virtual_machine *vm, char *filename, WORD kind,
+    unsigned int *pages, unsigned int pages_count, long page_size){
+    WORD header[CHECKPOINT_HEADER_SIZE];
+    WORD page_number[CHECKPOINT_PAGE_NUMBER_SIZE];
+    FILE *file;
+    int failed;
+
+    file = fopen(filename, "wb");
+    if(file == NULL){
+        log_error("Failed to create checkpoint %s", filename);
+        return VM_CHECKPOINT_FAILED;
+    }
+    memcpy(header, CHECKPOINT_MAGIC, 4);
+    header[4] = CHECKPOINT_VERSION;
+    header[5] = kind;
+    store_big_endian(header + 6, vm->checkpoints_count, 4);
+    store_big_endian(header + 10, page_size, 4);
+    store_big_endian(header + 14, get_pc_address(vm), 3);
+    header[17] = vm->status;
+    store_big_endian(header + 18, pages_count, 4);
+    failed = fwrite(header, 1, CHECKPOINT_HEADER_SIZE, file) != CHECKPOINT_HEADER_SIZE;
+    for(unsigned int i = 0; i < pages_count && !failed; i++){
+        unsigned int offset = pages[i] * page_size;
+        unsigned int length = MAX_MEMORY_SIZE - offset < page_size ? MAX_MEMORY_SIZE - offset : page_size;
+        store_big_endian(page_number, pages[i], CHECKPOINT_PAGE_NUMBER_SIZE);
+        failed = fwrite(page_number, 1, CHECKPOINT_PAGE_NUMBER_SIZE, file) != CHECKPOINT_PAGE_NUMBER_SIZE
+            || fwrite(vm->memory + offset, 1, length, file) != length;
+    }
+    if(fclose(file) != 0 || failed){
+        log_error("Failed to write checkpoint %s", filename);
+        return VM_CHECKPOINT_FAILED;
+    }
+    return VM_OK;
+}
+
+/**
+ * Maps the memory file privately over the memory of vm, at the same address
+ * so that the engines running vm do not notice.
+ */
+static int remap_memory(struct virtual_machine *vm, int descriptor){
+    if(mmap(vm->memory, MAX_MEMORY_SIZE, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_FIXED, descriptor, 0) == MAP_FAILED){
+        return VM_MEMORY_ALLOCATION_FAILED;
+    }
+    return VM_OK;
+}
+
+/**
+ * Makes the memory of vm a private mapping of a new memory file holding it,
+ * the base of the next incremental checkpoint.
+ */
+static int create_checkpoint_base(struct virtual_machine *vm){
+    int descriptor;
+
+    descriptor = create_memory_file();
+    if(descriptor < 0){
+        return VM_MEMORY_ALLOCATION_FAILED;
+    }
+    if(fill_from_memory(descriptor, vm->memory) != VM_OK || remap_memory(vm, descriptor) != VM_OK){
+        close(descriptor);
+        return VM_MEMORY_ALLOCATION_FAILED;
+    }
+    if(vm->image_descriptor != -1){
+        close(vm->image_descriptor);
+    }
+    vm->image_descriptor = descriptor;
+    return VM_OK;
+}
+
+/**
+ * Writes the listed pages of vm to its memory file and maps it again, so that
+ * it holds the memory as of this checkpoint and no page is written.
+ */
+static int update_checkpoint_base(struct virtual_machine *vm, unsigned int *pages,
+    unsigned int pages_count, long page_size){
+    for(unsigned int i = 0; i < pages_count; i++){
+        unsigned int offset = pages[i] * page_size;
+        unsigned int length = MAX_MEMORY_SIZE - offset < page_size ? MAX_MEMORY_SIZE - offset : page_size;
+        if(pwrite(vm->image_descriptor, vm->memory + offset, length, offset) != (ssize_t)length){
+            return VM_MEMORY_ALLOCATION_FAILED;
+        }
+    }
+    return remap_memory(vm, vm->image_descriptor);
+}
+
+/**
+ * Reads the checkpoint at filename into memory, which must be the
+ * sequence-th of its chain, and its PC and status.
+ */
+static int read_checkpoint_file(char *filename, unsigned int sequence, WORD *memory,
+    unsigned int *pc_address, enum vm_status *status){
+    WORD header[CHECKPOINT_HEADER_SIZE];
+    WORD page_number[CHECKPOINT_PAGE_NUMBER_SIZE];
+    unsigned int page_size, pages_count, read_count;
+    FILE *file;
+
+    file = fopen(filename, "rb");
+    if(file == NULL){
+        log_error("File does not exist %s", filename);
+        return VM_IMAGE_LOAD_FAILED;
+    }
+    if(fread(header, 1, CHECKPOINT_HEADER_SIZE, file) != CHECKPOINT_HEADER_SIZE
+        || memcmp(header, CHECKPOINT_MAGIC, 4) != 0
+        || header[4] != CHECKPOINT_VERSION
+        || header[5] != (sequence == 0 ? CHECKPOINT_FULL : CHECKPOINT_INCREMENTAL)
+        || load_big_endian(header + 6, 4) != sequence){
+        log_error("%s is not checkpoint %u of a chain", filename, sequence);
+        fclose(file);
+        return VM_IMAGE_LOAD_FAILED;
+    }
+    page_size = load_big_endian(header + 10, 4);
+    *pc_address = load_big_endian(header + 14, 3);
+    *status = header[17] == VIRTUAL_MACHINE_STOP ? VIRTUAL_MACHINE_STOP : VIRTUAL_MACHINE_RUN;
+    pages_count = load_big_endian(header + 18, 4);
+    read_count = 0;
+    while(read_count < pages_count){
+        unsigned int offset, length;
+        if(fread(page_number, 1, CHECKPOINT_PAGE_NUMBER_SIZE, file) != CHECKPOINT_PAGE_NUMBER_SIZE){
+            break;
+        }
+        offset = load_big_endian(page_number, CHECKPOINT_PAGE_NUMBER_SIZE) * page_size;
+        if(page_size == 0 || offset >= MAX_MEMORY_SIZE){
+            break;
+        }
+        length = MAX_MEMORY_SIZE - offset < page_size ? MAX_MEMORY_SIZE - offset : page_size;
+        if(fread(memory + offset, 1, length, file) != length){
+            break;
+        }
+        read_count++;
+    }
+    fclose(file);
+    if(read_count != pages_count){
+        log_error("Checkpoint %s is truncated", filename);
+        return VM_IMAGE_LOAD_FAILED;
+    }
+    return VM_OK;
+}
+
+/* Implementation. -----------------------------------------------------------*/
+int new_image(struct vm_image **image, char *filename, char *shared_name){
+    int descriptor, result, created;
+
+    *image = NULL;
+    created = 0;
+    if(shared_name != NULL){
+        result = open_shared_image(shared_name, filename, &descriptor, &created);
+        if(result != VM_OK){
+            return result;
+        }
+    } else{
+        descriptor = create_memory_file();
+        if(descriptor < 0){
+            return VM_ALLOCATION_FAILED;
+        }
+        result = fill_from_file(descriptor, filename);
+        if(result != VM_OK){
+            close(descriptor);
+            return result;
+        }
+    }
+    *image = (struct vm_image *)malloc(sizeof(struct vm_image));
+    if(*image == NULL){
+        close(descriptor);
+        return VM_ALLOCATION_FAILED;
+    }
+    (*image)->descriptor = descriptor;
+    (*image)->created = created;
+    return VM_OK;
+}
+
+int unlink_shared_image(char *shared_name){
+    if(shm_unlink(shared_name) != 0){
+        log_error("Failed to unlink shared image %s.", shared_name);
+        return VM_IMAGE_LOAD_FAILED;
+    }
+    return VM_OK;
+}
+
+int new_image_from_vm(struct vm_image **image, struct virtual_machine *vm){
+    int descriptor;
+
+    *image = NULL;
+    descriptor = create_memory_file();
+    if(descriptor < 0){
+        return VM_ALLOCATION_FAILED;
+    }
+    if(fill_from_memory(descriptor, vm->memory) != VM_OK){
+        close(descriptor);
+        return VM_ALLOCATION_FAILED;
+    }
+    *image = (struct vm_image *)malloc(sizeof(struct vm_image));
+    if(*image == NULL){
+        close(descriptor);
+        return VM_ALLOCATION_FAILED;
+    }
+    (*image)->descriptor = descriptor;
+    (*image)->created = 0;
+    return VM_OK;
+}
+
+void free_image(struct vm_image *image){
+    close(image->descriptor);
+    free(image);
+}
+
+int fork_from_image(struct virtual_machine **vm, struct vm_image *image){
+    if(new_vm(vm) != VM_OK){
+        return VM_ALLOCATION_FAILED;
+    }
+    if(attach_image(*vm, image->descriptor) != VM_OK){
+        free_vm(*vm);
+        *vm = NULL_VM;
+        return VM_MEMORY_ALLOCATION_FAILED;
+    }
+    load_pc(*vm);
+    return VM_OK;
+}
+
+int clone_vm(struct virtual_machine **clone, struct virtual_machine *parent){
+    if(parent->image_descriptor == -1 && adopt_image(parent) != VM_OK){
+        *clone = NULL_VM;
+        return VM_MEMORY_ALLOCATION_FAILED;
+    }
+    if(new_vm(clone) != VM_OK){
+        return VM_ALLOCATION_FAILED;
+    }
+    if(attach_image(*clone, parent->image_descriptor) != VM_OK){
+        free_vm(*clone);
+        *clone = NULL_VM;
+        return VM_MEMORY_ALLOCATION_FAILED;
+    }
+    copy_written_pages((*clone)->memory, parent);
+    // The memory file of parent is shared now, it cannot be updated by its
+    // next checkpoint.
+    parent->checkpoints_count = 0;
+    (*clone)->pc = (*clone)->memory + (parent->pc - parent->memory);
+    (*clone)->status = parent->status;
+    return VM_OK;
+}
+
+int write_checkpoint(struct virtual_machine *vm, char *filename){
+    unsigned int *pages;
+    unsigned int pages_count;
+    long page_size;
+    WORD kind;
+    int result;
+
+    page_size = sysconf(_SC_PAGESIZE);
+    pages_count = (MAX_MEMORY_SIZE + page_size - 1) / page_size;
+    pages = (unsigned int *)malloc(pages_count * sizeof(unsigned int));
+    if(pages == NULL){
+        return VM_CHECKPOINT_FAILED;
+    }
+    if(vm->checkpoints_count > 0){
+        kind = CHECKPOINT_INCREMENTAL;
+        pages_count = find_written_pages(vm, pages, page_size);
+    } else{
+        unsigned int all_count = pages_count;
+        kind = CHECKPOINT_FULL;
+        pages_count = 0;
+        for(unsigned int page = 0; page < all_count; page++){
+            unsigned int offset = page * page_size;
+            unsigned int length = MAX_MEMORY_SIZE - offset < page_size ? MAX_MEMORY_SIZE - offset : page_size;
+            if(!is_zero(vm->memory + offset, length)){
+                pages[pages_count++] = page;
+            }
+        }
+    }
+    result = write_checkpoint_file(vm, filename, kind, pages, pages_count, page_size);
+    if(result == VM_OK){
+        if(kind == CHECKPOINT_INCREMENTAL){
+            result = update_checkpoint_base(vm, pages, pages_count, page_size);
+        } else if(vm->memory_origin == VM_MEMORY_MAPPED){
+            result = create_checkpoint_base(vm);
+        } else{
+            // Memory given with set_memory cannot be moved under the engines:
+            // every checkpoint of the VM is a full one.
+            vm->checkpoints_count = 0;
+            free(pages);
+            return VM_OK;
+        }
+        if(result != VM_OK){
+            log_error("Failed to update the base of checkpoint %s", filename);
+            vm->checkpoints_count = 0;
+            result = VM_CHECKPOINT_FAILED;
+        } else{
+            vm->checkpoints_count++;
+        }
+    }
+    free(pages);
+    return result;
+}
+
+int restore_checkpoint(struct virtual_machine **vm, char **filenames, unsigned int count){
+    unsigned int pc_address;
+    enum vm_status status;
+    WORD *memory;
+    int descriptor, result;
+
+    *vm = NULL_VM;
+    if(count == 0){
+        return VM_IMAGE_LOAD_FAILED;
+    }
+    descriptor = create_memory_file();
+    if(descriptor < 0){
+        return VM_ALLOCATION_FAILED;
+    }
+    // The chain is applied in order to a shared mapping of the memory file.
+    memory = NULL_MEMORY;
+    if(ftruncate(descriptor, MAX_MEMORY_SIZE) != 0
+        || (memory = (WORD *)mmap(NULL, MAX_MEMORY_SIZE, PROT_READ | PROT_WRITE,
+            MAP_SHARED, descriptor, 0)) == MAP_FAILED){
+        close(descriptor);
+        return VM_ALLOCATION_FAILED;
+    }
+    result = VM_OK;
+    for(unsigned int i = 0; i < count && result == VM_OK; i++){
+        result = read_checkpoint_file(filenames[i], i, memory, &pc_address, &status);
+    }
+    munmap(memory, MAX_MEMORY_SIZE);
+    if(result == VM_OK && new_vm(vm) != VM_OK){
+        result = VM_ALLOCATION_FAILED;
+    }
+    if(result == VM_OK && (memory = map_image(descriptor)) == NULL_MEMORY){
+        free_vm(*vm);
+        *vm = NULL_VM;
+        result = VM_MEMORY_ALLOCATION_FAILED;
+    }
+    if(result != VM_OK){
+        close(descriptor);
+        return result;
+    }
+    (*vm)->memory = memory;
+    (*vm)->memory_origin = VM_MEMORY_MAPPED;
+    (*vm)->image_descriptor = descriptor;
+    (*vm)->pc = memory + pc_address;
+    (*vm)->status = status;
+    // The memory file holds the last checkpoint, the chain goes on.
+    (*vm)->checkpoints_count = count;
+    return VM_OK;
+}
@@ -0,0 +1,209 @@
+#include "image_format.h"
+#include "vm.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef ENABLE_LOGGING
+#include "log.h"
+#else
+#include "nolog.h"
+#endif
+
+#define IMAGE_SEGMENT_RUN_SIZE 3
+#define IMAGE_SEGMENT_RUNS_COUNT_SIZE 4
+
+/* Helpers. ------------------------------------------------------------------*/
+/**
+ * Stores value in the size bytes at bytes, most significant first like the
+ * addresses of the VM.
+ */
+static void store_big_endian(WORD *bytes, unsigned int value, unsigned int size){
+    for(unsigned int i = 0; i < size; i++){
+        bytes[i] = (value >> (WORD_SIZE * (size - 1 - i))) & WORD_BIT_MASK;
+    }
+}
+
+static unsigned int load_big_endian(WORD *bytes, unsigned int size){
+    unsigned int value = 0;
+    for(unsigned int i = 0; i < size; i++){
+        value = value << WORD_SIZE | bytes[i];
+    }
+    return value;
+}
+
+/**
+ * Returns the end of the segment of memory starting at start, a non-zero
+ * byte: the end of its last non-zero byte before IMAGE_SEGMENT_MIN_GAP zeros.
+ */
+static unsigned int find_segment_end(WORD *memory, unsigned int start){
+    unsigned int end = start + 1;
+    for(unsigned int address = start + 1;
+        address < MAX_MEMORY_SIZE && address - end < IMAGE_SEGMENT_MIN_GAP;
+        address++){
+        if(memory[address] != 0){
+            end = address + 1;
+        }
+    }
+    return end;
+}
+
+static unsigned int find_next_segment(WORD *memory, unsigned int address){
+    while(address < MAX_MEMORY_SIZE && memory[address] == 0){
+        address++;
+    }
+    return address;
+}
+
+static unsigned int count_runs(WORD *bytes, unsigned int length){
+    unsigned int runs = 0;
+    for(unsigned int i = 0; i < length; runs++){
+        unsigned int run = 1;
+        while(i + run < length && run < IMAGE_SEGMENT_MAX_RUN && bytes[i + run] == bytes[i]){
+            run++;
+        }
+        i += run;
+    }
+    return runs;
+}
+
+static int write_segment(FILE *file, WORD *memory, unsigned int start, unsigned int end){
+    WORD header[IMAGE_SEGMENT_HEADER_SIZE];
+    WORD runs_bytes[IMAGE_SEGMENT_RUNS_COUNT_SIZE];
+    WORD run_bytes[IMAGE_SEGMENT_RUN_SIZE];
+    unsigned int length, runs;
+
+    length = end - start;
+    runs = count_runs(memory + start, length);
+    store_big_endian(header, start, 4);
+    store_big_endian(header + 4, length, 4);
+    if(IMAGE_SEGMENT_RUNS_COUNT_SIZE + runs * IMAGE_SEGMENT_RUN_SIZE >= length){
+        header[8] = IMAGE_SEGMENT_RAW;
+        return fwrite(header, 1, IMAGE_SEGMENT_HEADER_SIZE, file) == IMAGE_SEGMENT_HEADER_SIZE
+            && fwrite(memory + start, 1, length, file) == length;
+    }
+    header[8] = IMAGE_SEGMENT_RLE;
+    store_big_endian(runs_bytes, runs, IMAGE_SEGMENT_RUNS_COUNT_SIZE);
+    if(fwrite(header, 1, IMAGE_SEGMENT_HEADER_SIZE, file) != IMAGE_SEGMENT_HEADER_SIZE
+        || fwrite(runs_bytes, 1, IMAGE_SEGMENT_RUNS_COUNT_SIZE, file) != IMAGE_SEGMENT_RUNS_COUNT_SIZE){
+        return 0;
+    }
+    for(unsigned int address = start; address < end;){
+        unsigned int run = 1;
+        while(address + run < end && run < IMAGE_SEGMENT_MAX_RUN && memory[address + run] == memory[address]){
+            run++;
+        }
+        store_big_endian(run_bytes, run, 2);
+        run_bytes[2] = memory[address];
+        if(fwrite(run_bytes, 1, IMAGE_SEGMENT_RUN_SIZE, file) != IMAGE_SEGMENT_RUN_SIZE){
+            return 0;
+        }
+        address += run;
+    }
+    return 1;
+}
+
+static int read_segment(FILE *file, WORD *memory){
+    WORD header[IMAGE_SEGMENT_HEADER_SIZE];
+    WORD runs_bytes[IMAGE_SEGMENT_RUNS_COUNT_SIZE];
+    WORD run_bytes[IMAGE_SEGMENT_RUN_SIZE];
+    unsigned int address, length, runs, filled;
+
+    if(fread(header, 1, IMAGE_SEGMENT_HEADER_SIZE, file) != IMAGE_SEGMENT_HEADER_SIZE){
+        return 0;
+    }
+    address = load_big_endian(header, 4);
+    length = load_big_endian(header + 4, 4);
+    if(address > MAX_MEMORY_SIZE || length > MAX_MEMORY_SIZE - address){
+        log_error("Segment of %u bytes at 0x%06X is out of memory", length, address);
+        return 0;
+    }
+    if(header[8] == IMAGE_SEGMENT_RAW){
+        return fread(memory + address, 1, length, file) == length;
+    }
+    if(header[8] != IMAGE_SEGMENT_RLE
+        || fread(runs_bytes, 1, IMAGE_SEGMENT_RUNS_COUNT_SIZE, file) != IMAGE_SEGMENT_RUNS_COUNT_SIZE){
+        return 0;
+    }
+    runs = load_big_endian(runs_bytes, IMAGE_SEGMENT_RUNS_COUNT_SIZE);
+    filled = 0;
+    for(unsigned int i = 0; i < runs; i++){
+        unsigned int run;
+        if(fread(run_bytes, 1, IMAGE_SEGMENT_RUN_SIZE, file) != IMAGE_SEGMENT_RUN_SIZE){
+            return 0;
+        }
+        run = load_big_endian(run_bytes, 2);
+        if(run > length - filled){
+            return 0;
+        }
+        // The memory is zero already.
+        if(run_bytes[2] != 0){
+            memset(memory + address + filled, run_bytes[2], run);
+        }
+        filled += run;
+    }
+    return filled == length;
+}
+
+/* Implementation. -----------------------------------------------------------*/
+int is_segmented_image(WORD *start){
+    return memcmp(start, IMAGE_FORMAT_MAGIC, IMAGE_FORMAT_MAGIC_SIZE) == 0;
+}
+
+int read_segmented_image(FILE *file, WORD *memory){
+    WORD header[IMAGE_FORMAT_HEADER_SIZE];
+    unsigned int segments_count;
+
+    if(fread(header, 1, IMAGE_FORMAT_HEADER_SIZE, file) != IMAGE_FORMAT_HEADER_SIZE
+        || !is_segmented_image(header)
+        || header[4] != IMAGE_FORMAT_VERSION){
+        log_error("Not a segmented image of version %d", IMAGE_FORMAT_VERSION);
+        return VM_IMAGE_LOAD_FAILED;
+    }
+    segments_count = load_big_endian(header + 9, 4);
+    for(unsigned int i = 0; i < segments_count; i++){
+        if(!read_segment(file, memory)){
+            log_error("Segment %u of the image is invalid", i);
+            return VM_IMAGE_LOAD_FAILED;
+        }
+    }
+    if(header[5] & IMAGE_FLAG_ENTRY_PC){
+        memcpy(memory + PC_HIGH_ADDRESS, header + 6, 3);
+    }
+    return VM_OK;
+}
+
+int write_segmented_image(WORD *memory, char *filename){
+    WORD header[IMAGE_FORMAT_HEADER_SIZE];
+    unsigned int segments_count, address;
+    FILE *file;
+    int written;
+
+    segments_count = 0;
+    for(address = find_next_segment(memory, 0); address < MAX_MEMORY_SIZE;
+        address = find_next_segment(memory, find_segment_end(memory, address))){
+        segments_count++;
+    }
+    file = fopen(filename, "wb");
+    if(file == NULL){
+        log_error("Failed to create image %s", filename);
+        return VM_IMAGE_LOAD_FAILED;
+    }
+    memcpy(header, IMAGE_FORMAT_MAGIC, IMAGE_FORMAT_MAGIC_SIZE);
+    header[4] = IMAGE_FORMAT_VERSION;
+    header[5] = IMAGE_FLAG_ENTRY_PC;
+    memcpy(header + 6, memory + PC_HIGH_ADDRESS, 3);
+    store_big_endian(header + 9, segments_count, 4);
+    written = fwrite(header, 1, IMAGE_FORMAT_HEADER_SIZE, file) == IMAGE_FORMAT_HEADER_SIZE;
+    for(address = find_next_segment(memory, 0); address < MAX_MEMORY_SIZE && written;){
+        unsigned int end = find_segment_end(memory, address);
+        written = write_segment(file, memory, address, end);
+        address = find_next_segment(memory, end);
+    }
+    if(fclose(file) != 0 || !written){
+        log_error("Failed to write image %s", filename);
+        return VM_IMAGE_LOAD_FAILED;
+    }
+    return VM_OK;
+}
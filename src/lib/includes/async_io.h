@@ -0,0 +1,95 @@
+#ifndef ASYNC_IO_H
+
+#define ASYNC_IO_H
+
+#include "vm.h"
+
+#include <pthread.h>
+
+/**
+ * Asynchronous I/O primitives.
+ *
+ * When vm->async_io is set, run_for does not execute the I/O primitives
+ * that may block its thread: it hands them to a pool of I/O threads shared
+ * by the process and returns RUN_FOR_BLOCKED, the VM being suspended until
+ * the primitive completed. The I/O thread executes the primitive as
+ * execute_primitive does, so its result code and data are in memory before
+ * the VM goes on. Meanwhile get_blocking_input_descriptor returns a
+ * descriptor that becomes readable once the primitive completed, which is
+ * how the scheduler parks such VMs.
+ *
+ * The primitives handed over are primitive_open_file, primitive_close_file,
+ * the block primitives, and primitive_get_char when no input is available
+ * on its stream. Other primitives, e.g. primitive_put_char, still run in
+ * the thread of the VM.
+ *
+ * A suspended VM must only be run with run_for, which returns
+ * RUN_FOR_BLOCKED until the primitive completed.
+ */
+
+/**
+ * Number of I/O threads, started on the first asynchronous primitive.
+ */
+#define ASYNC_IO_THREADS_COUNT 4
+
+// Values of the state field of async_io_request.
+#define ASYNC_IO_IDLE 0
+#define ASYNC_IO_SUBMITTED 1 // Queued or being executed by an I/O thread.
+#define ASYNC_IO_COMPLETED 2 // Executed, the VM did not resume yet.
+
+/**
+ * The asynchronous primitive of a VM, allocated on its first one and reused
+ * for the next ones.
+ */
+struct async_io_request{
+    struct virtual_machine *vm;
+    /**
+     * ASYNC_IO_IDLE, ASYNC_IO_SUBMITTED or ASYNC_IO_COMPLETED, protected by
+     * the lock of the I/O threads.
+     */
+    int state;
+    /**
+     * A byte is written to completion_pipe[1] when the primitive completed.
+     */
+    int completion_pipe[2];
+    /**
+     * Next request in the queue of the I/O threads.
+     */
+    struct async_io_request *next;
+};
+
+/**
+ * Returns TRUE if the primitive ready in vm is one that vm->async_io hands
+ * to the I/O threads.
+ */
+int is_async_primitive(struct virtual_machine *vm);
+
+/**
+ * Hands the primitive ready in vm to the I/O threads, starting them if
+ * needed.
+ *
+ * Returns VM_OK.
+ * Returns VM_ALLOCATION_FAILED if the request or the threads could not be
+ * created, in which case the primitive is still ready.
+ */
+int submit_async_primitive(struct virtual_machine *vm);
+
+/**
+ * Returns ASYNC_IO_SUBMITTED while the asynchronous primitive of vm runs.
+ * Returns ASYNC_IO_COMPLETED once it completed, and ASYNC_IO_IDLE from the
+ * next call on, so that vm can go on.
+ */
+int resume_async_primitive(struct virtual_machine *vm);
+
+/**
+ * Returns the descriptor that becomes readable when the asynchronous
+ * primitive of vm completes, -1 if vm has no primitive submitted.
+ */
+int get_async_completion_descriptor(struct virtual_machine *vm);
+
+/**
+ * Waits for the asynchronous primitive of vm, if any, and frees its request.
+ */
+void finalize_async_io(struct virtual_machine *vm);
+
+#endif
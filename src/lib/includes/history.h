@@ -0,0 +1,162 @@
+#ifndef HISTORY_H
+
+#define HISTORY_H
+
+#include "vm.h"
+
+/**
+ * Execution history.
+ *
+ * A ByteByteJump instruction writes exactly one byte, so undoing it only
+ * takes the address it wrote and the byte it overwrote. Once
+ * enable_vm_history was called, execute_recorded_instructions executes
+ * instructions like execute_instruction and appends one record per step to
+ * the history of the VM:
+ * - a flags byte, see HISTORY_STEP_PRIMITIVE,
+ * - the program counter and the address written, each as the difference
+ *   with those of the previous step (zigzag varints, usually one byte),
+ * - the overwritten byte,
+ * - with HISTORY_STEP_WRITES, the ranges written by the primitive executed
+ *   before the instruction or by the host since the previous step (see
+ *   notify_memory_write): a varint count of ranges, then for each of them
+ *   its varint address and length and the bytes it overwrote.
+ * rewind_vm applies those records in reverse to bring the memory back to
+ * any step still in the history. A copy of the memory as of the last step
+ * gives the bytes overwritten by primitives and the host, which notify
+ * their writes after doing them.
+ *
+ * The records of HISTORY_BLOCK_STEPS consecutive steps make a block, whose
+ * offset and first deltas are indexed. When the records outgrow the maximal
+ * size of the history, its oldest half is dropped.
+ *
+ * The file streams are not part of the history: rewinding a step that read
+ * input does not unread it.
+ */
+
+/**
+ * Number of steps of a block of records.
+ */
+#define HISTORY_BLOCK_STEPS 64
+
+/**
+ * Maximal size of the records of enable_vm_history when none is given.
+ */
+#define HISTORY_DEFAULT_MAX_SIZE 0x4000000
+
+// Flags of a step record.
+#define HISTORY_STEP_PRIMITIVE 0x01 // A primitive ran before the instruction.
+#define HISTORY_STEP_STOPPED 0x02 // The step stopped the VM.
+#define HISTORY_STEP_WRITES 0x04 // Ranges written by a primitive or the host follow.
+
+/**
+ * Start of the records of a block, and the program counter and written
+ * address of the step before its first one, from which its deltas start.
+ */
+struct history_block{
+    size_t offset;
+    unsigned int pc_address;
+    unsigned int write_address;
+};
+
+struct vm_history{
+    /**
+     * Records of the steps from first_step to steps, and their blocks.
+     */
+    unsigned char *records;
+    size_t size;
+    size_t capacity;
+    size_t max_size;
+    struct history_block *blocks;
+    size_t blocks_count;
+    size_t blocks_capacity;
+    /**
+     * First step that can be rewound to, and number of steps executed since
+     * enable_vm_history, the current step.
+     */
+    unsigned long long first_step;
+    unsigned long long steps;
+    /**
+     * Program counter and written address of the last step.
+     */
+    unsigned int pc_address;
+    unsigned int write_address;
+    /**
+     * Memory as of the last write recorded.
+     */
+    WORD *shadow;
+    /**
+     * Ranges written by a primitive or the host since the last step, encoded
+     * like in a record, and their count.
+     */
+    unsigned char *pending;
+    size_t pending_size;
+    size_t pending_capacity;
+    unsigned int pending_ranges;
+    /**
+     * TRUE when the ranges written since the last step could not all be
+     * kept: the history starts over after the next step.
+     */
+    int incomplete;
+    /**
+     * TRUE while rewind_vm writes the memory, whose writes are not recorded.
+     */
+    int rewinding;
+};
+
+/**
+ * Starts recording the steps of vm, from step 0, keeping at most max_size
+ * bytes of records (HISTORY_DEFAULT_MAX_SIZE if 0). Starts over if they are
+ * already recorded, which must be done when the memory of vm is replaced.
+ * The history is freed with the VM.
+ *
+ * Returns VM_OK.
+ * Returns VM_MEMORY_UNINITIALIZED if vm has no memory.
+ * Returns VM_ALLOCATION_FAILED if the history could not be allocated.
+ */
+int enable_vm_history(struct virtual_machine *vm, size_t max_size);
+
+/**
+ * Stops recording the steps of vm and frees its history.
+ */
+void disable_vm_history(struct virtual_machine *vm);
+
+/**
+ * Executes count instructions like execute_instruction, recording them.
+ * When the records could not be allocated, the history is dropped and
+ * starts over after the step.
+ *
+ * Returns VM_OK.
+ * Returns VM_HISTORY_UNAVAILABLE if the steps of vm are not recorded.
+ */
+int execute_recorded_instructions(struct virtual_machine *vm, unsigned long long count);
+
+/**
+ * Records that the length bytes starting at address were written by a
+ * primitive or the host, called by notify_memory_write.
+ */
+void record_memory_write(struct virtual_machine *vm, unsigned int address, unsigned int length);
+
+/**
+ * Returns the current step of vm, the number of steps recorded since
+ * enable_vm_history minus those rewound, 0 if its steps are not recorded.
+ */
+unsigned long long get_history_step(struct virtual_machine *vm);
+
+/**
+ * Returns the first step vm can be rewound to.
+ */
+unsigned long long get_history_first_step(struct virtual_machine *vm);
+
+/**
+ * Brings the memory, program counter, status and retired counters of vm
+ * back to what they were before step, and drops the records of the steps
+ * from step onwards. The writes done by the host since the last step are
+ * undone too.
+ *
+ * Returns VM_OK.
+ * Returns VM_HISTORY_UNAVAILABLE if the steps of vm are not recorded, or if
+ * step is not between the first step of the history and the current one.
+ */
+int rewind_vm(struct virtual_machine *vm, unsigned long long step);
+
+#endif
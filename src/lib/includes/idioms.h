@@ -0,0 +1,139 @@
+#ifndef IDIOMS_H
+
+#define IDIOMS_H
+
+#include "memory.h"
+#include "vm.h"
+
+#include <stdio.h>
+
+/**
+ * Idiom recognition for the fast engine.
+ *
+ * ByteByteJump programs compute with 256-byte lookup tables: an instruction
+ * copies a value into the low byte of the from address of the instruction it
+ * jumps to, which then copies the table entry indexed by this value.
+ *
+ *     A: value            -> B + FROM_ADDRESS_LOW_OFFSET, jump B
+ *     B: table_page:value -> result,                      jump next
+ *
+ * When run_fast decodes an instruction A starting such a pair, install_idiom_at
+ * installs the pair in the decoded-instruction cache as a single operation
+ * doing both copies, so that run_fast dispatches once instead of twice and
+ * does not decode B again every time A patches it. Only the code that runs is
+ * looked at, and an idiom dropped because B was rewritten is installed again
+ * the next time A is decoded.
+ * The table is still read from memory, so the memory effects are exactly the
+ * ones of the two instructions whatever the content of the table. Its content
+ * when the pair is found only classifies the idiom in the report.
+ */
+
+/**
+ * Kinds of idioms, according to the table row indexed by the pair.
+ */
+#define IDIOM_INCREMENT 0 // table[i] == i + 1
+#define IDIOM_DECREMENT 1 // table[i] == i - 1
+#define IDIOM_ADD 2 // table[i] == i + k, rows of 2-dimensional addition tables
+#define IDIOM_COMPARE 3 // table[i] has one value for a single i, another one elsewhere
+#define IDIOM_LOOKUP 4 // any other table
+
+#define IDIOM_KINDS_COUNT 5
+
+/**
+ * A table lookup whose patching instruction is at pc_address.
+ */
+struct idiom{
+    unsigned int pc_address;
+    /**
+     * Address of the lookup instruction, the jump address of the patching
+     * one.
+     */
+    unsigned int lookup_address;
+    unsigned int to_address;
+    unsigned int jump_address;
+    int kind;
+    /**
+     * FALSE once a byte of the lookup instruction kept in the idiom was
+     * written: the instructions of the pair are then decoded again.
+     */
+    int active;
+    /**
+     * Number of executions, each of them saves the dispatch of one
+     * instruction.
+     */
+    unsigned long long hits;
+};
+
+struct idiom_table{
+    struct idiom *idioms;
+    unsigned int count;
+    unsigned int capacity;
+    /**
+     * Indexes of the count idioms sorted by lookup address, to find the ones
+     * relying on a written byte.
+     */
+    unsigned int *by_lookup;
+};
+
+/**
+ * Counters describing the idioms of a VM.
+ */
+struct idiom_statistics{
+    unsigned int matched[IDIOM_KINDS_COUNT];
+    /**
+     * Dispatches saved by each kind of idiom: one per execution, the lookup
+     * instruction running along with the patching one.
+     */
+    unsigned long long saved_dispatches[IDIOM_KINDS_COUNT];
+};
+
+/**
+ * Gives vm an empty idiom table, so that install_idiom_at recognizes idioms.
+ * Replaces the idioms found before.
+ *
+ * Returns VM_OK.
+ * Returns VM_MEMORY_ALLOCATION_FAILED if the table could not be allocated.
+ */
+int enable_idioms(struct virtual_machine *vm);
+
+/**
+ * Installs the idiom started by the instruction at pc_address, just decoded
+ * in the cache of vm, if it patches the instruction it jumps to. Its entry
+ * then becomes a DECODED_IDIOM one. An idiom dropped before is reused, with
+ * its counters.
+ * Does nothing if idioms are not enabled or could not be stored.
+ *
+ * Returns TRUE if an idiom was installed.
+ */
+int install_idiom_at(struct virtual_machine *vm, unsigned int pc_address);
+
+/**
+ * Drops the idioms relying on the byte at address, which was written: their
+ * patching instructions are decoded again when executed. The other idioms
+ * are kept.
+ */
+void drop_idioms_at(struct virtual_machine *vm, unsigned int address);
+
+/**
+ * Drops the idioms of vm and frees them.
+ */
+void flush_idioms(struct virtual_machine *vm);
+
+/**
+ * Copies the counters of the idioms of vm in statistics.
+ * All counters are 0 if idioms were not enabled.
+ */
+void get_idiom_statistics(struct virtual_machine *vm, struct idiom_statistics *statistics);
+
+/**
+ * Returns the name of an idiom kind.
+ */
+char *get_idiom_kind_name(int kind);
+
+/**
+ * Prints the idioms of vm that were matched and the number of dispatches
+ * they saved on stream.
+ */
+void print_idiom_report(struct virtual_machine *vm, FILE *stream);
+
+#endif
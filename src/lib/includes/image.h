@@ -0,0 +1,159 @@
+#ifndef IMAGE_H
+
+#define IMAGE_H
+
+#include "memory.h"
+#include "vm.h"
+
+/**
+ * Copy-on-write VM memories.
+ *
+ * An image holds a complete VM memory in a memory file (memfd, or a POSIX
+ * shared memory object when it has a name). The VMs forked from an image map
+ * it privately: they share its pages with every other VM and process mapping
+ * it until they write them, so forking costs a mapping whatever the size of
+ * the image, and a VM only owns the pages it wrote.
+ */
+
+/**
+ * Number of attempts to open a shared image another process is still
+ * filling, IMAGE_OPEN_DELAY microseconds apart.
+ */
+#define IMAGE_OPEN_ATTEMPTS 5000
+#define IMAGE_OPEN_DELAY 1000
+
+/**
+ * Checkpoints.
+ *
+ * A chain of checkpoints starts with a full checkpoint holding the memory,
+ * PC and status of a VM. Each following one is incremental: it only holds
+ * the pages written since the previous checkpoint, with the PC and status.
+ * Once a VM wrote a full checkpoint, its memory is a private mapping of a
+ * memory file holding it as of its last checkpoint: the pages it wrote since
+ * are the private ones, found in /proc/self/pagemap (or by comparing them
+ * with the memory file when it is not available). Writing a checkpoint
+ * copies them to the memory file and maps it again, at the same address.
+ *
+ * A checkpoint file is made of a header:
+ *   magic "JLCK" (4 bytes), CHECKPOINT_VERSION (1), CHECKPOINT_FULL or
+ *   CHECKPOINT_INCREMENTAL (1), index in the chain (4), page size (4),
+ *   PC (3), status (1), number of pages (4),
+ * followed by each page: its number (4), then its bytes (the page size, or
+ * less for the last page of memory). Numbers are big-endian, like
+ * addresses. Pages missing from a full checkpoint are zero.
+ */
+#define CHECKPOINT_MAGIC "JLCK"
+#define CHECKPOINT_VERSION 1
+#define CHECKPOINT_FULL 0
+#define CHECKPOINT_INCREMENTAL 1
+#define CHECKPOINT_HEADER_SIZE 22
+#define CHECKPOINT_PAGE_NUMBER_SIZE 4
+
+struct vm_image{
+    /**
+     * Memory file of MAX_MEMORY_SIZE bytes.
+     */
+    int descriptor;
+    /**
+     * TRUE if new_image created the shared memory object of the image, FALSE
+     * if it opened an existing one or the image is not shared.
+     */
+    int created;
+};
+
+/**
+ * Creates an image holding the memory stored in the file at filename, zero
+ * after the end of the file.
+ * When shared_name is not NULL, the image is the POSIX shared memory object
+ * of this name (e.g. "/jolly-hello"): it is filled from the file if it does
+ * not exist yet, else opened as is, so that every process using the name
+ * shares the same pages. The object outlives the processes using it until
+ * it is unlinked with unlink_shared_image: its owner, usually the process
+ * that created it (see the created field), is expected to unlink it once
+ * no other process should attach to it anymore.
+ *
+ * Returns VM_OK.
+ * Returns VM_ALLOCATION_FAILED if the image could not be allocated.
+ * Returns VM_IMAGE_LOAD_FAILED if the file could not be read or the shared
+ * object opened.
+ */
+int new_image(struct vm_image **image, char *filename, char *shared_name);
+
+/**
+ * Removes the name of the shared image shared_name, so that the next
+ * new_image with this name creates a new one. The processes using the image
+ * keep their pages, which are freed when the last of them exits.
+ *
+ * Returns VM_OK.
+ * Returns VM_IMAGE_LOAD_FAILED if there is no shared image of this name.
+ */
+int unlink_shared_image(char *shared_name);
+
+/**
+ * Creates an image holding a copy of the current memory of vm.
+ *
+ * Returns VM_OK.
+ * Returns VM_ALLOCATION_FAILED if the image could not be allocated.
+ */
+int new_image_from_vm(struct vm_image **image, struct virtual_machine *vm);
+
+/**
+ * Frees the image. The VMs forked from it keep their memory.
+ */
+void free_image(struct vm_image *image);
+
+/**
+ * Creates a VM whose memory is a private mapping of image, with its PC
+ * loaded from memory.
+ *
+ * Returns VM_OK.
+ * Returns VM_ALLOCATION_FAILED if the VM could not be created.
+ * Returns VM_MEMORY_ALLOCATION_FAILED if the image could not be mapped.
+ */
+int fork_from_image(struct virtual_machine **vm, struct vm_image *image);
+
+/**
+ * Creates a VM with the memory, PC and status of parent, sharing the pages
+ * parent did not write with it.
+ * If the memory of parent is not mapped from an image, it is copied into a
+ * new one first and parent is moved to a private mapping of it, so only the
+ * first clone of such a VM costs a copy of its memory. The following ones
+ * only copy the pages parent wrote since.
+ * Files opened by parent are not shared: the clone starts with the standard
+ * streams only.
+ * The next checkpoint of parent is a full one, as its memory file is shared
+ * with the clone.
+ *
+ * Returns VM_OK.
+ * Returns VM_ALLOCATION_FAILED if the clone could not be created.
+ * Returns VM_MEMORY_ALLOCATION_FAILED if memory could not be mapped.
+ */
+int clone_vm(struct virtual_machine **clone, struct virtual_machine *parent);
+
+/**
+ * Writes the next checkpoint of vm to filename: a full one if
+ * vm->checkpoints_count is 0, else the pages written since the previous one.
+ * The memory of a VM given with set_memory cannot be remapped, so all its
+ * checkpoints are full ones.
+ * Can be called while vm runs, from a primitive.
+ *
+ * Returns VM_OK.
+ * Returns VM_CHECKPOINT_FAILED if the file could not be written, in which
+ * case the chain is not extended.
+ */
+int write_checkpoint(struct virtual_machine *vm, char *filename);
+
+/**
+ * Creates a VM from the chain of count checkpoint files, the full one first.
+ * Its memory is a private mapping of the memory they rebuild, and its next
+ * checkpoint continues the chain. Only the standard streams are open.
+ *
+ * Returns VM_OK.
+ * Returns VM_ALLOCATION_FAILED if the VM could not be created.
+ * Returns VM_MEMORY_ALLOCATION_FAILED if its memory could not be mapped.
+ * Returns VM_IMAGE_LOAD_FAILED if a file could not be read or is not the
+ * next checkpoint of the chain.
+ */
+int restore_checkpoint(struct virtual_machine **vm, char **filenames, unsigned int count);
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef IMAGE_FORMAT_H
+
+#define IMAGE_FORMAT_H
+
+#include <stdio.h>
+
+#include "memory.h"
+#include "vm.h"
+
+/**
+ * Image files.
+ *
+ * An image file is either raw, the content of the memory from address
+ * 0x000000 up to its last non-zero byte, or segmented: a header followed by
+ * the segments of memory that are not zero, so that a program using the end
+ * of the memory does not need a file of 16 MiB. The loaders tell them apart
+ * with the magic number starting segmented images.
+ *
+ * A segmented image starts with:
+ *   magic "JLIM" (4 bytes), IMAGE_FORMAT_VERSION (1), flags (1),
+ *   entry PC (3), number of segments (4),
+ * followed by each segment:
+ *   address (4), length (4), IMAGE_SEGMENT_RAW or IMAGE_SEGMENT_RLE (1),
+ * then its content. A raw segment holds its length bytes. A run-length
+ * encoded segment holds its number of runs (4), then each run: its length
+ * (2), and the byte repeated (1); the lengths of the runs add up to the
+ * length of the segment.
+ * Numbers are big-endian, like addresses. The memory outside the segments
+ * is zero. When the IMAGE_FLAG_ENTRY_PC flag is set, the entry PC is written
+ * at PC_HIGH_ADDRESS once the segments are loaded.
+ */
+#define IMAGE_FORMAT_MAGIC "JLIM"
+#define IMAGE_FORMAT_MAGIC_SIZE 4
+#define IMAGE_FORMAT_VERSION 1
+#define IMAGE_FORMAT_HEADER_SIZE 13
+#define IMAGE_SEGMENT_HEADER_SIZE 9
+
+#define IMAGE_FLAG_ENTRY_PC 1
+
+#define IMAGE_SEGMENT_RAW 0
+#define IMAGE_SEGMENT_RLE 1
+
+// Longest run of a run-length encoded segment.
+#define IMAGE_SEGMENT_MAX_RUN 0xFFFF
+
+// Shortest run of zeros ending a segment when writing an image: shorter ones
+// cost less as part of the segment than the header of a new one.
+#define IMAGE_SEGMENT_MIN_GAP 32
+
+/**
+ * Returns TRUE if the file starting with the IMAGE_FORMAT_MAGIC_SIZE bytes
+ * at start is a segmented image.
+ */
+int is_segmented_image(WORD *start);
+
+/**
+ * Loads the segmented image read from file into memory, which must be
+ * MAX_MEMORY_SIZE bytes of zero. Zero regions are not touched.
+ *
+ * Returns VM_OK.
+ * Returns VM_IMAGE_LOAD_FAILED if the file is not a valid segmented image.
+ */
+int read_segmented_image(FILE *file, WORD *memory);
+
+/**
+ * Writes memory to filename as a segmented image, whose entry PC is the one
+ * stored at PC_HIGH_ADDRESS. Runs of bytes are run-length encoded when it
+ * makes their segment smaller.
+ *
+ * Returns VM_OK.
+ * Returns VM_IMAGE_LOAD_FAILED if the file could not be written.
+ */
+int write_segmented_image(WORD *memory, char *filename);
+
+#endif
@@ -0,0 +1,140 @@
+#ifndef IO_LOG_H
+
+#define IO_LOG_H
+
+#include <stdio.h>
+
+#include "memory.h"
+#include "vm.h"
+
+/**
+ * Input/output capture and replay.
+ *
+ * The primitives that depend on the world outside the VM (streams, files,
+ * command line arguments, checkpoints and extended primitives, see
+ * is_logged_primitive) make runs of the same image differ. Once record_io
+ * was called on a VM, execute_primitive writes to a file, for each of these
+ * primitives, the bytes of memory it wrote and the status of the VM after
+ * it. Once replay_io was called on a VM, execute_primitive does not execute
+ * these primitives anymore: it reads their effects back from the file, so
+ * that the run writes the same memory and retires the same instructions and
+ * primitives without touching any stream. The other primitives are
+ * executed in both cases.
+ *
+ * An I/O log file starts with:
+ *   magic "JLIO" (4 bytes), IO_LOG_VERSION (1),
+ * followed by an entry per logged primitive:
+ *   primitive id (1), status of the VM (1), result code (1),
+ *   number of ranges (4),
+ * then each range the primitive notified with notify_memory_write: address
+ * (4), length (4), and its length bytes as the primitive left them. Numbers
+ * are big-endian, like addresses.
+ *
+ * A replay fails when the VM calls another primitive than the one logged,
+ * or more primitives than logged: the VM is then stopped, and
+ * close_io_log returns VM_IO_LOG_FAILED.
+ */
+
+#define IO_LOG_MAGIC "JLIO"
+#define IO_LOG_MAGIC_SIZE 4
+#define IO_LOG_VERSION 1
+#define IO_LOG_HEADER_SIZE 5
+#define IO_LOG_ENTRY_HEADER_SIZE 7
+#define IO_LOG_RANGE_HEADER_SIZE 8
+
+// Values of the mode field of I/O logs.
+#define IO_LOG_RECORD 0
+#define IO_LOG_REPLAY 1
+
+struct io_log_range{
+    unsigned int address;
+    unsigned int length;
+};
+
+struct io_log{
+    FILE *file;
+    int mode;
+    /**
+     * Ranges notified by the logged primitive being recorded, while
+     * capturing is TRUE.
+     */
+    int capturing;
+    struct io_log_range *ranges;
+    unsigned int ranges_count;
+    unsigned int ranges_capacity;
+    /**
+     * Number of primitives recorded or replayed.
+     */
+    unsigned long long entries;
+    /**
+     * TRUE once the file could not be written or read, or the replay
+     * diverged.
+     */
+    int failed;
+};
+
+/**
+ * Starts writing the effects of the logged primitives of vm to the file
+ * filename.
+ *
+ * Returns VM_OK.
+ * Returns VM_IO_LOG_FAILED if the file could not be created.
+ * Returns VM_ALLOCATION_FAILED if the log could not be allocated.
+ */
+int record_io(struct virtual_machine *vm, char *filename);
+
+/**
+ * Starts replaying the logged primitives of vm from the file filename.
+ *
+ * Returns VM_OK.
+ * Returns VM_IO_LOG_FAILED if the file could not be read or is not an I/O
+ * log.
+ * Returns VM_ALLOCATION_FAILED if the log could not be allocated.
+ */
+int replay_io(struct virtual_machine *vm, char *filename);
+
+/**
+ * Stops recording or replaying the primitives of vm, closing the file.
+ * Done by free_vm too.
+ *
+ * Returns VM_OK.
+ * Returns VM_IO_LOG_FAILED if the log could not be written, or if the
+ * replay diverged from it.
+ */
+int close_io_log(struct virtual_machine *vm);
+
+/**
+ * Returns TRUE if vm replays its logged primitives.
+ */
+int is_replaying_io(struct virtual_machine *vm);
+
+/**
+ * Returns TRUE if the effects of the primitive primitive_id are logged.
+ */
+int is_logged_primitive(unsigned int primitive_id);
+
+/**
+ * Starts capturing the writes of the logged primitive vm executes, called
+ * by execute_primitive.
+ */
+void begin_logged_primitive(struct virtual_machine *vm);
+
+/**
+ * Writes the entry of the logged primitive primitive_id that vm executed,
+ * called by execute_primitive.
+ */
+void end_logged_primitive(struct virtual_machine *vm, unsigned int primitive_id);
+
+/**
+ * Applies the next entry of the log instead of executing the primitive
+ * primitive_id, called by execute_primitive.
+ */
+void replay_logged_primitive(struct virtual_machine *vm, unsigned int primitive_id);
+
+/**
+ * Adds a range written by the logged primitive being recorded, called by
+ * notify_memory_write.
+ */
+void add_logged_write(struct virtual_machine *vm, unsigned int address, unsigned int length);
+
+#endif
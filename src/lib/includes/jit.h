@@ -0,0 +1,51 @@
+#ifndef JIT_H
+
+#define JIT_H
+
+#include "memory.h"
+#include "trace.h"
+
+/**
+ * x86-64 backend of the trace engine, only built when the JOLLY_ENABLE_JIT
+ * CMake option is ON on an x86-64 host.
+ *
+ * The moves of a trace are emitted as machine code in their own mmap'd
+ * buffer, writable while it is filled and executable afterwards. The jumps
+ * of a chain are resolved when the trace is compiled, so the code is a
+ * straight sequence of byte copies:
+ * - a static move is a movzx from memory[from_address] followed by a mov to
+ *   memory[to_address].
+ * - a dynamic move decodes its operands from memory first, then returns to
+ *   the trace engine if it wrote a protected byte or the
+ *   PRIMITIVE_IS_READY_ADDRESS byte.
+ */
+
+/**
+ * Set in the result of native code stopped by a dynamic move.
+ */
+#define JIT_EARLY_EXIT 0x80000000
+
+/**
+ * Native code of a trace. Executes the moves of the trace on memory and
+ * returns the number of moves executed in its low 31 bits.
+ * When the last move executed is a dynamic move that wrote a byte set in
+ * protected or the PRIMITIVE_IS_READY_ADDRESS byte, JIT_EARLY_EXIT is set
+ * and the high 32 bits hold the address written by this move.
+ */
+typedef unsigned long long (*jit_function)(WORD *memory, unsigned char *protected);
+
+/**
+ * Emits the native code of trace and stores it in trace->native_code.
+ *
+ * Returns VM_OK.
+ * Returns VM_MEMORY_ALLOCATION_FAILED if no executable buffer could be
+ * mapped, trace->native_code is then NULL.
+ */
+int jit_compile_trace(struct trace *trace);
+
+/**
+ * Unmaps the native code of trace, if any.
+ */
+void jit_free_trace(struct trace *trace);
+
+#endif
@@ -17,12 +17,78 @@ typedef void (*log_LockFn)(void *udata, int lock);
 
 enum { LOG_TRACE, LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR, LOG_FATAL };
 
-#define log_trace(...) log_log(LOG_TRACE, __FILE__, __LINE__, __VA_ARGS__)
-#define log_debug(...) log_log(LOG_DEBUG, __FILE__, __LINE__, __VA_ARGS__)
-#define log_info(...)  log_log(LOG_INFO,  __FILE__, __LINE__, __VA_ARGS__)
-#define log_warn(...)  log_log(LOG_WARN,  __FILE__, __LINE__, __VA_ARGS__)
-#define log_error(...) log_log(LOG_ERROR, __FILE__, __LINE__, __VA_ARGS__)
-#define log_fatal(...) log_log(LOG_FATAL, __FILE__, __LINE__, __VA_ARGS__)
+/**
+ * Messages of a level below LOG_COMPILED_LEVEL (0 for LOG_TRACE up to 4 for
+ * LOG_ERROR, fatal messages are always compiled) are compiled out, their
+ * arguments are never evaluated.
+ * The level set with log_set_level is checked before the arguments are
+ * evaluated too, so disabled messages only cost a comparison.
+ */
+#ifndef LOG_COMPILED_LEVEL
+#define LOG_COMPILED_LEVEL 0
+#endif
+
+extern int log_level;
+
+#define log_at(level, ...) \
+  do { \
+    if ((level) >= log_level) { \
+      log_log((level), __FILE__, __LINE__, __VA_ARGS__); \
+    } \
+  } while (0)
+
+/* Never called, keeps the arguments used. */
+#define log_compiled_out(...) \
+  do { \
+    if (0) { \
+      log_log(LOG_TRACE, __FILE__, __LINE__, __VA_ARGS__); \
+    } \
+  } while (0)
+
+#if LOG_COMPILED_LEVEL <= 0
+#define log_trace(...) log_at(LOG_TRACE, __VA_ARGS__)
+#else
+#define log_trace(...) log_compiled_out(__VA_ARGS__)
+#endif
+#if LOG_COMPILED_LEVEL <= 1
+#define log_debug(...) log_at(LOG_DEBUG, __VA_ARGS__)
+#else
+#define log_debug(...) log_compiled_out(__VA_ARGS__)
+#endif
+#if LOG_COMPILED_LEVEL <= 2
+#define log_info(...)  log_at(LOG_INFO, __VA_ARGS__)
+#else
+#define log_info(...)  log_compiled_out(__VA_ARGS__)
+#endif
+#if LOG_COMPILED_LEVEL <= 3
+#define log_warn(...)  log_at(LOG_WARN, __VA_ARGS__)
+#else
+#define log_warn(...)  log_compiled_out(__VA_ARGS__)
+#endif
+#if LOG_COMPILED_LEVEL <= 4
+#define log_error(...) log_at(LOG_ERROR, __VA_ARGS__)
+#else
+#define log_error(...) log_compiled_out(__VA_ARGS__)
+#endif
+#define log_fatal(...) log_at(LOG_FATAL, __VA_ARGS__)
+
+/**
+ * Asynchronous logging.
+ *
+ * Once log_set_async(1) was called, log_log does not format messages: it
+ * copies the time, level, site and arguments of each message into a
+ * fixed-size event of a ring buffer owned by the calling thread, without
+ * taking any lock. A background thread formats the events of all the rings
+ * every LOG_ASYNC_PERIOD microseconds and writes them where the synchronous
+ * log_log would. The arguments are read according to the format; strings
+ * are copied, up to LOG_EVENT_TEXT_SIZE bytes for all the strings of a
+ * message, and at most LOG_EVENT_ARGS_COUNT arguments are kept. Events are
+ * dropped, and counted, when a ring is full.
+ */
+#define LOG_RING_SIZE 1024
+#define LOG_EVENT_ARGS_COUNT 8
+#define LOG_EVENT_TEXT_SIZE 64
+#define LOG_ASYNC_PERIOD 5000
 
 void log_set_udata(void *udata);
 void log_set_lock(log_LockFn fn);
@@ -30,6 +96,23 @@ void log_set_fp(FILE *fp);
 void log_set_level(int level);
 void log_set_quiet(int enable);
 
+/**
+ * Switches to asynchronous logging, starting the background thread, or back
+ * to synchronous logging once the events recorded are written.
+ * Returns 0, -1 if the thread could not be started.
+ */
+int log_set_async(int enable);
+
+/**
+ * Writes the events recorded so far, when logging is asynchronous.
+ */
+void log_flush(void);
+
+/**
+ * Returns the number of events dropped because their ring was full.
+ */
+unsigned long long log_get_dropped(void);
+
 void log_log(int level, const char *file, int line, const char *fmt, ...);
 
 #endif
@@ -28,6 +28,18 @@
 #define PRIMITIVE_ID_SUBSTRACT_ADDRESSES 12
 #define PRIMITIVE_ID_DECREMENT_ADDRESS 13
 #define PRIMITIVE_ID_INCREMENT_ADDRESS 14
+#define PRIMITIVE_ID_CHECKPOINT 15
+#define PRIMITIVE_ID_READ_BLOCK 16
+#define PRIMITIVE_ID_WRITE_BLOCK 17
+#define PRIMITIVE_ID_READ_UNTIL 18
+#define PRIMITIVE_ID_COPY_MEMORY 19
+#define PRIMITIVE_ID_FILL_MEMORY 20
+#define PRIMITIVE_ID_COMPARE_MEMORY 21
+#define PRIMITIVE_ID_FIND_BYTE 22
+#define PRIMITIVE_ID_STRING_LENGTH 23
+#define PRIMITIVE_ID_ARITHMETIC 24
+#define PRIMITIVE_ID_ARITHMETIC_ARRAY 25
+#define PRIMITIVE_ID_POLL_STREAM 26
 
 #define PRIMITIVE_ID_EXTENDED 255
 
@@ -48,6 +60,30 @@
 #define PRIMITIVE_FILE_MODE_WRITE 1
 #define PRIMITIVE_FILE_MODE_APPEND 2
 
+// Flags stored by primitive_poll_stream.
+#define PRIMITIVE_STREAM_NOT_READY 0
+#define PRIMITIVE_STREAM_READABLE 1
+#define PRIMITIVE_STREAM_WRITABLE 2
+
+#define PRIMITIVE_COMPARE_EQUAL 0
+#define PRIMITIVE_COMPARE_LESS 1
+#define PRIMITIVE_COMPARE_GREATER 2
+
+#define PRIMITIVE_ARITHMETIC_ADD 0
+#define PRIMITIVE_ARITHMETIC_SUBTRACT 1
+#define PRIMITIVE_ARITHMETIC_MULTIPLY 2
+#define PRIMITIVE_ARITHMETIC_DIVIDE 3
+#define PRIMITIVE_ARITHMETIC_COMPARE 4
+#define PRIMITIVE_ARITHMETIC_SHIFT_LEFT 5
+#define PRIMITIVE_ARITHMETIC_SHIFT_RIGHT 6
+#define PRIMITIVE_ARITHMETIC_AND 7
+#define PRIMITIVE_ARITHMETIC_OR 8
+#define PRIMITIVE_ARITHMETIC_XOR 9
+
+// Widths of the operands of arithmetic primitives, in bytes.
+#define PRIMITIVE_ARITHMETIC_WORD 1
+#define PRIMITIVE_ARITHMETIC_ADDRESS 3
+
 struct virtual_machine;
 
 int initialize_primitives_data(struct virtual_machine *vm);
@@ -192,17 +228,278 @@ void primitive_argv(struct virtual_machine *vm);
  */
 void primitive_add_addresses(struct virtual_machine *vm);
 
+/**
+ * A primitive that substracts an address (3 bytes) from another one and
+ * stores the result and the borrow.
+ *
+ * Reads the 6 consecutive bytes in memory pointed by the result pointer and
+ * consider the 3 first bytes as the first address and the 3 next as the
+ * address to substract from it.
+ *
+ * Stores the result of the substraction, modulo 0x1000000, in the 3 first
+ * bytes pointed by the result pointer and stores either the second address
+ * was greater than the first one (1) or not (0) in the following byte.
+ */
 void primitive_substract_addresses(struct virtual_machine *vm);
 
 void primitive_decrement_address(struct virtual_machine *vm);
 
 void primitive_increment_address(struct virtual_machine *vm);
 
+/**
+ * A primitive that writes the next checkpoint of the VM (see
+ * write_checkpoint in image.h) to the file path provided as argument.
+ *
+ * Reads the null-terminated ASCII string starting at the byte pointed by the
+ * result pointer, the path of the checkpoint file.
+ *
+ * The checkpoint holds the VM as it is once the primitive returns, so a VM
+ * restored from it goes on after the call and does not call it again. It
+ * always records a success: if writing the file fails, only the running VM
+ * sees the primitive fail.
+ */
+void primitive_checkpoint(struct virtual_machine *vm);
+
+/**
+ * The block primitives move a buffer between a stream and memory in one
+ * call. They read their arguments at the result pointer:
+ * - the id of the stream (1 byte),
+ * - the address of the buffer (3 bytes),
+ * - the length of the buffer (3 bytes),
+ * - for primitive_read_until only, the delimiter (1 byte).
+ * They store the number of bytes transferred in the 3 bytes pointed by the
+ * result pointer (thus, the id of the stream and the start of the address
+ * of the buffer are erased!).
+ * They fail if the stream is not open or the buffer does not fit in the
+ * 0x1000000 addressable bytes.
+ */
+
+/**
+ * A block primitive that reads the length of the buffer from the stream
+ * into the buffer, or less at the end of the stream. It waits for the whole
+ * buffer: interactive input is better read with primitive_read_until.
+ * It fails if no byte could be read at all.
+ */
+void primitive_read_block(struct virtual_machine *vm);
+
+/**
+ * A block primitive that writes the buffer to the stream. It fails if the
+ * buffer could not be written completely.
+ */
+void primitive_write_block(struct virtual_machine *vm);
+
+/**
+ * A block primitive that reads from the stream into the buffer until it
+ * read the delimiter, which is stored in the buffer as well, or the buffer
+ * is full. It fails if no byte could be read at all.
+ */
+void primitive_read_until(struct virtual_machine *vm);
+
+/**
+ * A primitive that computes an arithmetic operation on 2 unsigned operands
+ * of 1 or 3 bytes.
+ *
+ * Reads at the result pointer the operation, one of PRIMITIVE_ARITHMETIC_ADD
+ * to PRIMITIVE_ARITHMETIC_XOR (1 byte), the width of the operands,
+ * PRIMITIVE_ARITHMETIC_WORD or PRIMITIVE_ARITHMETIC_ADDRESS (1 byte), then
+ * the operands x and y (width bytes each, big-endian).
+ *
+ * Stores its result at the result pointer (thus, the arguments are erased!):
+ * - ADD: x + y (width bytes) then the carry (1 byte).
+ * - SUBTRACT: x - y (width bytes) then the borrow (1 byte).
+ * - MULTIPLY: the low then the high width bytes of x * y.
+ * - DIVIDE: the quotient then the remainder of x / y (width bytes each).
+ *   Fails if y is 0.
+ * - COMPARE: PRIMITIVE_COMPARE_EQUAL, PRIMITIVE_COMPARE_LESS if x < y or
+ *   PRIMITIVE_COMPARE_GREATER (1 byte).
+ * - SHIFT_LEFT, SHIFT_RIGHT: x shifted by y bits (width bytes).
+ * - AND, OR, XOR: x & y, x | y, x ^ y (width bytes).
+ * Fails if the operation or the width is not one of those.
+ */
+void primitive_arithmetic(struct virtual_machine *vm);
+
+/**
+ * A primitive that computes an arithmetic operation on each pair of
+ * elements of 2 arrays, see primitive_arithmetic.
+ *
+ * Reads at the result pointer the operation (1 byte), the width of the
+ * operands (1 byte), the number of elements (3 bytes), then the addresses of
+ * the array of x operands, of the array of y operands and of the destination
+ * array (3 bytes each). Operands are width bytes each.
+ *
+ * Stores the result of each pair in the destination array, laid out as
+ * primitive_arithmetic stores it (e.g. 4 bytes per element for an ADD of
+ * addresses), in order from the first element.
+ * Fails if the arguments or an array do not fit in memory, or on a division
+ * by zero, in which case the elements before it are stored.
+ */
+void primitive_arithmetic_array(struct virtual_machine *vm);
+
+/**
+ * The memory primitives work on ranges of memory given by their address and
+ * length, in 3 bytes each, read at the result pointer. A range going past
+ * the 0x1000000 addressable bytes is cut at the end of memory. They run in
+ * one call what a program does one instruction per byte, using the
+ * vectorized string functions of the C library.
+ */
+
+/**
+ * A memory primitive that copies a range of memory to another one, which
+ * may overlap it.
+ *
+ * Reads at the result pointer the destination address, the source address
+ * and the length, 3 bytes each.
+ * Stores the number of bytes copied, the length unless a range was cut, in
+ * the 3 bytes pointed by the result pointer.
+ */
+void primitive_copy_memory(struct virtual_machine *vm);
+
+/**
+ * A memory primitive that sets every byte of a range of memory to a value.
+ *
+ * Reads at the result pointer the destination address and the length, 3
+ * bytes each, then the value (1 byte).
+ * Stores the number of bytes set in the 3 bytes pointed by the result
+ * pointer.
+ */
+void primitive_fill_memory(struct virtual_machine *vm);
+
+/**
+ * A memory primitive that compares 2 ranges of memory of the same length,
+ * byte by byte as unsigned values.
+ *
+ * Reads at the result pointer the address of the first range, the address
+ * of the second one and the length, 3 bytes each.
+ * Stores PRIMITIVE_COMPARE_EQUAL, PRIMITIVE_COMPARE_LESS if the first range
+ * is lower or PRIMITIVE_COMPARE_GREATER if it is greater in the byte pointed
+ * by the result pointer.
+ */
+void primitive_compare_memory(struct virtual_machine *vm);
+
+/**
+ * A memory primitive that finds the first occurrence of a byte in a range
+ * of memory.
+ *
+ * Reads at the result pointer the address and the length of the range, 3
+ * bytes each, then the byte to find (1 byte).
+ * Stores the address of the first occurrence, or 0 if there is none, in the
+ * 3 bytes pointed by the result pointer, and whether the byte was found (1)
+ * or not (0) in the following byte.
+ */
+void primitive_find_byte(struct virtual_machine *vm);
+
+/**
+ * A memory primitive that measures a null-terminated string.
+ *
+ * Reads the 3 bytes address of the string at the result pointer.
+ * Stores the length of the string, without its terminating null byte, in
+ * the 3 bytes pointed by the result pointer, and whether the null byte was
+ * found (1) or the string goes on to the end of memory (0) in the following
+ * byte.
+ */
+void primitive_string_length(struct virtual_machine *vm);
+
+/**
+ * A primitive that tells, without waiting, whether the stream with id
+ * provided as argument can be read or written without blocking.
+ *
+ * Reads the byte pointed by the result pointer, the id of the stream.
+ * Stores PRIMITIVE_STREAM_NOT_READY, or PRIMITIVE_STREAM_READABLE and/or
+ * PRIMITIVE_STREAM_WRITABLE, in the byte pointed by the result pointer (thus,
+ * the id of the stream is erased!). A stream at its end or in error is
+ * readable: reading it does not block, nor does reading data already
+ * buffered by the stream (see get_blocking_input_descriptor).
+ * Fails if the stream is not open.
+ */
+void primitive_poll_stream(struct virtual_machine *vm);
+
+/**
+ * Extended primitives.
+ *
+ * They are native functions the host registers under a 16-bit id with
+ * vm_register_primitive, directly or from a plugin loaded with
+ * load_primitive_plugin, so that programs can call host code without
+ * changing the VM. The table of extended primitives is shared by all the VMs
+ * of the process. Built-in primitives do not go through it.
+ */
+#define PRIMITIVE_EXTENDED_IDS_COUNT 0x10000
+
+// Offset of the arguments of an extended primitive from the result pointer,
+// after its id.
+#define PRIMITIVE_EXTENDED_ARGUMENTS_OFFSET 2
+
+// Name of the function a plugin exports, see load_primitive_plugin.
+#define PRIMITIVE_PLUGIN_ENTRY_POINT "jolly_register_primitives"
+
+/**
+ * An extended primitive, called with the user_data it was registered with.
+ * The result code is PRIMITIVE_OK_RESULT_CODE when it is called: it calls
+ * primitive_fail to fail. It must call notify_memory_write for the bytes it
+ * writes in the memory of vm.
+ */
+typedef void (*extended_primitive)(struct virtual_machine *vm, void *user_data);
+
+/**
+ * The entry point of a plugin, registering its primitives.
+ * Returns VM_OK, anything else makes the loading fail.
+ */
+typedef int (*primitive_plugin_entry_point)(void);
+
 /**
  * Execute an extended primitive. The code of the primitive to execute is stored
  * in the 2 first bytes pointed by PRIMITIVE_RESULT pointer.
  * The code of the extended primitive is encoded with big-endian convention.
+ * Its arguments follow, PRIMITIVE_EXTENDED_ARGUMENTS_OFFSET bytes after the
+ * result pointer.
+ *
+ * Fails if no primitive is registered with this code.
  */
 void primitive_extended(struct virtual_machine *vm);
 
+/**
+ * Registers function as the extended primitive with the id provided, called
+ * with user_data, replacing the one registered before if any. A NULL
+ * function unregisters the id.
+ * Primitives must be registered before the VMs calling them run: the table
+ * is read without locking.
+ *
+ * Returns VM_OK.
+ * Returns VM_PRIMITIVE_REGISTRATION_FAILED if id is not below
+ * PRIMITIVE_EXTENDED_IDS_COUNT.
+ */
+int vm_register_primitive(unsigned int id, extended_primitive function, void *user_data);
+
+/**
+ * Loads the shared library at filename and calls its
+ * PRIMITIVE_PLUGIN_ENTRY_POINT function (see primitive_plugin_entry_point),
+ * which registers its primitives with vm_register_primitive. The library
+ * stays loaded until the process exits.
+ *
+ * Returns VM_OK.
+ * Returns VM_PRIMITIVE_REGISTRATION_FAILED if the library could not be
+ * loaded, has no entry point, or its entry point failed.
+ */
+int load_primitive_plugin(char *filename);
+
+/**
+ * Returns the address stored in the result pointer, where primitives read
+ * their arguments.
+ */
+unsigned int extract_result_address(struct virtual_machine *vm);
+
+/**
+ * Returns the file descriptor the primitive ready in vm would wait on: the
+ * one of the stream read by primitive_get_char, primitive_read_block or
+ * primitive_read_until when poll reports no data available on it, or the
+ * one signaling the completion of the asynchronous primitive of vm (see
+ * async_io.h).
+ * Returns -1 if no primitive is ready or if it would not wait, which is
+ * always the case while vm replays its I/O log (see io_log.h).
+ *
+ * Data already buffered by the stream does not wait either. On C libraries
+ * whose FILE layout is unknown it is not seen, so the streams checked should
+ * be unbuffered there (see setvbuf).
+ */
+int get_blocking_input_descriptor(struct virtual_machine *vm);
+
 #endif
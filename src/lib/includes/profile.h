@@ -0,0 +1,107 @@
+#ifndef PROFILE_H
+
+#define PROFILE_H
+
+#include "vm.h"
+
+#include <stdio.h>
+
+/**
+ * Execution profiles.
+ *
+ * run_profile runs a virtual machine like run, counting the executions of
+ * each instruction address and of each edge from an instruction to the
+ * address it jumps to. The counters of instruction addresses are grouped in
+ * pages allocated on the first execution of an address they hold, so that a
+ * profile only costs memory for the code that ran. Edges are kept in a hash
+ * table, there is usually one per instruction address, a few more for the
+ * jumps patched by the program.
+ *
+ * A profile file is text, sorted by decreasing count:
+ *   # jolly profile
+ *   instructions <total>
+ *   pc <address> <count>
+ *   ...
+ *   edge <address> <jump address> <count>
+ *   ...
+ * Addresses are written 0xXXXXXX. Lines starting with # are comments.
+ */
+#define PROFILE_PAGE_SIZE 0x1000
+#define PROFILE_PAGES_COUNT (DECODED_INSTRUCTIONS_SIZE / PROFILE_PAGE_SIZE)
+
+// Initial number of slots of the edges table, a power of 2. It doubles when
+// half of them are used.
+#define PROFILE_EDGES_INITIAL_CAPACITY 0x1000
+
+// Number of instruction addresses print_profile_report lists.
+#define PROFILE_REPORT_COUNT 20
+
+struct profile_edge{
+    unsigned int pc_address;
+    unsigned int jump_address;
+    /**
+     * 0 for free slots of the table.
+     */
+    unsigned long long count;
+};
+
+struct profile{
+    /**
+     * Executions of each instruction address, page by page, NULL for the
+     * pages no instruction of ran.
+     */
+    unsigned long long *pages[PROFILE_PAGES_COUNT];
+    struct profile_edge *edges;
+    unsigned int edges_count;
+    unsigned int edges_capacity;
+    /**
+     * Instructions executed by run_profile.
+     */
+    unsigned long long instructions;
+};
+
+/**
+ * Creates an empty profile.
+ *
+ * Returns VM_OK.
+ * Returns VM_ALLOCATION_FAILED if the profile could not be allocated.
+ */
+int new_profile(struct profile **profile);
+
+void free_profile(struct profile *profile);
+
+/**
+ * Runs vm like run, adding its executions to profile.
+ *
+ * Returns VM_OK.
+ * Returns VM_ALLOCATION_FAILED if a counter could not be allocated, in which
+ * case it returns before the instruction it would have counted.
+ */
+int run_profile(struct virtual_machine *vm, struct profile *profile);
+
+/**
+ * Returns the number of executions of the instruction at address.
+ */
+unsigned long long get_profile_count(struct profile *profile, unsigned int address);
+
+/**
+ * Returns the number of jumps from the instruction at pc_address to
+ * jump_address.
+ */
+unsigned long long get_profile_edge_count(struct profile *profile, unsigned int pc_address, unsigned int jump_address);
+
+/**
+ * Writes profile to filename, in the format described above.
+ *
+ * Returns VM_OK.
+ * Returns VM_IMAGE_LOAD_FAILED if the file could not be written.
+ */
+int write_profile(struct profile *profile, char *filename);
+
+/**
+ * Prints the count instruction addresses executed the most, with their share
+ * of the instructions executed.
+ */
+void print_profile_report(struct profile *profile, FILE *stream, unsigned int count);
+
+#endif
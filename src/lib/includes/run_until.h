@@ -0,0 +1,100 @@
+#ifndef RUN_UNTIL_H
+
+#define RUN_UNTIL_H
+
+#include "vm.h"
+
+/**
+ * Conditional execution, for debuggers.
+ *
+ * run_until executes the instructions of a VM until one of a set of
+ * conditions holds before the next instruction:
+ * - the program counter is a breakpoint,
+ * - the instruction writes a watched byte, its to address,
+ * - a primitive is ready, with a given id or any,
+ * - a number of instructions were executed.
+ * Breakpoints and watched bytes are kept in bitmaps of the whole memory,
+ * allocated when the first one is added, so that checking them costs a
+ * couple of loads per instruction. The conditions are checked before the
+ * first instruction too: run_until returns right away if one already
+ * holds.
+ */
+
+/**
+ * Value of primitive_id meaning run_until does not stop on primitives, and
+ * meaning it stops on any primitive.
+ */
+#define RUN_UNTIL_NO_PRIMITIVE -1
+#define RUN_UNTIL_ANY_PRIMITIVE -2
+
+/**
+ * Reasons for run_until to return.
+ */
+enum run_until_status {
+    RUN_UNTIL_STOPPED, // The status of the VM is VIRTUAL_MACHINE_STOP.
+    RUN_UNTIL_BREAKPOINT, // The program counter is a breakpoint.
+    RUN_UNTIL_WATCHPOINT, // The next instruction writes a watched byte.
+    RUN_UNTIL_PRIMITIVE, // The primitive stopped at is ready.
+    RUN_UNTIL_LIMIT_REACHED, // max_instructions instructions were executed.
+    RUN_UNTIL_INTERRUPTED // vm_interrupt was called.
+};
+
+struct run_conditions{
+    /**
+     * Bit address%8 of byte address/8 is set for the breakpoints and the
+     * watched bytes, NULL when there is none.
+     */
+    unsigned char *breakpoints;
+    unsigned char *watched;
+    /**
+     * Id of the primitive to stop at, RUN_UNTIL_NO_PRIMITIVE by default.
+     */
+    int primitive_id;
+    /**
+     * Maximal number of instructions to execute, RUN_FOR_UNLIMITED by
+     * default.
+     */
+    unsigned long long max_instructions;
+};
+
+/**
+ * Creates conditions that never hold.
+ *
+ * Returns VM_OK.
+ * Returns VM_ALLOCATION_FAILED if they could not be allocated.
+ */
+int new_run_conditions(struct run_conditions **conditions);
+
+void free_run_conditions(struct run_conditions *conditions);
+
+/**
+ * Adds or removes the breakpoint at address.
+ *
+ * Returns VM_OK.
+ * Returns VM_INVALID_MEMORY if address is not in memory.
+ * Returns VM_ALLOCATION_FAILED if the breakpoints could not be allocated.
+ */
+int add_breakpoint(struct run_conditions *conditions, unsigned int address);
+int remove_breakpoint(struct run_conditions *conditions, unsigned int address);
+
+/**
+ * Starts or stops watching the writes of instructions to the length bytes
+ * starting at address.
+ *
+ * Returns VM_OK.
+ * Returns VM_INVALID_MEMORY if the bytes are not in memory.
+ * Returns VM_ALLOCATION_FAILED if the watched bytes could not be allocated.
+ */
+int add_write_watch(struct run_conditions *conditions, unsigned int address, unsigned int length);
+int remove_write_watch(struct run_conditions *conditions, unsigned int address, unsigned int length);
+
+/**
+ * Executes the instructions of vm until one of conditions holds or vm
+ * stops, like execute_instruction, and like execute_recorded_instructions
+ * if the steps of vm are recorded (see history.h). On RUN_UNTIL_PRIMITIVE,
+ * the primitive is ready but not executed yet: the next instruction
+ * executes it first.
+ */
+enum run_until_status run_until(struct virtual_machine *vm, struct run_conditions *conditions);
+
+#endif
@@ -0,0 +1,168 @@
+#ifndef SCHEDULER_H
+
+#define SCHEDULER_H
+
+#include "vm.h"
+
+#include <pthread.h>
+
+/**
+ * Runs many virtual machines on a fixed pool of worker threads.
+ *
+ * Each worker owns a deque of runnable VMs. It takes the VM at the front,
+ * runs it for a quantum of instructions with run_for and puts it back at the
+ * end of its deque, so the VMs of a worker share it in round-robin. A worker
+ * whose deque is empty steals the VM at the back of the deque of another
+ * one, and sleeps when there is nothing to steal.
+ *
+ * VMs run with park_on_input set: a VM whose primitive would wait for input
+ * is parked instead of blocking its worker. The thread calling
+ * scheduler_run polls the descriptors of the parked VMs and gives them back
+ * to the workers when their input is available. VMs with async_io set are
+ * parked the same way while their I/O primitives run on I/O threads (see
+ * async_io.h).
+ */
+
+/**
+ * Number of instructions a VM runs before the next one is scheduled, unless
+ * another quantum is given to new_scheduler.
+ */
+#define SCHEDULER_DEFAULT_QUANTUM 100000
+
+struct scheduler;
+
+/**
+ * Called by a worker when a VM stopped. The VM is no longer used by the
+ * scheduler. The callback may add new VMs with scheduler_add.
+ */
+typedef void (*scheduler_stop_callback)(struct scheduler *scheduler, struct virtual_machine *vm, void *user_data);
+
+struct scheduler_deque{
+    pthread_mutex_t lock;
+    /**
+     * Circular buffer of capacity entries, count of them starting at head.
+     */
+    struct virtual_machine **vms;
+    unsigned int head;
+    unsigned int count;
+    unsigned int capacity;
+};
+
+struct scheduler_worker{
+    struct scheduler *scheduler;
+    pthread_t thread;
+    unsigned int index;
+    struct scheduler_deque deque;
+    /**
+     * State of the generator choosing the deques to steal from.
+     */
+    unsigned int random_state;
+    unsigned long long slices;
+    unsigned long long steals;
+};
+
+/**
+ * A VM waiting for input on descriptor.
+ */
+struct scheduler_parked_vm{
+    struct virtual_machine *vm;
+    int descriptor;
+};
+
+/**
+ * Counters describing the activity of a scheduler.
+ */
+struct scheduler_statistics{
+    /**
+     * Number of calls to run_for.
+     */
+    unsigned long long slices;
+    /**
+     * Number of VMs taken from the deque of another worker.
+     */
+    unsigned long long steals;
+    unsigned long long parks;
+    unsigned long long stopped_vms;
+};
+
+struct scheduler{
+    struct scheduler_worker *workers;
+    unsigned int workers_count;
+    unsigned long long quantum;
+    scheduler_stop_callback on_stop;
+    void *user_data;
+    /**
+     * Protects the fields below and the deque counts seen by idle workers.
+     */
+    pthread_mutex_t lock;
+    /**
+     * Signaled when a VM is queued or when the last VM stopped.
+     */
+    pthread_cond_t work_available;
+    /**
+     * Number of VMs in the deques.
+     */
+    unsigned int queued_count;
+    /**
+     * Number of workers waiting for work_available.
+     */
+    unsigned int idle_count;
+    /**
+     * Number of VMs added and not stopped yet: queued, running or parked.
+     */
+    unsigned int active_count;
+    /**
+     * Worker receiving the next VM added.
+     */
+    unsigned int next_worker;
+    struct scheduler_parked_vm *parked;
+    unsigned int parked_count;
+    unsigned int parked_capacity;
+    /**
+     * Written to wake the thread polling for the parked VMs up.
+     */
+    int wakeup_pipe[2];
+    unsigned long long parks;
+    unsigned long long stopped_vms;
+};
+
+/**
+ * Creates a scheduler running VMs on workers_count threads, quantum
+ * instructions at a time. on_stop, if not NULL, is called with user_data for
+ * every VM that stopped.
+ *
+ * Returns VM_OK.
+ * Returns VM_ALLOCATION_FAILED if the scheduler or its pipe could not be
+ * created.
+ */
+int new_scheduler(struct scheduler **scheduler, unsigned int workers_count,
+    unsigned long long quantum, scheduler_stop_callback on_stop, void *user_data);
+
+/**
+ * Frees the scheduler. VMs are not freed.
+ */
+void free_scheduler(struct scheduler *scheduler);
+
+/**
+ * Adds a VM, ready to run from its PC, to the scheduler. Can be called
+ * before scheduler_run or from any thread while it runs.
+ *
+ * Returns VM_OK.
+ * Returns VM_MEMORY_ALLOCATION_FAILED if the VM could not be queued.
+ */
+int scheduler_add(struct scheduler *scheduler, struct virtual_machine *vm);
+
+/**
+ * Starts the workers and waits until every VM added stopped.
+ *
+ * Returns VM_OK.
+ * Returns VM_ALLOCATION_FAILED if the worker threads could not be started.
+ */
+int scheduler_run(struct scheduler *scheduler);
+
+/**
+ * Copies the counters of the scheduler in statistics.
+ */
+void get_scheduler_statistics(struct scheduler *scheduler, struct scheduler_statistics *statistics);
+
+#endif
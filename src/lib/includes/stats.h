@@ -0,0 +1,90 @@
+#ifndef STATS_H
+
+#define STATS_H
+
+#include "vm.h"
+
+#include <stdio.h>
+
+/**
+ * Primitive statistics.
+ *
+ * Once enable_vm_stats was called on a VM, execute_primitive counts the
+ * calls and failures of each primitive id and the time they took on the
+ * monotonic clock, and the I/O primitives count the bytes they moved, so
+ * that the time of a slow VM can be split between the interpreter and its
+ * primitives. A VM without statistics only pays for a NULL check per
+ * primitive.
+ */
+
+// Number of primitive ids, the size of a WORD.
+#define VM_STATS_PRIMITIVES_COUNT 256
+
+struct primitive_stats{
+    unsigned long long calls;
+    unsigned long long failures;
+    /**
+     * Time spent in the primitive, in nanoseconds.
+     */
+    unsigned long long total_time;
+    unsigned long long max_time;
+    /**
+     * Bytes read or written by primitive_get_char, primitive_put_char and
+     * the block primitives.
+     */
+    unsigned long long bytes;
+};
+
+struct vm_stats{
+    unsigned long long instructions;
+    unsigned long long primitives;
+    struct primitive_stats primitives_by_id[VM_STATS_PRIMITIVES_COUNT];
+};
+
+/**
+ * Starts counting the primitives of vm, from zero. The counters are freed
+ * with the VM. Does nothing if they are already counted.
+ *
+ * Returns VM_OK.
+ * Returns VM_ALLOCATION_FAILED if the counters could not be allocated.
+ */
+int enable_vm_stats(struct virtual_machine *vm);
+
+/**
+ * Copies the statistics of vm to stats: its retired instructions and
+ * primitives, and the counters of its primitives, zero if they are not
+ * counted.
+ */
+void get_vm_stats(struct virtual_machine *vm, struct vm_stats *stats);
+
+/**
+ * Adds the statistics of vm to total, e.g. to sum those of a batch of VMs.
+ * The maximal times are the maximum of both.
+ */
+void add_vm_stats(struct vm_stats *total, struct virtual_machine *vm);
+
+/**
+ * Adds a call of the primitive primitive_id that took time nanoseconds,
+ * called by execute_primitive.
+ */
+void count_primitive_call(struct virtual_machine *vm, unsigned int primitive_id,
+    unsigned long long time, int failed);
+
+/**
+ * Adds bytes to the bytes moved by the primitive vm is executing.
+ */
+void count_primitive_bytes(struct virtual_machine *vm, unsigned long long bytes);
+
+/**
+ * Returns the name of the primitive primitive_id, e.g. "get_char", NULL if
+ * it is not a built-in primitive.
+ */
+char *get_primitive_name(unsigned int primitive_id);
+
+/**
+ * Prints the primitives called, with their share of the time since
+ * elapsed_time nanoseconds when it is not 0.
+ */
+void print_vm_stats(struct vm_stats *stats, FILE *stream, unsigned long long elapsed_time);
+
+#endif
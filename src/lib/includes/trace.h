@@ -0,0 +1,124 @@
+#ifndef TRACE_H
+
+#define TRACE_H
+
+#include "memory.h"
+#include "vm.h"
+
+/**
+ * Trace engine.
+ *
+ * ByteByteJump code is made of long linear chains: the jump address of an
+ * instruction is a constant, so the next instruction is known as soon as the
+ * current one is decoded. The trace engine follows those chains from hot
+ * program counters and compiles each of them into an array of (from, to)
+ * moves executed without decoding nor dispatching instructions.
+ *
+ * Compiled code stays correct with self-modifying programs:
+ * - every byte written by an instruction or a primitive is remembered, and
+ *   the operands made of such bytes are read from memory when the trace runs
+ *   (dynamic moves). A chain ends at the first instruction whose jump address
+ *   may be overwritten.
+ * - the other instruction bytes a trace relies on are protected. Writing one
+ *   of them drops every compiled trace.
+ * - a chain ends after any instruction writing at PRIMITIVE_IS_READY_ADDRESS,
+ *   so that primitives still run before the next instruction.
+ */
+
+/**
+ * Number of executions of a program counter by the interpreter before a
+ * trace starting there is compiled.
+ */
+#define TRACE_HOT_THRESHOLD 16
+
+/**
+ * Maximal number of instructions in a trace.
+ */
+#define TRACE_MAX_LENGTH 256
+
+/**
+ * Set in the to_address of a move that must decode its instruction at
+ * execution time, from_address is then the address of the instruction.
+ */
+#define TRACE_DYNAMIC_MOVE 0x80000000
+
+struct trace_move{
+    unsigned int from_address;
+    unsigned int to_address;
+};
+
+struct trace{
+    /**
+     * Address of the first instruction of the trace.
+     */
+    unsigned int pc_address;
+    /**
+     * Number of moves, one per instruction of the chain.
+     */
+    unsigned int moves_count;
+    struct trace_move *moves;
+    /**
+     * Address of the last instruction of the trace.
+     */
+    unsigned int last_address;
+    /**
+     * Address of the instruction following the trace. Only meaningful if
+     * dynamic_exit is 0, else the jump address of the last instruction is
+     * read from memory when the trace ends.
+     */
+    unsigned int next_address;
+    int dynamic_exit;
+    /**
+     * Machine code executing the moves, see jit.h. NULL when the library is
+     * built without JIT or when the code could not be emitted.
+     */
+    void *native_code;
+    unsigned int native_code_size;
+    /**
+     * Trace executed after this one the last time it ran, used when the
+     * next program counter is the same again.
+     */
+    struct trace *next_trace;
+};
+
+/**
+ * Counters describing the activity of the trace engine of a VM.
+ */
+struct trace_statistics{
+    unsigned long long traces_compiled;
+    unsigned long long native_traces_compiled;
+    unsigned long long flushes;
+    unsigned long long traced_instructions;
+    unsigned long long interpreted_instructions;
+};
+
+/**
+ * Runs the virtual machine with the trace engine as long as its status is
+ * VIRTUAL_MACHINE_RUN.
+ * Memory effects and primitive executions are the same as with run.
+ *
+ * Returns VM_OK.
+ * Returns VM_MEMORY_ALLOCATION_FAILED if the trace cache could not be
+ * allocated, without executing any instruction.
+ */
+int run_trace(struct virtual_machine *vm);
+
+/**
+ * Notifies the trace engine that length bytes starting at address were
+ * written outside of a trace. Drops the traces relying on those bytes.
+ */
+void notify_trace_write(struct virtual_machine *vm, unsigned int address, unsigned int length);
+
+/**
+ * Frees every compiled trace of the virtual machine and the data the trace
+ * engine learnt about its memory.
+ */
+void flush_traces(struct virtual_machine *vm);
+
+/**
+ * Copies the counters of the trace engine of vm in statistics.
+ * All counters are 0 if the trace engine never ran.
+ */
+void get_trace_statistics(struct virtual_machine *vm, struct trace_statistics *statistics);
+
+#endif
@@ -27,19 +27,172 @@
 #define VM_INVALID_MEMORY 2
 #define VM_MEMORY_ALLOCATION_FAILED 3
 #define VM_ALLOCATION_FAILED 4
+#define VM_IMAGE_LOAD_FAILED 5
+#define VM_CHECKPOINT_FAILED 6
+#define VM_PRIMITIVE_REGISTRATION_FAILED 7
+#define VM_HISTORY_UNAVAILABLE 8
+#define VM_IO_LOG_FAILED 9
 
 #define FILE_STREAMS_SIZE 255
 
+// Values of the memory_origin field of virtual machines.
+#define VM_MEMORY_ALLOCATED 0 // Allocated with malloc, freed with free.
+#define VM_MEMORY_MAPPED 1 // Mapped with mmap, unmapped.
+
+// Size of the decoded-instruction cache: one entry per addressable byte,
+// allocated by pages of DECODED_PAGE_SIZE entries.
+#define DECODED_INSTRUCTIONS_SIZE 0x1000000
+#define DECODED_PAGE_SIZE 0x1000
+#define DECODED_PAGES_COUNT 0x1000
+
+// Values of the valid field of decoded instructions.
+#define DECODED_INVALID 0
+#define DECODED_VALID 1
+#define DECODED_IDIOM 2
+
+// Values of decoded_owners entries.
+#define DECODED_OWNER_NONE 0
+#define DECODED_OWNER_CONTROL 253
+#define DECODED_OWNER_IDIOM 254
+#define DECODED_OWNER_SHARED 255
+
+// Value of the limits of run_for meaning there is no limit.
+#define RUN_FOR_UNLIMITED 0
+
+// Number of instructions run_for executes between two checks of its
+// deadline and of interruptions.
+#define RUN_FOR_CHECK_INTERVAL 4096
+
 enum vm_status { VIRTUAL_MACHINE_RUN, VIRTUAL_MACHINE_STOP };
 
+/**
+ * Reasons for run_for to return.
+ */
+enum run_for_status {
+    RUN_FOR_STOPPED, // The status of the VM is VIRTUAL_MACHINE_STOP.
+    RUN_FOR_BUDGET_EXHAUSTED, // max_instructions instructions were executed.
+    RUN_FOR_DEADLINE_REACHED, // The deadline is in the past.
+    RUN_FOR_INTERRUPTED, // vm_interrupt was called.
+    RUN_FOR_BLOCKED // The ready primitive would wait for input, see park_on_input.
+};
+
+/**
+ * An instruction whose 3 addresses have already been extracted from memory.
+ * Entries are only meaningful when valid is DECODED_VALID.
+ * When valid is DECODED_IDIOM, the entry is the first instruction of an idiom
+ * of the fast engine and jump_address is the index of the idiom, see
+ * idioms.h.
+ */
+struct decoded_instruction{
+    unsigned int from_address;
+    unsigned int to_address;
+    unsigned int jump_address;
+    unsigned int valid;
+    /**
+     * Entry of the instruction at jump_address, so that run_fast goes from
+     * an instruction to the next without looking up its page. In the shared
+     * page of invalid entries if the page could not be allocated.
+     */
+    struct decoded_instruction *jump_instruction;
+};
+
 struct virtual_machine{
     WORD *memory;
+    /**
+     * How memory was obtained, see VM_MEMORY_ALLOCATED.
+     */
+    int memory_origin;
+    /**
+     * Descriptor of the image memory is a private mapping of, -1 if none.
+     * The pages the VM did not write are shared with the image, see image.h.
+     */
+    int image_descriptor;
+    /**
+     * Number of checkpoints of the chain the VM writes, 0 if its next
+     * checkpoint is a full one. When not 0, image_descriptor is a memory
+     * file only this VM maps, holding its memory as of the last checkpoint.
+     */
+    unsigned int checkpoints_count;
     WORD *pc;
     enum vm_status status;
     /**
      * Array of file streams manipulated by primitive_get_char.
      */
     FILE *file_streams[FILE_STREAMS_SIZE];
+    /**
+     * Cache of decoded instructions indexed by instruction address, page by
+     * page: entry address%DECODED_PAGE_SIZE of page address/DECODED_PAGE_SIZE.
+     * The pages no instruction was decoded in all point to a shared page of
+     * invalid entries, which is never written, and are allocated on the
+     * first decoding, so that the cache costs memory for the code that ran
+     * only. Allocated lazily on first execution, NULL before that.
+     */
+    struct decoded_instruction **decoded_pages;
+    /**
+     * One entry per memory byte, tracking writes to cached instructions.
+     * Allocated with the cache, its pages only cost memory once an
+     * instruction they hold was decoded.
+     * DECODED_OWNER_NONE if the byte is not part of a cached instruction,
+     * else 1 + the offset of the byte in the instruction it belongs to, or
+     * DECODED_OWNER_SHARED if it belongs to several overlapping instructions.
+     * DECODED_OWNER_IDIOM if idioms rely on it, it may also belong to
+     * overlapping instructions.
+     * DECODED_OWNER_CONTROL for PRIMITIVE_IS_READY_ADDRESS, so that the
+     * engines notice a primitive becoming ready when the byte is written.
+     * A write to such a byte drops the cached instructions covering it.
+     */
+    unsigned char *decoded_owners;
+    /**
+     * Idioms installed in the decoded-instruction cache by run_fast, NULL
+     * when there are none.
+     */
+    struct idiom_table *idioms;
+    /**
+     * Compiled traces of the trace engine, NULL until run_trace is called.
+     */
+    struct trace_cache *traces;
+    /**
+     * Number of instructions and of primitives executed since the VM was
+     * created, by any engine.
+     */
+    unsigned long long retired_instructions;
+    unsigned long long retired_primitives;
+    /**
+     * Set by vm_interrupt, possibly from a signal handler, cleared when
+     * run_for returns RUN_FOR_INTERRUPTED.
+     */
+    volatile int interrupt_requested;
+    /**
+     * When TRUE, run_for returns RUN_FOR_BLOCKED instead of executing a
+     * primitive that would wait for input (see
+     * get_blocking_input_descriptor), leaving it ready. FALSE by default.
+     */
+    int park_on_input;
+    /**
+     * When TRUE, run_for hands the I/O primitives that may block to I/O
+     * threads and returns RUN_FOR_BLOCKED until they completed, see
+     * async_io.h. FALSE by default.
+     */
+    int async_io;
+    /**
+     * Asynchronous primitive of the VM, NULL before its first one.
+     */
+    struct async_io_request *async_request;
+    /**
+     * Counters of the primitives, NULL unless enable_vm_stats was called,
+     * see stats.h.
+     */
+    struct vm_stats *stats;
+    /**
+     * Records of the steps executed by execute_recorded_instructions, NULL
+     * unless enable_vm_history was called, see history.h.
+     */
+    struct vm_history *history;
+    /**
+     * File the logged primitives are recorded to or replayed from, NULL
+     * unless record_io or replay_io was called, see io_log.h.
+     */
+    struct io_log *io_log;
 };
 
 /**
@@ -123,6 +276,28 @@ int set_pc_address(struct virtual_machine *vm, unsigned int pc_address);
  */
 int serialize_pc(struct virtual_machine *vm);
 
+/**
+ * Notifies the virtual machine that the length bytes starting at address were
+ * written by something else than an instruction (a primitive or the host).
+ * Drops the decoded instructions and the traces relying on those bytes, and
+ * records the bytes overwritten when the steps of the VM are recorded.
+ */
+void notify_memory_write(struct virtual_machine *vm, unsigned int address, unsigned int length);
+
+/**
+ * Returns the entry of the decoded-instruction cache of vm, which must be
+ * allocated, for the instruction at pc_address, allocating its page first
+ * if needed.
+ * Returns NULL if the page could not be allocated.
+ */
+struct decoded_instruction *get_decoded_instruction(struct virtual_machine *vm, unsigned int pc_address);
+
+/**
+ * Drops every decoded instruction of the virtual machine provided as argument.
+ * Must be called when its memory is replaced or rewritten as a whole.
+ */
+void flush_decoded_instructions(struct virtual_machine *vm);
+
 /**
  * Lookup the primitive corresponding to the id stored at address
  * PRIMITIVE_CALL_ID_ADDRESS in memory and executes it.
@@ -135,7 +310,10 @@ int execute_primitive(struct virtual_machine *vm);
 /**
  * Execute the next instruction pointed by the virtual machine program counter.
  * If a primitive is ready to be executed, executes the primitive before
- * executing the instruction.
+ * executing the instruction. As the memory may have been modified since the
+ * previous call, the PRIMITIVE_IS_READY_ADDRESS byte is checked on every call.
+ * The instruction is decoded once and kept in the decoded-instruction cache
+ * until one of its bytes is written.
  * 
  * Returns VM_OK.
  */
@@ -143,16 +321,67 @@ int execute_instruction(struct virtual_machine *vm);
 
 /**
  * Run the virtual machine as long as its status is VIRTUAL_MACHINE_RUN.
+ * The PRIMITIVE_IS_READY_ADDRESS byte is checked when run is called, then
+ * primitives are triggered by the instructions writing it: as with
+ * execute_instruction, a primitive made ready runs before the next
+ * instruction.
  * 
  * Returns VM_OK.
  */
 int run(struct virtual_machine *vm);
 
+/**
+ * Same as run, but with the whole interpreter loop in a single function
+ * dispatching with computed gotos when the compiler supports them.
+ * Table lookup idioms are recognized as their instructions are decoded and
+ * executed as single operations (see idioms.h).
+ * The memory effects and the order of primitive executions are the same as
+ * with run.
+ * 
+ * Returns VM_OK.
+ */
+int run_fast(struct virtual_machine *vm);
+
+/**
+ * Runs the virtual machine like run, but returns as soon as one of these
+ * happens:
+ * - its status is VIRTUAL_MACHINE_STOP: RUN_FOR_STOPPED.
+ * - max_instructions instructions were executed by this call:
+ *   RUN_FOR_BUDGET_EXHAUSTED.
+ * - the monotonic clock (see get_monotonic_time) reached deadline:
+ *   RUN_FOR_DEADLINE_REACHED.
+ * - vm_interrupt was called: RUN_FOR_INTERRUPTED.
+ * - park_on_input is TRUE and the ready primitive would wait for input:
+ *   RUN_FOR_BLOCKED.
+ * Either limit can be RUN_FOR_UNLIMITED. The budget is exact, the deadline
+ * and interruptions are only checked every RUN_FOR_CHECK_INTERVAL
+ * instructions, and before the first one.
+ * Calling run_for again resumes the execution where it stopped.
+ */
+enum run_for_status run_for(struct virtual_machine *vm, unsigned long long max_instructions, unsigned long long deadline);
+
+/**
+ * Asks run_for to return RUN_FOR_INTERRUPTED at its next check. Only sets a
+ * flag of vm, so it can be called from a signal handler or another thread.
+ */
+void vm_interrupt(struct virtual_machine *vm);
+
+/**
+ * Returns the time of the monotonic clock in nanoseconds, to compute the
+ * deadlines of run_for.
+ */
+unsigned long long get_monotonic_time(void);
+
 /**
  * Load the image stored at the file path provided as argument.
+ * The memory is a zero-filled anonymous mapping: the bytes past the end of
+ * the image are zero and only cost memory once written. The image is read
+ * into it, so the file can be modified or removed once loaded.
+ * The previous memory of vm is released.
  * 
  * Return VM_OK is everything went well.
  * Might return VM_MEMORY_ALLOCATION_FAILED if memory allocation failed.
+ * Might return VM_IMAGE_LOAD_FAILED if the file could not be read.
  */
 int load_image(struct virtual_machine *vm, char *filename);
 
@@ -0,0 +1,255 @@
+#include "io_log.h"
+#include "vm.h"
+#include "primitives.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef ENABLE_LOGGING
+#include "log.h"
+#else
+#include "nolog.h"
+#endif
+
+#define IO_LOG_RANGES_INITIAL_CAPACITY 8
+
+/* Helpers. ------------------------------------------------------------------*/
+/**
+ * Stores value in the size bytes at bytes, most significant first like the
+ * addresses of the VM.
+ */
+static void store_big_endian(WORD *bytes, unsigned int value, unsigned int size){
+    for(unsigned int i = 0; i < size; i++){
+        bytes[i] = (value >> (WORD_SIZE * (size - 1 - i))) & WORD_BIT_MASK;
+    }
+}
+
+static unsigned int load_big_endian(WORD *bytes, unsigned int size){
+    unsigned int value = 0;
+    for(unsigned int i = 0; i < size; i++){
+        value = value << WORD_SIZE | bytes[i];
+    }
+    return value;
+}
+
+static int open_io_log(struct virtual_machine *vm, char *filename, int mode){
+    struct io_log *log;
+
+    close_io_log(vm);
+    log = (struct io_log *)calloc(1, sizeof(struct io_log));
+    if(log == NULL){
+        return VM_ALLOCATION_FAILED;
+    }
+    log->file = fopen(filename, mode == IO_LOG_RECORD ? "wb" : "rb");
+    if(log->file == NULL){
+        log_error("Failed to open I/O log %s.", filename);
+        free(log);
+        return VM_IO_LOG_FAILED;
+    }
+    log->mode = mode;
+    vm->io_log = log;
+    return VM_OK;
+}
+
+/**
+ * Writes the range of the entry being recorded starting at address.
+ */
+static void write_range(struct io_log *log, WORD *memory, unsigned int address, unsigned int length){
+    WORD header[IO_LOG_RANGE_HEADER_SIZE];
+
+    store_big_endian(header, address, 4);
+    store_big_endian(header + 4, length, 4);
+    if(fwrite(header, 1, IO_LOG_RANGE_HEADER_SIZE, log->file) != IO_LOG_RANGE_HEADER_SIZE
+        || fwrite(memory + address, 1, length, log->file) != length){
+        log->failed = 1;
+    }
+}
+
+/**
+ * Marks the replay as diverged, stopping vm.
+ */
+static void diverge(struct virtual_machine *vm, unsigned int primitive_id, char *reason){
+    log_error("I/O replay diverged at primitive %llu (id %u): %s.",
+        vm->io_log->entries, primitive_id, reason);
+    vm->io_log->failed = 1;
+    vm->status = VIRTUAL_MACHINE_STOP;
+}
+
+/* Implementation. -----------------------------------------------------------*/
+int record_io(struct virtual_machine *vm, char *filename){
+    WORD header[IO_LOG_HEADER_SIZE];
+    int result;
+
+    result = open_io_log(vm, filename, IO_LOG_RECORD);
+    if(result != VM_OK){
+        return result;
+    }
+    memcpy(header, IO_LOG_MAGIC, IO_LOG_MAGIC_SIZE);
+    header[IO_LOG_MAGIC_SIZE] = IO_LOG_VERSION;
+    if(fwrite(header, 1, IO_LOG_HEADER_SIZE, vm->io_log->file) != IO_LOG_HEADER_SIZE){
+        close_io_log(vm);
+        return VM_IO_LOG_FAILED;
+    }
+    return VM_OK;
+}
+
+int replay_io(struct virtual_machine *vm, char *filename){
+    WORD header[IO_LOG_HEADER_SIZE];
+    int result;
+
+    result = open_io_log(vm, filename, IO_LOG_REPLAY);
+    if(result != VM_OK){
+        return result;
+    }
+    if(fread(header, 1, IO_LOG_HEADER_SIZE, vm->io_log->file) != IO_LOG_HEADER_SIZE
+        || memcmp(header, IO_LOG_MAGIC, IO_LOG_MAGIC_SIZE) != 0
+        || header[IO_LOG_MAGIC_SIZE] != IO_LOG_VERSION){
+        log_error("%s is not an I/O log.", filename);
+        close_io_log(vm);
+        return VM_IO_LOG_FAILED;
+    }
+    return VM_OK;
+}
+
+int close_io_log(struct virtual_machine *vm){
+    struct io_log *log;
+    int failed;
+
+    log = vm->io_log;
+    if(log == NULL){
+        return VM_OK;
+    }
+    failed = log->failed;
+    if(fclose(log->file) != 0 && log->mode == IO_LOG_RECORD){
+        failed = 1;
+    }
+    free(log->ranges);
+    free(log);
+    vm->io_log = NULL;
+    return failed ? VM_IO_LOG_FAILED : VM_OK;
+}
+
+int is_replaying_io(struct virtual_machine *vm){
+    return vm->io_log != NULL && vm->io_log->mode == IO_LOG_REPLAY;
+}
+
+int is_logged_primitive(unsigned int primitive_id){
+    switch(primitive_id){
+        case(PRIMITIVE_ID_PUT_CHAR):
+        case(PRIMITIVE_ID_GET_CHAR):
+        case(PRIMITIVE_ID_OPEN_FILE):
+        case(PRIMITIVE_ID_CLOSE_FILE):
+        case(PRIMITIVE_ID_IS_FILE_OPEN):
+        case(PRIMITIVE_ID_ARGC):
+        case(PRIMITIVE_ID_ARGV_SIZE_AT_INDEX):
+        case(PRIMITIVE_ID_ARGV):
+        case(PRIMITIVE_ID_CHECKPOINT):
+        case(PRIMITIVE_ID_READ_BLOCK):
+        case(PRIMITIVE_ID_WRITE_BLOCK):
+        case(PRIMITIVE_ID_READ_UNTIL):
+        case(PRIMITIVE_ID_POLL_STREAM):
+        case(PRIMITIVE_ID_EXTENDED):
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+void begin_logged_primitive(struct virtual_machine *vm){
+    vm->io_log->ranges_count = 0;
+    vm->io_log->capturing = 1;
+}
+
+void add_logged_write(struct virtual_machine *vm, unsigned int address, unsigned int length){
+    struct io_log *log;
+    struct io_log_range *ranges;
+    unsigned int capacity;
+
+    log = vm->io_log;
+    if(address >= MAX_MEMORY_SIZE || length == 0){
+        return;
+    }
+    if(length > MAX_MEMORY_SIZE - address){
+        length = MAX_MEMORY_SIZE - address;
+    }
+    if(log->ranges_count == log->ranges_capacity){
+        capacity = log->ranges_capacity == 0 ?
+            IO_LOG_RANGES_INITIAL_CAPACITY : 2 * log->ranges_capacity;
+        ranges = (struct io_log_range *)realloc(log->ranges,
+            capacity * sizeof(struct io_log_range));
+        if(ranges == NULL){
+            log->failed = 1;
+            return;
+        }
+        log->ranges = ranges;
+        log->ranges_capacity = capacity;
+    }
+    log->ranges[log->ranges_count].address = address;
+    log->ranges[log->ranges_count].length = length;
+    log->ranges_count++;
+}
+
+void end_logged_primitive(struct virtual_machine *vm, unsigned int primitive_id){
+    struct io_log *log;
+    WORD header[IO_LOG_ENTRY_HEADER_SIZE];
+
+    log = vm->io_log;
+    log->capturing = 0;
+    header[0] = primitive_id;
+    header[1] = vm->status;
+    header[2] = vm->memory[PRIMITIVE_RESULT_CODE_ADDRESS];
+    store_big_endian(header + 3, log->ranges_count, 4);
+    if(fwrite(header, 1, IO_LOG_ENTRY_HEADER_SIZE, log->file) != IO_LOG_ENTRY_HEADER_SIZE){
+        log->failed = 1;
+    }
+    // The ranges as the primitive left them: replaying them in order gives
+    // the same memory even when they overlap.
+    for(unsigned int i = 0; i < log->ranges_count; i++){
+        write_range(log, vm->memory, log->ranges[i].address, log->ranges[i].length);
+    }
+    if(log->failed){
+        log_error("Failed to write the I/O log.");
+    }
+    log->entries++;
+}
+
+void replay_logged_primitive(struct virtual_machine *vm, unsigned int primitive_id){
+    struct io_log *log;
+    WORD header[IO_LOG_ENTRY_HEADER_SIZE], range[IO_LOG_RANGE_HEADER_SIZE];
+    unsigned int status, ranges_count, address, length;
+
+    log = vm->io_log;
+    if(log->failed){
+        diverge(vm, primitive_id, "the log failed before");
+        return;
+    }
+    if(fread(header, 1, IO_LOG_ENTRY_HEADER_SIZE, log->file) != IO_LOG_ENTRY_HEADER_SIZE){
+        diverge(vm, primitive_id, "end of the log");
+        return;
+    }
+    if(header[0] != primitive_id){
+        diverge(vm, primitive_id, "another primitive was logged");
+        return;
+    }
+    status = header[1];
+    // Notified by execute_primitive with the other reserved bytes.
+    vm->memory[PRIMITIVE_RESULT_CODE_ADDRESS] = header[2];
+    ranges_count = load_big_endian(header + 3, 4);
+    for(unsigned int i = 0; i < ranges_count; i++){
+        if(fread(range, 1, IO_LOG_RANGE_HEADER_SIZE, log->file) != IO_LOG_RANGE_HEADER_SIZE){
+            diverge(vm, primitive_id, "truncated log");
+            return;
+        }
+        address = load_big_endian(range, 4);
+        length = load_big_endian(range + 4, 4);
+        if(address >= MAX_MEMORY_SIZE || length > MAX_MEMORY_SIZE - address
+            || fread(vm->memory + address, 1, length, log->file) != length){
+            diverge(vm, primitive_id, "invalid range");
+            return;
+        }
+        notify_memory_write(vm, address, length);
+    }
+    vm->status = status;
+    log->entries++;
+}
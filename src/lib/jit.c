@@ -0,0 +1,234 @@
+#include "jit.h"
+#include "vm.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifdef ENABLE_LOGGING
+#include "log.h"
+#else
+#include "nolog.h"
+#endif
+
+// Upper bound of the size (in bytes) of the code emitted for one move.
+#define JIT_MAX_MOVE_SIZE 128
+
+// Size of the code ending a trace.
+#define JIT_EPILOGUE_SIZE 6
+
+/**
+ * Registers, numbered as in the ModRM and SIB bytes.
+ */
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RSI 6
+#define RDI 7
+
+struct jit_buffer{
+    unsigned char *code;
+    unsigned int size;
+};
+
+/* Encoding. -----------------------------------------------------------------*/
+static inline void emit_byte(struct jit_buffer *buffer, unsigned char byte){
+    buffer->code[buffer->size++] = byte;
+}
+
+static inline void emit_int32(struct jit_buffer *buffer, unsigned int value){
+    for(int i = 0; i < 4; i++){
+        emit_byte(buffer, (value >> (8 * i)) & 0xFF);
+    }
+}
+
+/**
+ * movzx reg32, byte [rdi + displacement]
+ */
+static void emit_load_byte(struct jit_buffer *buffer, int reg, unsigned int displacement){
+    emit_byte(buffer, 0x0F);
+    emit_byte(buffer, 0xB6);
+    emit_byte(buffer, 0x80 | reg << 3 | RDI);
+    emit_int32(buffer, displacement);
+}
+
+/**
+ * mov byte [rdi + displacement], al
+ */
+static void emit_store_byte(struct jit_buffer *buffer, unsigned int displacement){
+    emit_byte(buffer, 0x88);
+    emit_byte(buffer, 0x80 | RAX << 3 | RDI);
+    emit_int32(buffer, displacement);
+}
+
+/**
+ * shl reg32, count
+ */
+static void emit_shift_left(struct jit_buffer *buffer, int reg, unsigned char count){
+    emit_byte(buffer, 0xC1);
+    emit_byte(buffer, 0xC0 | 4 << 3 | reg);
+    emit_byte(buffer, count);
+}
+
+/**
+ * or destination32, source32
+ */
+static void emit_or(struct jit_buffer *buffer, int destination, int source){
+    emit_byte(buffer, 0x09);
+    emit_byte(buffer, 0xC0 | source << 3 | destination);
+}
+
+/**
+ * Decodes the address stored at [rdi + displacement] in reg32, using ecx.
+ */
+static void emit_decode_address(struct jit_buffer *buffer, int reg, unsigned int displacement){
+    emit_load_byte(buffer, reg, displacement);
+    emit_shift_left(buffer, reg, DOUBLE_WORD_SIZE);
+    emit_load_byte(buffer, RCX, displacement + 1);
+    emit_shift_left(buffer, RCX, WORD_SIZE);
+    emit_or(buffer, reg, RCX);
+    emit_load_byte(buffer, RCX, displacement + 2);
+    emit_or(buffer, reg, RCX);
+}
+
+/**
+ * mov eax, value
+ * ret
+ */
+static void emit_end(struct jit_buffer *buffer, unsigned int value){
+    emit_byte(buffer, 0xB8);
+    emit_int32(buffer, value);
+    emit_byte(buffer, 0xC3);
+}
+
+static void emit_static_move(struct jit_buffer *buffer, struct trace_move *move){
+    emit_load_byte(buffer, RAX, move->from_address);
+    emit_store_byte(buffer, move->to_address);
+}
+
+/**
+ * Emits the dynamic move of the instruction at pc_address, returning
+ * executed_count and the address written when it writes a protected byte or
+ * the PRIMITIVE_IS_READY_ADDRESS byte.
+ */
+static void emit_dynamic_move(struct jit_buffer *buffer, unsigned int pc_address, unsigned int executed_count){
+    unsigned int exit_jump, skip_jump;
+
+    emit_decode_address(buffer, RAX, pc_address + FROM_ADDRESS_HIGH_OFFSET);
+    emit_decode_address(buffer, RDX, pc_address + TO_ADDRESS_HIGH_OFFSET);
+    // movzx eax, byte [rdi + rax]
+    emit_byte(buffer, 0x0F);
+    emit_byte(buffer, 0xB6);
+    emit_byte(buffer, 0x04);
+    emit_byte(buffer, RAX << 3 | RDI);
+    // mov byte [rdi + rdx], al
+    emit_byte(buffer, 0x88);
+    emit_byte(buffer, 0x04);
+    emit_byte(buffer, RDX << 3 | RDI);
+
+    // cmp edx, PRIMITIVE_IS_READY_ADDRESS
+    // je exit
+    emit_byte(buffer, 0x83);
+    emit_byte(buffer, 0xC0 | 7 << 3 | RDX);
+    emit_byte(buffer, PRIMITIVE_IS_READY_ADDRESS);
+    emit_byte(buffer, 0x74);
+    exit_jump = buffer->size;
+    emit_byte(buffer, 0);
+    // mov ecx, edx
+    // shr ecx, 3
+    // movzx ecx, byte [rsi + rcx]
+    emit_byte(buffer, 0x89);
+    emit_byte(buffer, 0xC0 | RDX << 3 | RCX);
+    emit_byte(buffer, 0xC1);
+    emit_byte(buffer, 0xC0 | 5 << 3 | RCX);
+    emit_byte(buffer, 3);
+    emit_byte(buffer, 0x0F);
+    emit_byte(buffer, 0xB6);
+    emit_byte(buffer, RCX << 3 | 0x04);
+    emit_byte(buffer, RCX << 3 | RSI);
+    // mov eax, edx
+    // and eax, 7
+    // bt ecx, eax
+    // jnc skip
+    emit_byte(buffer, 0x89);
+    emit_byte(buffer, 0xC0 | RDX << 3 | RAX);
+    emit_byte(buffer, 0x83);
+    emit_byte(buffer, 0xC0 | 4 << 3 | RAX);
+    emit_byte(buffer, 7);
+    emit_byte(buffer, 0x0F);
+    emit_byte(buffer, 0xA3);
+    emit_byte(buffer, 0xC0 | RAX << 3 | RCX);
+    emit_byte(buffer, 0x73);
+    skip_jump = buffer->size;
+    emit_byte(buffer, 0);
+    // exit:
+    // mov eax, JIT_EARLY_EXIT | executed_count
+    // shl rdx, 32
+    // or rax, rdx
+    // ret
+    buffer->code[exit_jump] = buffer->size - (exit_jump + 1);
+    emit_byte(buffer, 0xB8);
+    emit_int32(buffer, JIT_EARLY_EXIT | executed_count);
+    emit_byte(buffer, 0x48);
+    emit_byte(buffer, 0xC1);
+    emit_byte(buffer, 0xC0 | 4 << 3 | RDX);
+    emit_byte(buffer, 32);
+    emit_byte(buffer, 0x48);
+    emit_or(buffer, RAX, RDX);
+    emit_byte(buffer, 0xC3);
+    // skip:
+    buffer->code[skip_jump] = buffer->size - (skip_jump + 1);
+}
+
+/* Implementation. -----------------------------------------------------------*/
+int jit_compile_trace(struct trace *trace){
+    struct jit_buffer buffer;
+    unsigned int capacity;
+    long page_size;
+    void *code;
+
+    trace->native_code = NULL;
+    trace->native_code_size = 0;
+
+    page_size = sysconf(_SC_PAGESIZE);
+    capacity = trace->moves_count * JIT_MAX_MOVE_SIZE + JIT_EPILOGUE_SIZE;
+    capacity = (capacity + page_size - 1) / page_size * page_size;
+    code = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(code == MAP_FAILED){
+        log_error("Failed to map %d bytes for native code.", capacity);
+        return VM_MEMORY_ALLOCATION_FAILED;
+    }
+
+    buffer.code = (unsigned char *)code;
+    buffer.size = 0;
+    for(unsigned int i = 0; i < trace->moves_count; i++){
+        struct trace_move *move = &trace->moves[i];
+        if(move->to_address & TRACE_DYNAMIC_MOVE){
+            emit_dynamic_move(&buffer, move->from_address, i + 1);
+        } else{
+            emit_static_move(&buffer, move);
+        }
+    }
+    emit_end(&buffer, trace->moves_count);
+
+    // The buffer is never writable and executable at the same time.
+    if(mprotect(code, capacity, PROT_READ | PROT_EXEC) != 0){
+        log_error("Failed to make native code executable.");
+        munmap(code, capacity);
+        return VM_MEMORY_ALLOCATION_FAILED;
+    }
+    trace->native_code = code;
+    trace->native_code_size = capacity;
+    log_debug("Emitted %d bytes of native code for trace at 0x%06X.",
+        buffer.size, trace->pc_address);
+    return VM_OK;
+}
+
+void jit_free_trace(struct trace *trace){
+    if(trace->native_code != NULL){
+        munmap(trace->native_code, trace->native_code_size);
+        trace->native_code = NULL;
+        trace->native_code_size = 0;
+    }
+}
@@ -23,16 +23,21 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include "log.h"
 
+int log_level;
+
 static struct {
   void *udata;
   log_LockFn lock;
   FILE *fp;
-  int level;
   int quiet;
 } L;
 
@@ -48,6 +53,71 @@ static const char *level_colors[] = {
 #endif
 
 
+/* Conversion specification of a format, e.g. %-08.*llx. */
+enum { LENGTH_NONE, LENGTH_HH, LENGTH_H, LENGTH_L, LENGTH_LL, LENGTH_J,
+  LENGTH_Z, LENGTH_T, LENGTH_LONG_DOUBLE };
+
+typedef struct {
+  const char *flags;
+  int flags_length;
+  int width;          /* -1 if none, -2 if read from the arguments */
+  int precision;      /* -1 if none, -2 if read from the arguments */
+  int length;
+  char conversion;
+} log_Spec;
+
+typedef union {
+  long long i;
+  unsigned long long u;
+  double d;
+  const void *p;
+  size_t text;        /* offset of a copied string in the event text */
+} log_Arg;
+
+typedef struct {
+  struct timespec time;
+  const char *file;
+  const char *fmt;
+  int line;
+  int level;
+  int args_count;
+  int text_length;
+  log_Arg args[LOG_EVENT_ARGS_COUNT];
+  char text[LOG_EVENT_TEXT_SIZE];
+} log_Event;
+
+/* Single producer, single consumer ring of the events of a thread. */
+typedef struct log_Ring {
+  log_Event events[LOG_RING_SIZE];
+  atomic_uint head;
+  atomic_uint tail;
+  atomic_ullong dropped;
+  atomic_int released;
+  struct log_Ring *next;
+} log_Ring;
+
+static struct {
+  atomic_int enabled;
+  atomic_int stopping;
+  int started;
+  pthread_t thread;
+  pthread_key_t key;
+  pthread_once_t once;
+  /* Protects the list of rings. */
+  pthread_mutex_t rings_lock;
+  /* Taken while formatting events, by the thread or log_flush. */
+  pthread_mutex_t drain_lock;
+  log_Ring *rings;
+  unsigned long long reported_dropped;
+} A = {
+  .once = PTHREAD_ONCE_INIT,
+  .rings_lock = PTHREAD_MUTEX_INITIALIZER,
+  .drain_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static __thread log_Ring *thread_ring;
+
+
 static void lock(void)   {
   if (L.lock) {
     L.lock(L.udata, 1);
@@ -78,7 +148,7 @@ void log_set_fp(FILE *fp) {
 
 
 void log_set_level(int level) {
-  L.level = level;
+  log_level = level;
 }
 
 
@@ -87,11 +157,473 @@ void log_set_quiet(int enable) {
 }
 
 
+static void write_header(FILE *stream, struct tm *lt, const char *time_format,
+  int colored, int level, const char *file, int line) {
+  char buf[32];
+  buf[strftime(buf, sizeof(buf), time_format, lt)] = '\0';
+#ifdef LOG_USE_COLOR
+  if (colored) {
+    fprintf(
+      stream, "%s %s%-5s\x1b[0m \x1b[90m%s:%d:\x1b[0m ",
+      buf, level_colors[level], level_names[level], file, line);
+    return;
+  }
+#else
+  (void)colored;
+#endif
+  fprintf(stream, "%s %-5s %s:%d: ", buf, level_names[level], file, line);
+}
+
+
+/* Parses the conversion specification following a '%', returns its end. */
+static const char *parse_spec(const char *fmt, log_Spec *spec) {
+  spec->flags = fmt;
+  while (*fmt && strchr("-+ #0'", *fmt)) {
+    fmt++;
+  }
+  spec->flags_length = fmt - spec->flags;
+  spec->width = -1;
+  if (*fmt == '*') {
+    spec->width = -2;
+    fmt++;
+  } else if (*fmt >= '0' && *fmt <= '9') {
+    spec->width = strtol(fmt, (char **)&fmt, 10);
+  }
+  spec->precision = -1;
+  if (*fmt == '.') {
+    fmt++;
+    if (*fmt == '*') {
+      spec->precision = -2;
+      fmt++;
+    } else {
+      spec->precision = strtol(fmt, (char **)&fmt, 10);
+    }
+  }
+  spec->length = LENGTH_NONE;
+  switch (*fmt) {
+    case 'h':
+      spec->length = fmt[1] == 'h' ? LENGTH_HH : LENGTH_H;
+      fmt += fmt[1] == 'h' ? 2 : 1;
+      break;
+    case 'l':
+      spec->length = fmt[1] == 'l' ? LENGTH_LL : LENGTH_L;
+      fmt += fmt[1] == 'l' ? 2 : 1;
+      break;
+    case 'j': spec->length = LENGTH_J; fmt++; break;
+    case 'z': spec->length = LENGTH_Z; fmt++; break;
+    case 't': spec->length = LENGTH_T; fmt++; break;
+    case 'L': spec->length = LENGTH_LONG_DOUBLE; fmt++; break;
+  }
+  spec->conversion = *fmt;
+  return *fmt ? fmt + 1 : fmt;
+}
+
+
+static long long read_signed(int length, va_list *args) {
+  switch (length) {
+    case LENGTH_HH: return (signed char)va_arg(*args, int);
+    case LENGTH_H:  return (short)va_arg(*args, int);
+    case LENGTH_L:  return va_arg(*args, long);
+    case LENGTH_LL: return va_arg(*args, long long);
+    case LENGTH_J:  return va_arg(*args, intmax_t);
+    case LENGTH_Z:  return (long long)va_arg(*args, size_t);
+    case LENGTH_T:  return va_arg(*args, ptrdiff_t);
+    default:        return va_arg(*args, int);
+  }
+}
+
+
+static unsigned long long read_unsigned(int length, va_list *args) {
+  switch (length) {
+    case LENGTH_HH: return (unsigned char)va_arg(*args, unsigned int);
+    case LENGTH_H:  return (unsigned short)va_arg(*args, unsigned int);
+    case LENGTH_L:  return va_arg(*args, unsigned long);
+    case LENGTH_LL: return va_arg(*args, unsigned long long);
+    case LENGTH_J:  return va_arg(*args, uintmax_t);
+    case LENGTH_Z:  return va_arg(*args, size_t);
+    case LENGTH_T:  return (unsigned long long)va_arg(*args, ptrdiff_t);
+    default:        return va_arg(*args, unsigned int);
+  }
+}
+
+
+static void add_arg(log_Event *ev, log_Arg arg) {
+  if (ev->args_count < LOG_EVENT_ARGS_COUNT) {
+    ev->args[ev->args_count] = arg;
+  }
+  ev->args_count++;
+}
+
+
+/* Copies the arguments of fmt into ev, without formatting them. */
+static void record_args(log_Event *ev, const char *fmt, va_list *args) {
+  log_Spec spec;
+  log_Arg arg;
+
+  ev->args_count = 0;
+  ev->text_length = 0;
+  while ((fmt = strchr(fmt, '%')) != NULL) {
+    fmt = parse_spec(fmt + 1, &spec);
+    if (spec.width == -2) {
+      arg.i = va_arg(*args, int);
+      add_arg(ev, arg);
+    }
+    if (spec.precision == -2) {
+      arg.i = va_arg(*args, int);
+      add_arg(ev, arg);
+    }
+    switch (spec.conversion) {
+      case 'd': case 'i': case 'c':
+        arg.i = read_signed(spec.length, args);
+        break;
+      case 'u': case 'x': case 'X': case 'o':
+        arg.u = read_unsigned(spec.length, args);
+        break;
+      case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+        arg.d = spec.length == LENGTH_LONG_DOUBLE
+          ? (double)va_arg(*args, long double) : va_arg(*args, double);
+        break;
+      case 'p':
+        arg.p = va_arg(*args, void *);
+        break;
+      case 's': {
+        const char *string = va_arg(*args, const char *);
+        size_t length, available;
+        if (string == NULL) {
+          string = "(null)";
+        }
+        length = strlen(string);
+        if (spec.precision >= 0 && (size_t)spec.precision < length) {
+          length = spec.precision;
+        }
+        /* Strings are truncated once the text is full, text_length then
+           stays on its last byte, always '\0'. */
+        available = LOG_EVENT_TEXT_SIZE - 1 - ev->text_length;
+        if (length > available) {
+          length = available;
+        }
+        memcpy(ev->text + ev->text_length, string, length);
+        ev->text[ev->text_length + length] = '\0';
+        arg.text = ev->text_length;
+        ev->text_length += length < available ? length + 1 : length;
+        break;
+      }
+      default:
+        /* %%, %n and unknown conversions take no argument. */
+        continue;
+    }
+    add_arg(ev, arg);
+  }
+}
+
+
+static log_Arg next_arg(const log_Event *ev, int *index) {
+  log_Arg none = { 0 };
+  if (*index >= ev->args_count || *index >= LOG_EVENT_ARGS_COUNT) {
+    (*index)++;
+    return none;
+  }
+  return ev->args[(*index)++];
+}
+
+
+/* Formats the message of ev into buf. */
+static void format_message(const log_Event *ev, char *buf, size_t size) {
+  const char *fmt = ev->fmt, *percent;
+  char spec_fmt[32];
+  log_Spec spec;
+  log_Arg arg;
+  int index = 0, width, precision, n;
+  size_t length = 0;
+
+  while (length < size - 1 && (percent = strchr(fmt, '%')) != NULL) {
+    n = percent - fmt;
+    if ((size_t)n > size - 1 - length) {
+      n = size - 1 - length;
+    }
+    memcpy(buf + length, fmt, n);
+    length += n;
+    fmt = parse_spec(percent + 1, &spec);
+    width = spec.width == -2 ? (int)next_arg(ev, &index).i : spec.width;
+    precision = spec.precision == -2 ? (int)next_arg(ev, &index).i : spec.precision;
+    /* Rebuilds the specification, with explicit width and precision and
+       the length of the recorded argument. */
+    n = snprintf(spec_fmt, sizeof(spec_fmt), "%%%.*s", spec.flags_length, spec.flags);
+    if (width >= 0) {
+      n += snprintf(spec_fmt + n, sizeof(spec_fmt) - n, "%d", width);
+    }
+    if (precision >= 0) {
+      n += snprintf(spec_fmt + n, sizeof(spec_fmt) - n, ".%d", precision);
+    }
+    switch (spec.conversion) {
+      case 'd': case 'i': case 'u': case 'x': case 'X': case 'o':
+        snprintf(spec_fmt + n, sizeof(spec_fmt) - n, "ll%c", spec.conversion);
+        arg = next_arg(ev, &index);
+        n = snprintf(buf + length, size - length, spec_fmt, arg.i);
+        break;
+      case 'c':
+        snprintf(spec_fmt + n, sizeof(spec_fmt) - n, "c");
+        n = snprintf(buf + length, size - length, spec_fmt, (int)next_arg(ev, &index).i);
+        break;
+      case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+        snprintf(spec_fmt + n, sizeof(spec_fmt) - n, "%c", spec.conversion);
+        n = snprintf(buf + length, size - length, spec_fmt, next_arg(ev, &index).d);
+        break;
+      case 'p':
+        snprintf(spec_fmt + n, sizeof(spec_fmt) - n, "p");
+        n = snprintf(buf + length, size - length, spec_fmt, next_arg(ev, &index).p);
+        break;
+      case 's':
+        snprintf(spec_fmt + n, sizeof(spec_fmt) - n, "s");
+        n = snprintf(buf + length, size - length, spec_fmt, ev->text + next_arg(ev, &index).text);
+        break;
+      case '%':
+        buf[length] = '%';
+        n = 1;
+        break;
+      default:
+        n = 0;
+        break;
+    }
+    length += n < 0 ? 0 : (size_t)n;
+    if (length > size - 1) {
+      length = size - 1;
+    }
+  }
+  if (percent == NULL) {
+    n = snprintf(buf + length, size - length, "%s", fmt);
+  }
+  buf[size - 1] = '\0';
+}
+
+
+static void write_event(const log_Event *ev) {
+  char message[512];
+  struct tm lt;
+
+  format_message(ev, message, sizeof(message));
+  localtime_r(&ev->time.tv_sec, &lt);
+  lock();
+  if (!L.quiet) {
+    write_header(stderr, &lt, "%H:%M:%S", 1, ev->level, ev->file, ev->line);
+    fprintf(stderr, "%s\n", message);
+  }
+  if (L.fp) {
+    write_header(L.fp, &lt, "%Y-%m-%d %H:%M:%S", 0, ev->level, ev->file, ev->line);
+    fprintf(L.fp, "%s\n", message);
+  }
+  unlock();
+}
+
+
+static int is_before(const struct timespec *a, const struct timespec *b) {
+  return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+
+/* Writes the events of all the rings, oldest first. */
+static void drain(void) {
+  log_Ring *rings, *ring, *oldest;
+  unsigned long long dropped;
+  unsigned int tail;
+
+  pthread_mutex_lock(&A.drain_lock);
+  /* Rings are only ever added in front of the list, the rings of threads
+     logging for the first time are drained next time. */
+  pthread_mutex_lock(&A.rings_lock);
+  rings = A.rings;
+  pthread_mutex_unlock(&A.rings_lock);
+  for (;;) {
+    oldest = NULL;
+    for (ring = rings; ring != NULL; ring = ring->next) {
+      tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+      if (atomic_load_explicit(&ring->head, memory_order_acquire) == tail) {
+        continue;
+      }
+      if (oldest == NULL || is_before(&ring->events[tail % LOG_RING_SIZE].time,
+          &oldest->events[atomic_load_explicit(&oldest->tail, memory_order_relaxed) % LOG_RING_SIZE].time)) {
+        oldest = ring;
+      }
+    }
+    if (oldest == NULL) {
+      break;
+    }
+    tail = atomic_load_explicit(&oldest->tail, memory_order_relaxed);
+    write_event(&oldest->events[tail % LOG_RING_SIZE]);
+    atomic_store_explicit(&oldest->tail, tail + 1, memory_order_release);
+  }
+  dropped = 0;
+  for (ring = rings; ring != NULL; ring = ring->next) {
+    dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+  }
+  lock();
+  if (dropped != A.reported_dropped) {
+    if (!L.quiet) {
+      fprintf(stderr, "%llu log events dropped\n", dropped - A.reported_dropped);
+    }
+    if (L.fp) {
+      fprintf(L.fp, "%llu log events dropped\n", dropped - A.reported_dropped);
+    }
+    A.reported_dropped = dropped;
+  }
+  fflush(stderr);
+  if (L.fp) {
+    fflush(L.fp);
+  }
+  unlock();
+  pthread_mutex_unlock(&A.drain_lock);
+}
+
+
+static void *run_drain_thread(void *unused) {
+  struct timespec period = { 0, LOG_ASYNC_PERIOD * 1000L };
+  (void)unused;
+  while (!atomic_load(&A.stopping)) {
+    nanosleep(&period, NULL);
+    drain();
+  }
+  return NULL;
+}
+
+
+/* Hands the ring of an exiting thread over to the next thread. */
+static void release_ring(void *ring) {
+  atomic_store(&((log_Ring *)ring)->released, 1);
+}
+
+
+static void stop_async(void) {
+  log_set_async(0);
+}
+
+
+static void init_async(void) {
+  pthread_key_create(&A.key, release_ring);
+  atexit(stop_async);
+}
+
+
+static log_Ring *get_ring(void) {
+  log_Ring *ring;
+
+  if (thread_ring != NULL) {
+    return thread_ring;
+  }
+  pthread_mutex_lock(&A.rings_lock);
+  for (ring = A.rings; ring != NULL; ring = ring->next) {
+    if (atomic_load(&ring->released)) {
+      atomic_store(&ring->released, 0);
+      break;
+    }
+  }
+  if (ring == NULL) {
+    ring = calloc(1, sizeof(log_Ring));
+    if (ring != NULL) {
+      ring->next = A.rings;
+      A.rings = ring;
+    }
+  }
+  pthread_mutex_unlock(&A.rings_lock);
+  if (ring != NULL) {
+    pthread_setspecific(A.key, ring);
+  }
+  thread_ring = ring;
+  return ring;
+}
+
+
+/* Records the message in the ring of the thread, returns 0 if it could not. */
+static int record(int level, const char *file, int line, const char *fmt, va_list *args) {
+  log_Ring *ring = get_ring();
+  log_Event *ev;
+  unsigned int head;
+
+  if (ring == NULL) {
+    return 0;
+  }
+  head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= LOG_RING_SIZE) {
+    atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+    return 1;
+  }
+  ev = &ring->events[head % LOG_RING_SIZE];
+  clock_gettime(CLOCK_REALTIME, &ev->time);
+  ev->file = file;
+  ev->fmt = fmt;
+  ev->line = line;
+  ev->level = level;
+  record_args(ev, fmt, args);
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+  return 1;
+}
+
+
+int log_set_async(int enable) {
+  pthread_once(&A.once, init_async);
+  pthread_mutex_lock(&A.drain_lock);
+  if (enable && !A.started) {
+    atomic_store(&A.stopping, 0);
+    if (pthread_create(&A.thread, NULL, run_drain_thread, NULL) != 0) {
+      pthread_mutex_unlock(&A.drain_lock);
+      return -1;
+    }
+    A.started = 1;
+    atomic_store(&A.enabled, 1);
+    pthread_mutex_unlock(&A.drain_lock);
+    return 0;
+  }
+  if (!enable && A.started) {
+    atomic_store(&A.enabled, 0);
+    atomic_store(&A.stopping, 1);
+    A.started = 0;
+    pthread_mutex_unlock(&A.drain_lock);
+    pthread_join(A.thread, NULL);
+    drain();
+    return 0;
+  }
+  pthread_mutex_unlock(&A.drain_lock);
+  return 0;
+}
+
+
+void log_flush(void) {
+  drain();
+}
+
+
+unsigned long long log_get_dropped(void) {
+  unsigned long long dropped = 0;
+  log_Ring *ring;
+
+  pthread_mutex_lock(&A.rings_lock);
+  for (ring = A.rings; ring != NULL; ring = ring->next) {
+    dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+  }
+  pthread_mutex_unlock(&A.rings_lock);
+  return dropped;
+}
+
+
 void log_log(int level, const char *file, int line, const char *fmt, ...) {
-  if (level < L.level) {
+  if (level < log_level) {
     return;
   }
 
+  /* Record the event, errors are written at once */
+  if (atomic_load_explicit(&A.enabled, memory_order_relaxed)) {
+    va_list args;
+    int recorded;
+    va_start(args, fmt);
+    recorded = record(level, file, line, fmt, &args);
+    va_end(args);
+    if (recorded) {
+      if (level >= LOG_ERROR) {
+        drain();
+      }
+      return;
+    }
+  }
+
   /* Acquire lock */
   lock();
 
@@ -102,15 +634,7 @@ void log_log(int level, const char *file, int line, const char *fmt, ...) {
   /* Log to stderr */
   if (!L.quiet) {
     va_list args;
-    char buf[16];
-    buf[strftime(buf, sizeof(buf), "%H:%M:%S", lt)] = '\0';
-#ifdef LOG_USE_COLOR
-    fprintf(
-      stderr, "%s %s%-5s\x1b[0m \x1b[90m%s:%d:\x1b[0m ",
-      buf, level_colors[level], level_names[level], file, line);
-#else
-    fprintf(stderr, "%s %-5s %s:%d: ", buf, level_names[level], file, line);
-#endif
+    write_header(stderr, lt, "%H:%M:%S", 1, level, file, line);
     va_start(args, fmt);
     vfprintf(stderr, fmt, args);
     va_end(args);
@@ -121,9 +645,7 @@ void log_log(int level, const char *file, int line, const char *fmt, ...) {
   /* Log to file */
   if (L.fp) {
     va_list args;
-    char buf[32];
-    buf[strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", lt)] = '\0';
-    fprintf(L.fp, "%s %-5s %s:%d: ", buf, level_names[level], file, line);
+    write_header(L.fp, lt, "%Y-%m-%d %H:%M:%S", 0, level, file, line);
     va_start(args, fmt);
     vfprintf(L.fp, fmt, args);
     va_end(args);
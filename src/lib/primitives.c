@@ -1,7 +1,16 @@
 #include "primitives.h"
+#include "image.h"
+#include "async_io.h"
+#include "stats.h"
+#include "io_log.h"
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
+#include <poll.h>
+#include <dlfcn.h>
+#ifdef HAVE_FREADAHEAD
+#include <stdio_ext.h>
+#endif
 
 #define ENABLE_LOGGING
 #ifdef ENABLE_LOGGING
@@ -12,6 +21,47 @@
 
 #define ERROR_NO_STREAM_AVAILABLE (-1)
 
+// Number of bytes the addresses of the VM can reach, the end of the buffers
+// of block primitives.
+#define ADDRESSABLE_MEMORY_SIZE 0x1000000
+
+// Offsets of the arguments of block primitives from the result pointer.
+#define BLOCK_STREAM_OFFSET 0
+#define BLOCK_ADDRESS_OFFSET 1
+#define BLOCK_LENGTH_OFFSET 4
+#define BLOCK_DELIMITER_OFFSET 7
+
+// Offsets of the arguments of memory primitives from the result pointer,
+// either (address, length, value) or (address, second address, length).
+#define RANGE_ADDRESS_OFFSET 0
+#define RANGE_LENGTH_OFFSET 3
+#define RANGE_VALUE_OFFSET 6
+#define RANGE_SECOND_ADDRESS_OFFSET 3
+#define RANGE_SECOND_LENGTH_OFFSET 6
+
+// Offset of the flag stored by memory primitives after an address.
+#define RANGE_FOUND_OFFSET 3
+
+// Offsets of the arguments of arithmetic primitives from the result pointer.
+#define ARITHMETIC_OPERATION_OFFSET 0
+#define ARITHMETIC_WIDTH_OFFSET 1
+#define ARITHMETIC_OPERANDS_OFFSET 2
+#define ARITHMETIC_COUNT_OFFSET 2
+#define ARITHMETIC_X_ARRAY_OFFSET 5
+#define ARITHMETIC_Y_ARRAY_OFFSET 8
+#define ARITHMETIC_DESTINATION_ARRAY_OFFSET 11
+
+/**
+ * A registered extended primitive, see vm_register_primitive.
+ */
+struct extended_primitive_entry{
+    extended_primitive function;
+    void *user_data;
+};
+
+// Extended primitives indexed by id, NULL functions where none is registered.
+static struct extended_primitive_entry extended_primitives[PRIMITIVE_EXTENDED_IDS_COUNT];
+
 unsigned int extract_address(struct virtual_machine *vm, unsigned int address){
     return vm->memory[address] << DOUBLE_WORD_SIZE
         | vm->memory[address+1] << WORD_SIZE
@@ -22,6 +72,48 @@ unsigned int extract_result_address(struct virtual_machine *vm){
     return extract_address(vm, PRIMITIVE_RESULT_POINTER_HIGH_ADDRESS);
 }
 
+/**
+ * Stores value in the 3 bytes at address, like extract_address reads them.
+ */
+static void store_address(struct virtual_machine *vm, unsigned int address, unsigned int value){
+    vm->memory[address] = (value & 0xFF0000) >> DOUBLE_WORD_SIZE;
+    vm->memory[address+1] = (value & 0x00FF00) >> WORD_SIZE;
+    vm->memory[address+2] = (value & 0x0000FF);
+    notify_memory_write(vm, address, 3);
+}
+
+/**
+ * Returns the stream stream_id of vm, NULL if it is not open or if
+ * stream_id is past the stream slots: stream ids are bytes of the memory.
+ */
+static FILE *get_file_stream(struct virtual_machine *vm, unsigned int stream_id){
+    if(stream_id >= FILE_STREAMS_SIZE){
+        return NULL;
+    }
+    return vm->file_streams[stream_id];
+}
+
+/**
+ * Returns TRUE if stream holds input it read ahead, which reading returns
+ * without waiting on its descriptor. The C library features telling it are
+ * detected by CMake.
+ */
+static int has_buffered_input(FILE *stream){
+#if defined(HAVE_FREADAHEAD)
+    // musl.
+    return __freadahead(stream) > 0;
+#elif defined(HAVE_FILE_READ_POINTERS)
+    // glibc.
+    return stream->_IO_read_ptr < stream->_IO_read_end;
+#elif defined(HAVE_FILE_READ_COUNT)
+    // BSDs and macOS.
+    return stream->_r > 0;
+#else
+    // No way to tell: only unbuffered streams are seen right.
+    return 0;
+#endif
+}
+
 void primitive_ok(struct virtual_machine *vm){
     vm->memory[PRIMITIVE_RESULT_CODE_ADDRESS] = PRIMITIVE_OK_RESULT_CODE;
 }
@@ -84,7 +176,7 @@ void primitive_get_char(struct virtual_machine *vm){
     log_debug("    result_address = 0x%06X", result_address);
 
     stream_id = vm->memory[result_address];
-    input_stream = vm->file_streams[stream_id];
+    input_stream = get_file_stream(vm, stream_id);
 
     if(input_stream == NULL){
         log_debug(
@@ -102,7 +194,9 @@ void primitive_get_char(struct virtual_machine *vm){
         return;
     }
     vm->memory[result_address] = (WORD)fgetc_result;
+    notify_memory_write(vm, result_address, 1);
     log_debug( "    char=%c.", vm->memory[result_address]);
+    count_primitive_bytes(vm, 1);
     primitive_ok(vm);
 }
 
@@ -120,7 +214,7 @@ void primitive_put_char(struct virtual_machine *vm){
     log_debug( "   char_to_put=%c.", char_to_put);
 
     stream_id = vm->memory[result_address+1];
-    output_stream = vm->file_streams[stream_id];
+    output_stream = get_file_stream(vm, stream_id);
 
     if(output_stream == NULL){
         log_debug(
@@ -138,6 +232,7 @@ void primitive_put_char(struct virtual_machine *vm){
         log_debug("    %s", strerror(errno));
         primitive_fail(vm);
     } else{
+        count_primitive_bytes(vm, 1);
         primitive_ok(vm);
     }
 }
@@ -207,6 +302,7 @@ void primitive_open_file(struct virtual_machine *vm){
         return;
     }
     vm->memory[result_address] = stream_id;
+    notify_memory_write(vm, result_address, 1);
     primitive_ok(vm);
 }
 
@@ -219,7 +315,7 @@ void primitive_close_file(struct virtual_machine *vm){
     result_address = extract_result_address(vm);
     log_debug("    result_address = 0x%06X", result_address);
     stream_id = vm->memory[result_address];
-    file_stream = vm->file_streams[stream_id];
+    file_stream = get_file_stream(vm, stream_id);
 
     if(file_stream == NULL){
         log_debug(
@@ -246,11 +342,12 @@ void primitive_is_file_open(struct virtual_machine *vm){
     log_debug("    result_address = 0x%06X", result_address);
     stream_id = vm->memory[result_address];
     
-    if(vm->file_streams[stream_id] == NULL){
+    if(get_file_stream(vm, stream_id) == NULL){
         vm->memory[result_address] = PRIMITIVE_FILE_IS_CLOSED;
     } else{
         vm->memory[result_address] = PRIMITIVE_FILE_IS_OPEN;
     }
+    notify_memory_write(vm, result_address, 1);
     primitive_ok(vm);
 }
 
@@ -279,16 +376,29 @@ void primitive_add_addresses(struct virtual_machine *vm){
     y = extract_address(vm, result_address+3);
     sum = x + y;
     vm->memory[result_address+3] = (sum & 0xFF000000) > 0;
-    sum = sum % 0xFFFFFF;
+    sum = sum & 0xFFFFFF;
     vm->memory[result_address] = (sum & 0xFF0000) >> DOUBLE_WORD_SIZE;
     vm->memory[result_address+1] = (sum & 0x00FF00) >> WORD_SIZE;
     vm->memory[result_address+2] = (sum & 0x0000FF);
+    notify_memory_write(vm, result_address, 4);
     primitive_ok(vm);
 }
 
 void primitive_substract_addresses(struct virtual_machine *vm){
-    //TODO
-    primitive_fail(vm);
+    unsigned int result_address;
+    unsigned long x, y, difference;
+
+    result_address = extract_result_address(vm);
+
+    x = extract_address(vm, result_address);
+    y = extract_address(vm, result_address+3);
+    difference = (x - y) & 0xFFFFFF;
+    vm->memory[result_address+3] = x < y;
+    vm->memory[result_address] = (difference & 0xFF0000) >> DOUBLE_WORD_SIZE;
+    vm->memory[result_address+1] = (difference & 0x00FF00) >> WORD_SIZE;
+    vm->memory[result_address+2] = (difference & 0x0000FF);
+    notify_memory_write(vm, result_address, 4);
+    primitive_ok(vm);
 }
 
 void primitive_decrement_address(struct virtual_machine *vm){
@@ -305,6 +415,7 @@ void primitive_decrement_address(struct virtual_machine *vm){
     vm->memory[result_address] = (decremented & 0xFF0000) >> DOUBLE_WORD_SIZE;
     vm->memory[result_address+1] = (decremented & 0x00FF00) >> WORD_SIZE;
     vm->memory[result_address+2] = (decremented & 0x0000FF);
+    notify_memory_write(vm, result_address, 3);
     primitive_ok(vm);
 }
 
@@ -318,10 +429,527 @@ void primitive_increment_address(struct virtual_machine *vm){
     vm->memory[result_address] = (incremented & 0xFF0000) >> DOUBLE_WORD_SIZE;
     vm->memory[result_address+1] = (incremented & 0x00FF00) >> WORD_SIZE;
     vm->memory[result_address+2] = (incremented & 0x0000FF);
+    notify_memory_write(vm, result_address, 3);
+    primitive_ok(vm);
+}
+
+void primitive_checkpoint(struct virtual_machine *vm){
+    unsigned int result_address;
+    char *file_path;
+
+    result_address = extract_result_address(vm);
+    log_debug("    result_address = 0x%06X", result_address);
+    file_path = (char *)vm->memory + result_address;
+    // Done by execute_primitive once the primitive returns, which is the state
+    // to record.
+    set_primitive_call_id(vm, PRIMITIVE_ID_NOPE);
+    set_primitive_is_ready(vm, PRIMITIVE_NOT_READY);
+    primitive_ok(vm);
+    if(write_checkpoint(vm, file_path) != VM_OK){
+        primitive_fail(vm);
+    }
+}
+
+/**
+ * Reads the arguments of a block primitive at the result pointer.
+ * Returns the stream, or NULL if it is not open, including ids past the
+ * stream slots, or if the buffer does not fit in addressable memory.
+ */
+static FILE *extract_block_arguments(struct virtual_machine *vm,
+    unsigned int *result_address, unsigned int *buffer_address, unsigned int *length){
+    unsigned char stream_id;
+    FILE *stream;
+
+    *result_address = extract_result_address(vm);
+    log_debug("    result_address = 0x%06X", *result_address);
+    stream_id = vm->memory[*result_address + BLOCK_STREAM_OFFSET];
+    *buffer_address = extract_address(vm, *result_address + BLOCK_ADDRESS_OFFSET);
+    *length = extract_address(vm, *result_address + BLOCK_LENGTH_OFFSET);
+    log_debug("   filestream=%d, buffer=0x%06X, length=%u.", stream_id, *buffer_address, *length);
+    if(*length > ADDRESSABLE_MEMORY_SIZE - *buffer_address){
+        log_debug("   Buffer out of memory.");
+        return NULL;
+    }
+    stream = get_file_stream(vm, stream_id);
+    if(stream == NULL){
+        log_debug("   Attempt to use non allocated stream with id=%d.", stream_id);
+    }
+    return stream;
+}
+
+void primitive_read_block(struct virtual_machine *vm){
+    unsigned int result_address, buffer_address, length;
+    size_t count;
+    FILE *input_stream;
+
+    input_stream = extract_block_arguments(vm, &result_address, &buffer_address, &length);
+    if(input_stream == NULL){
+        primitive_fail(vm);
+        return;
+    }
+    count = fread(vm->memory + buffer_address, 1, length, input_stream);
+    // The buffer may hold instructions.
+    notify_memory_write(vm, buffer_address, count);
+    count_primitive_bytes(vm, count);
+    if(count == 0 && length > 0){
+        primitive_fail(vm);
+        return;
+    }
+    store_address(vm, result_address, count);
+    primitive_ok(vm);
+}
+
+void primitive_write_block(struct virtual_machine *vm){
+    unsigned int result_address, buffer_address, length;
+    size_t count;
+    FILE *output_stream;
+
+    output_stream = extract_block_arguments(vm, &result_address, &buffer_address, &length);
+    if(output_stream == NULL){
+        primitive_fail(vm);
+        return;
+    }
+    count = fwrite(vm->memory + buffer_address, 1, length, output_stream);
+    count_primitive_bytes(vm, count);
+    store_address(vm, result_address, count);
+    if(count < length){
+        log_debug("    %s", strerror(errno));
+        primitive_fail(vm);
+        return;
+    }
+    primitive_ok(vm);
+}
+
+void primitive_read_until(struct virtual_machine *vm){
+    unsigned int result_address, buffer_address, length, count;
+    WORD delimiter;
+    FILE *input_stream;
+    int character;
+
+    input_stream = extract_block_arguments(vm, &result_address, &buffer_address, &length);
+    if(input_stream == NULL){
+        primitive_fail(vm);
+        return;
+    }
+    delimiter = vm->memory[result_address + BLOCK_DELIMITER_OFFSET];
+    count = 0;
+    flockfile(input_stream);
+    while(count < length && (character = getc_unlocked(input_stream)) != EOF){
+        vm->memory[buffer_address + count++] = (WORD)character;
+        if(character == delimiter){
+            break;
+        }
+    }
+    funlockfile(input_stream);
+    notify_memory_write(vm, buffer_address, count);
+    count_primitive_bytes(vm, count);
+    if(count == 0 && length > 0){
+        primitive_fail(vm);
+        return;
+    }
+    store_address(vm, result_address, count);
+    primitive_ok(vm);
+}
+
+/**
+ * Reads the width bytes big-endian operand at address.
+ */
+static unsigned long long extract_operand(struct virtual_machine *vm, unsigned int address, unsigned int width){
+    unsigned long long value = 0;
+    for(unsigned int i = 0; i < width; i++){
+        value = value << WORD_SIZE | vm->memory[address + i];
+    }
+    return value;
+}
+
+/**
+ * Stores value in the width bytes at address, like extract_operand reads
+ * them. Does not notify the write.
+ */
+static void store_operand(struct virtual_machine *vm, unsigned int address, unsigned int width, unsigned long long value){
+    for(unsigned int i = width; i > 0; i--){
+        vm->memory[address + i - 1] = value & WORD_BIT_MASK;
+        value >>= WORD_SIZE;
+    }
+}
+
+/**
+ * Sets the sizes of the 2 parts of the result of operation on width bytes
+ * operands, see primitive_arithmetic.
+ * Returns FALSE if operation or width is not valid.
+ */
+static int get_arithmetic_result_sizes(WORD operation, unsigned int width,
+    unsigned int *result_size, unsigned int *extra_size){
+    if(width != PRIMITIVE_ARITHMETIC_WORD && width != PRIMITIVE_ARITHMETIC_ADDRESS){
+        return 0;
+    }
+    *result_size = width;
+    *extra_size = 0;
+    switch(operation){
+        case(PRIMITIVE_ARITHMETIC_ADD):
+        case(PRIMITIVE_ARITHMETIC_SUBTRACT):
+            *extra_size = 1;
+            return 1;
+        case(PRIMITIVE_ARITHMETIC_MULTIPLY):
+        case(PRIMITIVE_ARITHMETIC_DIVIDE):
+            *extra_size = width;
+            return 1;
+        case(PRIMITIVE_ARITHMETIC_COMPARE):
+            *result_size = 1;
+            return 1;
+        case(PRIMITIVE_ARITHMETIC_SHIFT_LEFT):
+        case(PRIMITIVE_ARITHMETIC_SHIFT_RIGHT):
+        case(PRIMITIVE_ARITHMETIC_AND):
+        case(PRIMITIVE_ARITHMETIC_OR):
+        case(PRIMITIVE_ARITHMETIC_XOR):
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Computes operation on the width bytes operands x and y, the 2 parts of its
+ * result going to result and extra.
+ * Returns FALSE on a division by zero.
+ */
+static inline int compute_arithmetic(WORD operation, unsigned int width,
+    unsigned long long x, unsigned long long y,
+    unsigned long long *result, unsigned long long *extra){
+    unsigned int bits = width * WORD_SIZE;
+    unsigned long long mask = (1ULL << bits) - 1;
+
+    *result = 0;
+    *extra = 0;
+    switch(operation){
+        case(PRIMITIVE_ARITHMETIC_ADD):
+            *result = (x + y) & mask;
+            *extra = (x + y) >> bits;
+            break;
+        case(PRIMITIVE_ARITHMETIC_SUBTRACT):
+            *result = (x - y) & mask;
+            *extra = x < y;
+            break;
+        case(PRIMITIVE_ARITHMETIC_MULTIPLY):
+            *result = (x * y) & mask;
+            *extra = (x * y) >> bits;
+            break;
+        case(PRIMITIVE_ARITHMETIC_DIVIDE):
+            if(y == 0){
+                return 0;
+            }
+            *result = x / y;
+            *extra = x % y;
+            break;
+        case(PRIMITIVE_ARITHMETIC_COMPARE):
+            if(x == y){
+                *result = PRIMITIVE_COMPARE_EQUAL;
+            } else if(x < y){
+                *result = PRIMITIVE_COMPARE_LESS;
+            } else{
+                *result = PRIMITIVE_COMPARE_GREATER;
+            }
+            break;
+        case(PRIMITIVE_ARITHMETIC_SHIFT_LEFT):
+            *result = y >= bits ? 0 : (x << y) & mask;
+            break;
+        case(PRIMITIVE_ARITHMETIC_SHIFT_RIGHT):
+            *result = y >= bits ? 0 : x >> y;
+            break;
+        case(PRIMITIVE_ARITHMETIC_AND):
+            *result = x & y;
+            break;
+        case(PRIMITIVE_ARITHMETIC_OR):
+            *result = x | y;
+            break;
+        case(PRIMITIVE_ARITHMETIC_XOR):
+            *result = x ^ y;
+            break;
+    }
+    return 1;
+}
+
+void primitive_arithmetic(struct virtual_machine *vm){
+    unsigned int result_address, width, result_size, extra_size;
+    unsigned long long x, y, result, extra;
+    WORD operation;
+
+    result_address = extract_result_address(vm);
+    operation = vm->memory[result_address + ARITHMETIC_OPERATION_OFFSET];
+    width = vm->memory[result_address + ARITHMETIC_WIDTH_OFFSET];
+    if(!get_arithmetic_result_sizes(operation, width, &result_size, &extra_size)){
+        log_debug("   Invalid arithmetic operation %d on %u bytes.", operation, width);
+        primitive_fail(vm);
+        return;
+    }
+    x = extract_operand(vm, result_address + ARITHMETIC_OPERANDS_OFFSET, width);
+    y = extract_operand(vm, result_address + ARITHMETIC_OPERANDS_OFFSET + width, width);
+    if(!compute_arithmetic(operation, width, x, y, &result, &extra)){
+        log_debug("   Division by zero.");
+        primitive_fail(vm);
+        return;
+    }
+    store_operand(vm, result_address, result_size, result);
+    store_operand(vm, result_address + result_size, extra_size, extra);
+    notify_memory_write(vm, result_address, result_size + extra_size);
+    primitive_ok(vm);
+}
+
+void primitive_arithmetic_array(struct virtual_machine *vm){
+    unsigned int result_address, width, result_size, extra_size, count;
+    unsigned int x_address, y_address, destination_address;
+    unsigned long long x, y, result, extra;
+    WORD operation;
+
+    result_address = extract_result_address(vm);
+    if(result_address + ARITHMETIC_DESTINATION_ARRAY_OFFSET + 3 > MAX_MEMORY_SIZE){
+        log_debug("   Arguments out of memory.");
+        primitive_fail(vm);
+        return;
+    }
+    operation = vm->memory[result_address + ARITHMETIC_OPERATION_OFFSET];
+    width = vm->memory[result_address + ARITHMETIC_WIDTH_OFFSET];
+    count = extract_address(vm, result_address + ARITHMETIC_COUNT_OFFSET);
+    x_address = extract_address(vm, result_address + ARITHMETIC_X_ARRAY_OFFSET);
+    y_address = extract_address(vm, result_address + ARITHMETIC_Y_ARRAY_OFFSET);
+    destination_address = extract_address(vm, result_address + ARITHMETIC_DESTINATION_ARRAY_OFFSET);
+    if(!get_arithmetic_result_sizes(operation, width, &result_size, &extra_size)){
+        log_debug("   Invalid arithmetic operation %d on %u bytes.", operation, width);
+        primitive_fail(vm);
+        return;
+    }
+    if((unsigned long long)count * width > ADDRESSABLE_MEMORY_SIZE - x_address
+        || (unsigned long long)count * width > ADDRESSABLE_MEMORY_SIZE - y_address
+        || (unsigned long long)count * (result_size + extra_size) > ADDRESSABLE_MEMORY_SIZE - destination_address){
+        log_debug("   Array out of memory.");
+        primitive_fail(vm);
+        return;
+    }
+    for(unsigned int i = 0; i < count; i++){
+        x = extract_operand(vm, x_address + i * width, width);
+        y = extract_operand(vm, y_address + i * width, width);
+        if(!compute_arithmetic(operation, width, x, y, &result, &extra)){
+            log_debug("   Division by zero at index %u.", i);
+            notify_memory_write(vm, destination_address, i * (result_size + extra_size));
+            primitive_fail(vm);
+            return;
+        }
+        store_operand(vm, destination_address + i * (result_size + extra_size), result_size, result);
+        store_operand(vm, destination_address + i * (result_size + extra_size) + result_size, extra_size, extra);
+    }
+    notify_memory_write(vm, destination_address, count * (result_size + extra_size));
+    primitive_ok(vm);
+}
+
+/**
+ * Returns length, cut so that the range starting at address does not go past
+ * the addressable memory.
+ */
+static unsigned int clamp_range_length(unsigned int address, unsigned int length){
+    if(length > ADDRESSABLE_MEMORY_SIZE - address){
+        log_debug("   Range at 0x%06X cut to the end of memory.", address);
+        return ADDRESSABLE_MEMORY_SIZE - address;
+    }
+    return length;
+}
+
+void primitive_copy_memory(struct virtual_machine *vm){
+    unsigned int result_address, destination_address, source_address, length;
+
+    result_address = extract_result_address(vm);
+    destination_address = extract_address(vm, result_address + RANGE_ADDRESS_OFFSET);
+    source_address = extract_address(vm, result_address + RANGE_SECOND_ADDRESS_OFFSET);
+    length = extract_address(vm, result_address + RANGE_SECOND_LENGTH_OFFSET);
+    length = clamp_range_length(destination_address, length);
+    length = clamp_range_length(source_address, length);
+    memmove(vm->memory + destination_address, vm->memory + source_address, length);
+    notify_memory_write(vm, destination_address, length);
+    store_address(vm, result_address, length);
+    primitive_ok(vm);
+}
+
+void primitive_fill_memory(struct virtual_machine *vm){
+    unsigned int result_address, destination_address, length;
+    WORD value;
+
+    result_address = extract_result_address(vm);
+    destination_address = extract_address(vm, result_address + RANGE_ADDRESS_OFFSET);
+    length = extract_address(vm, result_address + RANGE_LENGTH_OFFSET);
+    value = vm->memory[result_address + RANGE_VALUE_OFFSET];
+    length = clamp_range_length(destination_address, length);
+    memset(vm->memory + destination_address, value, length);
+    notify_memory_write(vm, destination_address, length);
+    store_address(vm, result_address, length);
+    primitive_ok(vm);
+}
+
+void primitive_compare_memory(struct virtual_machine *vm){
+    unsigned int result_address, first_address, second_address, length;
+    int comparison;
+
+    result_address = extract_result_address(vm);
+    first_address = extract_address(vm, result_address + RANGE_ADDRESS_OFFSET);
+    second_address = extract_address(vm, result_address + RANGE_SECOND_ADDRESS_OFFSET);
+    length = extract_address(vm, result_address + RANGE_SECOND_LENGTH_OFFSET);
+    length = clamp_range_length(first_address, length);
+    length = clamp_range_length(second_address, length);
+    comparison = memcmp(vm->memory + first_address, vm->memory + second_address, length);
+    if(comparison == 0){
+        vm->memory[result_address] = PRIMITIVE_COMPARE_EQUAL;
+    } else if(comparison < 0){
+        vm->memory[result_address] = PRIMITIVE_COMPARE_LESS;
+    } else{
+        vm->memory[result_address] = PRIMITIVE_COMPARE_GREATER;
+    }
+    notify_memory_write(vm, result_address, 1);
+    primitive_ok(vm);
+}
+
+void primitive_find_byte(struct virtual_machine *vm){
+    unsigned int result_address, start_address, length;
+    WORD value, *found;
+
+    result_address = extract_result_address(vm);
+    start_address = extract_address(vm, result_address + RANGE_ADDRESS_OFFSET);
+    length = extract_address(vm, result_address + RANGE_LENGTH_OFFSET);
+    value = vm->memory[result_address + RANGE_VALUE_OFFSET];
+    length = clamp_range_length(start_address, length);
+    found = memchr(vm->memory + start_address, value, length);
+    if(found == NULL){
+        store_address(vm, result_address, 0);
+    } else{
+        store_address(vm, result_address, found - vm->memory);
+    }
+    vm->memory[result_address + RANGE_FOUND_OFFSET] = found != NULL;
+    notify_memory_write(vm, result_address + RANGE_FOUND_OFFSET, 1);
+    primitive_ok(vm);
+}
+
+void primitive_string_length(struct virtual_machine *vm){
+    unsigned int result_address, start_address, length, maximum_length;
+
+    result_address = extract_result_address(vm);
+    start_address = extract_address(vm, result_address + RANGE_ADDRESS_OFFSET);
+    maximum_length = ADDRESSABLE_MEMORY_SIZE - start_address;
+    length = strnlen((char *)vm->memory + start_address, maximum_length);
+    store_address(vm, result_address, length);
+    vm->memory[result_address + RANGE_FOUND_OFFSET] = length < maximum_length;
+    notify_memory_write(vm, result_address + RANGE_FOUND_OFFSET, 1);
+    primitive_ok(vm);
+}
+
+void primitive_poll_stream(struct virtual_machine *vm){
+    unsigned int result_address;
+    struct pollfd stream;
+    FILE *file_stream;
+    WORD stream_id;
+
+    result_address = extract_result_address(vm);
+    stream_id = vm->memory[result_address];
+    file_stream = get_file_stream(vm, stream_id);
+    if(file_stream == NULL){
+        log_debug("   Attempt to poll non allocated stream with id=%d.", stream_id);
+        primitive_fail(vm);
+        return;
+    }
+    stream.fd = fileno(file_stream);
+    stream.events = POLLIN | POLLOUT;
+    stream.revents = 0;
+    if(poll(&stream, 1, 0) < 0){
+        primitive_fail(vm);
+        return;
+    }
+    vm->memory[result_address] = PRIMITIVE_STREAM_NOT_READY;
+    // End of file, errors and data read ahead do not block either.
+    if(stream.revents & (POLLIN | POLLHUP | POLLERR) || has_buffered_input(file_stream)){
+        vm->memory[result_address] |= PRIMITIVE_STREAM_READABLE;
+    }
+    if(stream.revents & (POLLOUT | POLLERR)){
+        vm->memory[result_address] |= PRIMITIVE_STREAM_WRITABLE;
+    }
+    notify_memory_write(vm, result_address, 1);
     primitive_ok(vm);
 }
 
 void primitive_extended(struct virtual_machine *vm){
-    //TODO
-    primitive_fail(vm);
+    unsigned int result_address, id;
+    struct extended_primitive_entry *entry;
+
+    result_address = extract_result_address(vm);
+    id = vm->memory[result_address] << WORD_SIZE | vm->memory[result_address+1];
+    entry = &extended_primitives[id];
+    if(entry->function == NULL){
+        log_error("No extended primitive registered with id %u.", id);
+        primitive_fail(vm);
+        return;
+    }
+    primitive_ok(vm);
+    entry->function(vm, entry->user_data);
+}
+
+int vm_register_primitive(unsigned int id, extended_primitive function, void *user_data){
+    if(id >= PRIMITIVE_EXTENDED_IDS_COUNT){
+        return VM_PRIMITIVE_REGISTRATION_FAILED;
+    }
+    extended_primitives[id].function = function;
+    extended_primitives[id].user_data = user_data;
+    return VM_OK;
+}
+
+int load_primitive_plugin(char *filename){
+    void *library;
+    primitive_plugin_entry_point entry_point;
+
+    library = dlopen(filename, RTLD_NOW | RTLD_LOCAL);
+    if(library == NULL){
+        log_error("Failed to load plugin %s: %s", filename, dlerror());
+        return VM_PRIMITIVE_REGISTRATION_FAILED;
+    }
+    // The cast is the way POSIX documents to get a function from dlsym.
+    *(void **)&entry_point = dlsym(library, PRIMITIVE_PLUGIN_ENTRY_POINT);
+    if(entry_point == NULL){
+        log_error("Plugin %s has no " PRIMITIVE_PLUGIN_ENTRY_POINT " function.", filename);
+        dlclose(library);
+        return VM_PRIMITIVE_REGISTRATION_FAILED;
+    }
+    if(entry_point() != VM_OK){
+        log_error("Plugin %s failed to register its primitives.", filename);
+        // Primitives it registered before failing may still point into it.
+        return VM_PRIMITIVE_REGISTRATION_FAILED;
+    }
+    // Never closed: its primitives stay registered.
+    return VM_OK;
+}
+
+int get_blocking_input_descriptor(struct virtual_machine *vm){
+    struct pollfd input;
+    FILE *input_stream;
+    int descriptor;
+
+    descriptor = get_async_completion_descriptor(vm);
+    if(descriptor != -1){
+        return descriptor;
+    }
+    if(!is_primitive_ready(vm) || is_replaying_io(vm)
+        || (get_primitive_call_id(vm) != PRIMITIVE_ID_GET_CHAR
+            && get_primitive_call_id(vm) != PRIMITIVE_ID_READ_BLOCK
+            && get_primitive_call_id(vm) != PRIMITIVE_ID_READ_UNTIL)){
+        return -1;
+    }
+    input_stream = get_file_stream(vm, vm->memory[extract_result_address(vm)]);
+    if(input_stream == NULL){
+        // The primitive fails right away, also on ids past the stream slots.
+        return -1;
+    }
+    if(has_buffered_input(input_stream)){
+        // A previous read left data in the stream: fgetc returns it.
+        return -1;
+    }
+    input.fd = fileno(input_stream);
+    input.events = POLLIN;
+    if(poll(&input, 1, 0) != 0){
+        // Data, end of file or error: fgetc returns immediately.
+        return -1;
+    }
+    return input.fd;
 }
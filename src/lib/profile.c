@@ -0,0 +1,272 @@
+#include "profile.h"
+#include "vm.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef ENABLE_LOGGING
+#include "log.h"
+#else
+#include "nolog.h"
+#endif
+
+/**
+ * An instruction address and its executions, to sort them.
+ */
+struct profile_entry{
+    unsigned int address;
+    unsigned long long count;
+};
+
+/* Helpers. ------------------------------------------------------------------*/
+static inline unsigned int hash_edge(unsigned int pc_address, unsigned int jump_address){
+    return (pc_address * 2654435761u) ^ (jump_address * 40503u);
+}
+
+/**
+ * Returns the slot of the edge from pc_address to jump_address in edges,
+ * a free one if it is not there.
+ */
+static struct profile_edge *find_edge(struct profile_edge *edges, unsigned int capacity,
+    unsigned int pc_address, unsigned int jump_address){
+    unsigned int slot;
+
+    slot = hash_edge(pc_address, jump_address) & (capacity - 1);
+    while(edges[slot].count != 0
+        && (edges[slot].pc_address != pc_address || edges[slot].jump_address != jump_address)){
+        slot = (slot + 1) & (capacity - 1);
+    }
+    return &edges[slot];
+}
+
+/**
+ * Doubles the capacity of the edges table.
+ */
+static int grow_edges(struct profile *profile){
+    struct profile_edge *edges;
+    unsigned int capacity;
+
+    capacity = profile->edges_capacity * 2;
+    edges = (struct profile_edge *)calloc(capacity, sizeof(struct profile_edge));
+    if(edges == NULL){
+        return VM_ALLOCATION_FAILED;
+    }
+    for(unsigned int i = 0; i < profile->edges_capacity; i++){
+        if(profile->edges[i].count != 0){
+            *find_edge(edges, capacity, profile->edges[i].pc_address,
+                profile->edges[i].jump_address) = profile->edges[i];
+        }
+    }
+    free(profile->edges);
+    profile->edges = edges;
+    profile->edges_capacity = capacity;
+    return VM_OK;
+}
+
+/**
+ * Returns the counter of the instruction at address, allocating its page if
+ * needed, NULL if it could not be allocated.
+ */
+static inline unsigned long long *get_counter(struct profile *profile, unsigned int address){
+    unsigned long long **page = &profile->pages[address / PROFILE_PAGE_SIZE];
+
+    if(*page == NULL){
+        *page = (unsigned long long *)calloc(PROFILE_PAGE_SIZE, sizeof(unsigned long long));
+        if(*page == NULL){
+            return NULL;
+        }
+    }
+    return &(*page)[address % PROFILE_PAGE_SIZE];
+}
+
+/**
+ * Adds an execution of the edge from pc_address to jump_address.
+ */
+static int count_edge(struct profile *profile, unsigned int pc_address, unsigned int jump_address){
+    struct profile_edge *edge;
+
+    edge = find_edge(profile->edges, profile->edges_capacity, pc_address, jump_address);
+    if(edge->count == 0){
+        if(2 * (profile->edges_count + 1) > profile->edges_capacity){
+            if(grow_edges(profile) != VM_OK){
+                return VM_ALLOCATION_FAILED;
+            }
+            edge = find_edge(profile->edges, profile->edges_capacity, pc_address, jump_address);
+        }
+        edge->pc_address = pc_address;
+        edge->jump_address = jump_address;
+        profile->edges_count++;
+    }
+    edge->count++;
+    return VM_OK;
+}
+
+/**
+ * Orders by decreasing count, then by increasing address.
+ */
+static int compare_entries(const void *first, const void *second){
+    const struct profile_entry *a = (const struct profile_entry *)first;
+    const struct profile_entry *b = (const struct profile_entry *)second;
+
+    if(a->count != b->count){
+        return a->count > b->count ? -1 : 1;
+    }
+    return a->address < b->address ? -1 : a->address > b->address;
+}
+
+static int compare_edges(const void *first, const void *second){
+    const struct profile_edge *a = (const struct profile_edge *)first;
+    const struct profile_edge *b = (const struct profile_edge *)second;
+
+    if(a->count != b->count){
+        return a->count > b->count ? -1 : 1;
+    }
+    if(a->pc_address != b->pc_address){
+        return a->pc_address < b->pc_address ? -1 : 1;
+    }
+    return a->jump_address < b->jump_address ? -1 : a->jump_address > b->jump_address;
+}
+
+/**
+ * Returns the executed instruction addresses sorted with compare_entries,
+ * NULL if they could not be allocated. Their number is stored in count.
+ */
+static struct profile_entry *sort_entries(struct profile *profile, unsigned int *count){
+    struct profile_entry *entries;
+
+    // Each edge starts at an executed address, and each executed address has
+    // an edge: there are at most as many addresses as edges.
+    entries = (struct profile_entry *)malloc((profile->edges_count + 1) * sizeof(struct profile_entry));
+    if(entries == NULL){
+        return NULL;
+    }
+    *count = 0;
+    for(unsigned int page = 0; page < PROFILE_PAGES_COUNT; page++){
+        if(profile->pages[page] == NULL){
+            continue;
+        }
+        for(unsigned int i = 0; i < PROFILE_PAGE_SIZE; i++){
+            if(profile->pages[page][i] != 0){
+                entries[*count].address = page * PROFILE_PAGE_SIZE + i;
+                entries[*count].count = profile->pages[page][i];
+                (*count)++;
+            }
+        }
+    }
+    qsort(entries, *count, sizeof(struct profile_entry), compare_entries);
+    return entries;
+}
+
+/* Implementation. -----------------------------------------------------------*/
+int new_profile(struct profile **profile){
+    *profile = (struct profile *)calloc(1, sizeof(struct profile));
+    if(*profile == NULL){
+        return VM_ALLOCATION_FAILED;
+    }
+    (*profile)->edges_capacity = PROFILE_EDGES_INITIAL_CAPACITY;
+    (*profile)->edges = (struct profile_edge *)calloc(PROFILE_EDGES_INITIAL_CAPACITY, sizeof(struct profile_edge));
+    if((*profile)->edges == NULL){
+        free(*profile);
+        *profile = NULL;
+        return VM_ALLOCATION_FAILED;
+    }
+    return VM_OK;
+}
+
+void free_profile(struct profile *profile){
+    for(unsigned int page = 0; page < PROFILE_PAGES_COUNT; page++){
+        free(profile->pages[page]);
+    }
+    free(profile->edges);
+    free(profile);
+}
+
+int run_profile(struct virtual_machine *vm, struct profile *profile){
+    unsigned long long *counter;
+    unsigned int pc_address;
+
+    // execute_instruction runs the primitive made ready by the previous
+    // instruction before the next one, as run does.
+    while(vm->status == VIRTUAL_MACHINE_RUN){
+        pc_address = get_pc_address(vm);
+        counter = get_counter(profile, pc_address);
+        if(counter == NULL){
+            log_error("Failed to allocate profile counters.");
+            return VM_ALLOCATION_FAILED;
+        }
+        execute_instruction(vm);
+        (*counter)++;
+        profile->instructions++;
+        if(count_edge(profile, pc_address, get_pc_address(vm)) != VM_OK){
+            log_error("Failed to allocate profile edges.");
+            return VM_ALLOCATION_FAILED;
+        }
+    }
+    return VM_OK;
+}
+
+unsigned long long get_profile_count(struct profile *profile, unsigned int address){
+    unsigned long long *page = profile->pages[(address / PROFILE_PAGE_SIZE) % PROFILE_PAGES_COUNT];
+
+    return page == NULL ? 0 : page[address % PROFILE_PAGE_SIZE];
+}
+
+unsigned long long get_profile_edge_count(struct profile *profile, unsigned int pc_address, unsigned int jump_address){
+    return find_edge(profile->edges, profile->edges_capacity, pc_address, jump_address)->count;
+}
+
+int write_profile(struct profile *profile, char *filename){
+    struct profile_entry *entries;
+    struct profile_edge *edges;
+    unsigned int entries_count, edges_count;
+    FILE *file;
+    int result;
+
+    entries = sort_entries(profile, &entries_count);
+    edges = (struct profile_edge *)malloc((profile->edges_count + 1) * sizeof(struct profile_edge));
+    file = fopen(filename, "w");
+    result = VM_IMAGE_LOAD_FAILED;
+    if(entries != NULL && edges != NULL && file != NULL){
+        edges_count = 0;
+        for(unsigned int i = 0; i < profile->edges_capacity; i++){
+            if(profile->edges[i].count != 0){
+                edges[edges_count++] = profile->edges[i];
+            }
+        }
+        qsort(edges, edges_count, sizeof(struct profile_edge), compare_edges);
+
+        fprintf(file, "# jolly profile\n");
+        fprintf(file, "instructions %llu\n", profile->instructions);
+        for(unsigned int i = 0; i < entries_count; i++){
+            fprintf(file, "pc 0x%06X %llu\n", entries[i].address, entries[i].count);
+        }
+        for(unsigned int i = 0; i < edges_count; i++){
+            fprintf(file, "edge 0x%06X 0x%06X %llu\n", edges[i].pc_address,
+                edges[i].jump_address, edges[i].count);
+        }
+        result = ferror(file) ? VM_IMAGE_LOAD_FAILED : VM_OK;
+    }
+    if(file != NULL && fclose(file) != 0){
+        result = VM_IMAGE_LOAD_FAILED;
+    }
+    free(entries);
+    free(edges);
+    return result;
+}
+
+void print_profile_report(struct profile *profile, FILE *stream, unsigned int count){
+    struct profile_entry *entries;
+    unsigned int entries_count;
+
+    entries = sort_entries(profile, &entries_count);
+    if(entries == NULL){
+        return;
+    }
+    fprintf(stream, "Profile: %llu instructions, %u addresses, %u edges\n",
+        profile->instructions, entries_count, profile->edges_count);
+    for(unsigned int i = 0; i < entries_count && i < count; i++){
+        fprintf(stream, "  0x%06X %12llu %6.2f%%\n", entries[i].address, entries[i].count,
+            100.0 * entries[i].count / profile->instructions);
+    }
+    free(entries);
+}
@@ -0,0 +1,122 @@
+#include "run_until.h"
+#include "vm.h"
+#include "history.h"
+
+#include <stdlib.h>
+
+#define RUN_UNTIL_BITMAP_SIZE ((MAX_MEMORY_SIZE + 7) / 8)
+
+/* Helpers. ------------------------------------------------------------------*/
+static inline int is_bit_set(unsigned char *bitmap, unsigned int address){
+    return bitmap[address >> 3] & (1 << (address & 7));
+}
+
+/**
+ * Sets or clears the bits of the length addresses starting at address in
+ * *bitmap, allocating it first when bits are set.
+ */
+static int update_bitmap(unsigned char **bitmap, unsigned int address, unsigned int length, int set){
+    if(address >= MAX_MEMORY_SIZE || length > MAX_MEMORY_SIZE - address){
+        return VM_INVALID_MEMORY;
+    }
+    if(*bitmap == NULL){
+        if(!set){
+            return VM_OK;
+        }
+        *bitmap = (unsigned char *)calloc(RUN_UNTIL_BITMAP_SIZE, 1);
+        if(*bitmap == NULL){
+            return VM_ALLOCATION_FAILED;
+        }
+    }
+    for(unsigned int i = address; i < address + length; i++){
+        if(set){
+            (*bitmap)[i >> 3] |= 1 << (i & 7);
+        } else{
+            (*bitmap)[i >> 3] &= ~(1 << (i & 7));
+        }
+    }
+    return VM_OK;
+}
+
+static unsigned int extract_to_address(WORD *instruction){
+    return instruction[TO_ADDRESS_HIGH_OFFSET] << DOUBLE_WORD_SIZE
+        | instruction[TO_ADDRESS_MIDDLE_OFFSET] << WORD_SIZE
+        | instruction[TO_ADDRESS_LOW_OFFSET];
+}
+
+/* Implementation. -----------------------------------------------------------*/
+int new_run_conditions(struct run_conditions **conditions){
+    *conditions = (struct run_conditions *)malloc(sizeof(struct run_conditions));
+    if(*conditions == NULL){
+        return VM_ALLOCATION_FAILED;
+    }
+    (*conditions)->breakpoints = NULL;
+    (*conditions)->watched = NULL;
+    (*conditions)->primitive_id = RUN_UNTIL_NO_PRIMITIVE;
+    (*conditions)->max_instructions = RUN_FOR_UNLIMITED;
+    return VM_OK;
+}
+
+void free_run_conditions(struct run_conditions *conditions){
+    if(conditions == NULL){
+        return;
+    }
+    free(conditions->breakpoints);
+    free(conditions->watched);
+    free(conditions);
+}
+
+int add_breakpoint(struct run_conditions *conditions, unsigned int address){
+    return update_bitmap(&conditions->breakpoints, address, 1, 1);
+}
+
+int remove_breakpoint(struct run_conditions *conditions, unsigned int address){
+    return update_bitmap(&conditions->breakpoints, address, 1, 0);
+}
+
+int add_write_watch(struct run_conditions *conditions, unsigned int address, unsigned int length){
+    return update_bitmap(&conditions->watched, address, length, 1);
+}
+
+int remove_write_watch(struct run_conditions *conditions, unsigned int address, unsigned int length){
+    return update_bitmap(&conditions->watched, address, length, 0);
+}
+
+enum run_until_status run_until(struct virtual_machine *vm, struct run_conditions *conditions){
+    unsigned char *breakpoints = conditions->breakpoints;
+    unsigned char *watched = conditions->watched;
+    int primitive_id = conditions->primitive_id;
+    unsigned long long executed;
+    unsigned int pc_address;
+
+    for(executed = 0; ; executed++){
+        if(vm->status != VIRTUAL_MACHINE_RUN){
+            return RUN_UNTIL_STOPPED;
+        }
+        if(vm->interrupt_requested){
+            vm->interrupt_requested = 0;
+            return RUN_UNTIL_INTERRUPTED;
+        }
+        pc_address = vm->pc - vm->memory;
+        if(breakpoints != NULL && is_bit_set(breakpoints, pc_address)){
+            return RUN_UNTIL_BREAKPOINT;
+        }
+        if(primitive_id != RUN_UNTIL_NO_PRIMITIVE && is_primitive_ready(vm)
+            && (primitive_id == RUN_UNTIL_ANY_PRIMITIVE
+                || (unsigned int)primitive_id == get_primitive_call_id(vm))){
+            return RUN_UNTIL_PRIMITIVE;
+        }
+        if(watched != NULL && is_bit_set(watched, extract_to_address(vm->pc))){
+            return RUN_UNTIL_WATCHPOINT;
+        }
+        if(conditions->max_instructions != RUN_FOR_UNLIMITED
+            && executed == conditions->max_instructions){
+            return RUN_UNTIL_LIMIT_REACHED;
+        }
+        if(vm->history != NULL){
+            execute_recorded_instructions(vm, 1);
+        } else{
+            execute_instruction(vm);
+        }
+    }
+}
@@ -0,0 +1,423 @@
+#include "scheduler.h"
+#include "vm.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#ifdef ENABLE_LOGGING
+#include "log.h"
+#else
+#include "nolog.h"
+#endif
+
+// Initial capacity of the deques and of the parked VMs array.
+#define SCHEDULER_INITIAL_CAPACITY 16
+
+/* Deques. -------------------------------------------------------------------*/
+static void initialize_deque(struct scheduler_deque *deque){
+    deque->vms = NULL;
+    deque->head = 0;
+    deque->count = 0;
+    deque->capacity = 0;
+    pthread_mutex_init(&deque->lock, NULL);
+}
+
+static void finalize_deque(struct scheduler_deque *deque){
+    free(deque->vms);
+    pthread_mutex_destroy(&deque->lock);
+}
+
+static int push_back(struct scheduler_deque *deque, struct virtual_machine *vm){
+    pthread_mutex_lock(&deque->lock);
+    if(deque->count == deque->capacity){
+        unsigned int capacity = deque->capacity ? 2 * deque->capacity : SCHEDULER_INITIAL_CAPACITY;
+        struct virtual_machine **vms = (struct virtual_machine **)malloc(capacity * sizeof(struct virtual_machine *));
+        if(vms == NULL){
+            pthread_mutex_unlock(&deque->lock);
+            return VM_MEMORY_ALLOCATION_FAILED;
+        }
+        // Unwraps the circular buffer.
+        for(unsigned int i = 0; i < deque->count; i++){
+            vms[i] = deque->vms[(deque->head + i) % deque->capacity];
+        }
+        free(deque->vms);
+        deque->vms = vms;
+        deque->head = 0;
+        deque->capacity = capacity;
+    }
+    deque->vms[(deque->head + deque->count) % deque->capacity] = vm;
+    deque->count++;
+    pthread_mutex_unlock(&deque->lock);
+    return VM_OK;
+}
+
+static struct virtual_machine *pop_front(struct scheduler_deque *deque){
+    struct virtual_machine *vm;
+
+    pthread_mutex_lock(&deque->lock);
+    vm = NULL;
+    if(deque->count > 0){
+        vm = deque->vms[deque->head];
+        deque->head = (deque->head + 1) % deque->capacity;
+        deque->count--;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return vm;
+}
+
+static struct virtual_machine *pop_back(struct scheduler_deque *deque){
+    struct virtual_machine *vm;
+
+    pthread_mutex_lock(&deque->lock);
+    vm = NULL;
+    if(deque->count > 0){
+        deque->count--;
+        vm = deque->vms[(deque->head + deque->count) % deque->capacity];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return vm;
+}
+
+/* Workers. ------------------------------------------------------------------*/
+static void wake_poller(struct scheduler *scheduler){
+    char byte = 0;
+
+    // The pipe is non-blocking: when it is full, the poller is awake anyway.
+    if(write(scheduler->wakeup_pipe[1], &byte, 1) < 0){
+        log_debug("Wakeup pipe full.");
+    }
+}
+
+/**
+ * Puts vm at the back of the deque of worker.
+ */
+static int queue_vm(struct scheduler_worker *worker, struct virtual_machine *vm){
+    struct scheduler *scheduler = worker->scheduler;
+    int result;
+
+    // Pushed and counted at once, so that the count is never below the
+    // number of VMs another worker can take.
+    pthread_mutex_lock(&scheduler->lock);
+    result = push_back(&worker->deque, vm);
+    if(result == VM_OK){
+        scheduler->queued_count++;
+        if(scheduler->idle_count > 0){
+            pthread_cond_signal(&scheduler->work_available);
+        }
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+    return result;
+}
+
+/**
+ * Puts vm in the deque of the next worker, round-robin.
+ */
+static int distribute_vm(struct scheduler *scheduler, struct virtual_machine *vm){
+    unsigned int index;
+
+    pthread_mutex_lock(&scheduler->lock);
+    index = scheduler->next_worker;
+    scheduler->next_worker = (index + 1) % scheduler->workers_count;
+    pthread_mutex_unlock(&scheduler->lock);
+    return queue_vm(&scheduler->workers[index], vm);
+}
+
+static unsigned int next_random(struct scheduler_worker *worker){
+    // xorshift32
+    worker->random_state ^= worker->random_state << 13;
+    worker->random_state ^= worker->random_state >> 17;
+    worker->random_state ^= worker->random_state << 5;
+    return worker->random_state;
+}
+
+/**
+ * Takes the next VM to run from the deque of worker, else from the back of
+ * the deque of another worker.
+ */
+static struct virtual_machine *take_vm(struct scheduler_worker *worker){
+    struct scheduler *scheduler = worker->scheduler;
+    struct virtual_machine *vm;
+    unsigned int first;
+
+    vm = pop_front(&worker->deque);
+    if(vm == NULL){
+        first = next_random(worker) % scheduler->workers_count;
+        for(unsigned int i = 0; i < scheduler->workers_count && vm == NULL; i++){
+            unsigned int victim = (first + i) % scheduler->workers_count;
+            if(victim != worker->index){
+                vm = pop_back(&scheduler->workers[victim].deque);
+            }
+        }
+        if(vm != NULL){
+            worker->steals++;
+        }
+    }
+    if(vm != NULL){
+        pthread_mutex_lock(&scheduler->lock);
+        scheduler->queued_count--;
+        pthread_mutex_unlock(&scheduler->lock);
+    }
+    return vm;
+}
+
+static int park_vm(struct scheduler *scheduler, struct virtual_machine *vm){
+    int descriptor = get_blocking_input_descriptor(vm);
+
+    pthread_mutex_lock(&scheduler->lock);
+    if(scheduler->parked_count == scheduler->parked_capacity){
+        unsigned int capacity = scheduler->parked_capacity ? 2 * scheduler->parked_capacity : SCHEDULER_INITIAL_CAPACITY;
+        struct scheduler_parked_vm *parked = (struct scheduler_parked_vm *)realloc(
+            scheduler->parked, capacity * sizeof(struct scheduler_parked_vm));
+        if(parked == NULL){
+            pthread_mutex_unlock(&scheduler->lock);
+            return VM_MEMORY_ALLOCATION_FAILED;
+        }
+        scheduler->parked = parked;
+        scheduler->parked_capacity = capacity;
+    }
+    scheduler->parked[scheduler->parked_count].vm = vm;
+    scheduler->parked[scheduler->parked_count].descriptor = descriptor;
+    scheduler->parked_count++;
+    scheduler->parks++;
+    pthread_mutex_unlock(&scheduler->lock);
+    wake_poller(scheduler);
+    return VM_OK;
+}
+
+static void stop_vm(struct scheduler *scheduler, struct virtual_machine *vm){
+    // Called before the VM stops counting as active, so that the callback
+    // can add VMs before the workers leave.
+    if(scheduler->on_stop != NULL){
+        scheduler->on_stop(scheduler, vm, scheduler->user_data);
+    }
+    pthread_mutex_lock(&scheduler->lock);
+    scheduler->stopped_vms++;
+    scheduler->active_count--;
+    if(scheduler->active_count == 0){
+        pthread_cond_broadcast(&scheduler->work_available);
+        wake_poller(scheduler);
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+}
+
+static void *run_worker(void *argument){
+    struct scheduler_worker *worker = (struct scheduler_worker *)argument;
+    struct scheduler *scheduler = worker->scheduler;
+    struct virtual_machine *vm;
+    int done;
+
+    while(1){
+        vm = take_vm(worker);
+        if(vm == NULL){
+            pthread_mutex_lock(&scheduler->lock);
+            while(scheduler->queued_count == 0 && scheduler->active_count > 0){
+                scheduler->idle_count++;
+                pthread_cond_wait(&scheduler->work_available, &scheduler->lock);
+                scheduler->idle_count--;
+            }
+            done = scheduler->active_count == 0;
+            pthread_mutex_unlock(&scheduler->lock);
+            if(done){
+                break;
+            }
+            continue;
+        }
+
+        worker->slices++;
+        switch(run_for(vm, scheduler->quantum, RUN_FOR_UNLIMITED)){
+            case(RUN_FOR_STOPPED):
+                stop_vm(scheduler, vm);
+                break;
+            case(RUN_FOR_BLOCKED):
+                if(park_vm(scheduler, vm) != VM_OK){
+                    // Let the VM block this worker rather than lose it.
+                    log_error("Not enough memory to park a VM, running it to the end.");
+                    run(vm);
+                    stop_vm(scheduler, vm);
+                }
+                break;
+            default:
+                if(queue_vm(worker, vm) != VM_OK){
+                    log_error("Not enough memory to queue a VM, running it to the end.");
+                    run(vm);
+                    stop_vm(scheduler, vm);
+                }
+                break;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Waits for the input of the parked VMs and queues them again, until every
+ * VM stopped.
+ */
+static void poll_parked_vms(struct scheduler *scheduler){
+    struct pollfd *descriptors;
+    unsigned int capacity, count;
+    char buffer[64];
+
+    descriptors = NULL;
+    capacity = 0;
+    while(1){
+        pthread_mutex_lock(&scheduler->lock);
+        if(scheduler->active_count == 0){
+            pthread_mutex_unlock(&scheduler->lock);
+            break;
+        }
+        count = scheduler->parked_count;
+        if(count + 1 > capacity){
+            struct pollfd *grown = (struct pollfd *)realloc(descriptors, (count + 1) * sizeof(struct pollfd));
+            if(grown == NULL){
+                // Only poll the VMs that fit, the others wait for the next
+                // round.
+                count = capacity > 0 ? capacity - 1 : 0;
+            } else{
+                descriptors = grown;
+                capacity = count + 1;
+            }
+        }
+        for(unsigned int i = 0; i < count; i++){
+            descriptors[i + 1].fd = scheduler->parked[i].descriptor;
+            descriptors[i + 1].events = POLLIN;
+            descriptors[i + 1].revents = 0;
+        }
+        pthread_mutex_unlock(&scheduler->lock);
+        if(descriptors == NULL){
+            // Nothing to poll but the pipe.
+            struct pollfd wakeup = { scheduler->wakeup_pipe[0], POLLIN, 0 };
+            poll(&wakeup, 1, -1);
+        } else{
+            descriptors[0].fd = scheduler->wakeup_pipe[0];
+            descriptors[0].events = POLLIN;
+            descriptors[0].revents = 0;
+            poll(descriptors, count + 1, -1);
+        }
+        while(read(scheduler->wakeup_pipe[0], buffer, sizeof(buffer)) > 0);
+
+        // Only this thread removes parked VMs, the first count entries did
+        // not change. Going backwards, the entry moved to i is never one of
+        // the VMs polled this round.
+        for(unsigned int i = count; i-- > 0;){
+            struct virtual_machine *vm;
+            if(descriptors[i + 1].revents == 0){
+                continue;
+            }
+            pthread_mutex_lock(&scheduler->lock);
+            vm = scheduler->parked[i].vm;
+            scheduler->parked[i] = scheduler->parked[--scheduler->parked_count];
+            pthread_mutex_unlock(&scheduler->lock);
+            if(distribute_vm(scheduler, vm) != VM_OK){
+                log_error("Not enough memory to queue a VM, running it to the end.");
+                run(vm);
+                stop_vm(scheduler, vm);
+            }
+        }
+    }
+    free(descriptors);
+}
+
+/* Implementation. -----------------------------------------------------------*/
+int new_scheduler(struct scheduler **scheduler, unsigned int workers_count,
+    unsigned long long quantum, scheduler_stop_callback on_stop, void *user_data){
+    struct scheduler *created;
+
+    *scheduler = NULL;
+    if(workers_count == 0){
+        workers_count = 1;
+    }
+    created = (struct scheduler *)calloc(1, sizeof(struct scheduler));
+    if(created == NULL){
+        return VM_ALLOCATION_FAILED;
+    }
+    created->workers = (struct scheduler_worker *)calloc(workers_count, sizeof(struct scheduler_worker));
+    if(created->workers == NULL){
+        free(created);
+        return VM_ALLOCATION_FAILED;
+    }
+    if(pipe(created->wakeup_pipe) != 0){
+        free(created->workers);
+        free(created);
+        return VM_ALLOCATION_FAILED;
+    }
+    fcntl(created->wakeup_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(created->wakeup_pipe[1], F_SETFL, O_NONBLOCK);
+    pthread_mutex_init(&created->lock, NULL);
+    pthread_cond_init(&created->work_available, NULL);
+    created->workers_count = workers_count;
+    created->quantum = quantum;
+    created->on_stop = on_stop;
+    created->user_data = user_data;
+    for(unsigned int i = 0; i < workers_count; i++){
+        created->workers[i].scheduler = created;
+        created->workers[i].index = i;
+        created->workers[i].random_state = 2463534242u + i;
+        initialize_deque(&created->workers[i].deque);
+    }
+    *scheduler = created;
+    return VM_OK;
+}
+
+void free_scheduler(struct scheduler *scheduler){
+    for(unsigned int i = 0; i < scheduler->workers_count; i++){
+        finalize_deque(&scheduler->workers[i].deque);
+    }
+    free(scheduler->workers);
+    free(scheduler->parked);
+    close(scheduler->wakeup_pipe[0]);
+    close(scheduler->wakeup_pipe[1]);
+    pthread_cond_destroy(&scheduler->work_available);
+    pthread_mutex_destroy(&scheduler->lock);
+    free(scheduler);
+}
+
+int scheduler_add(struct scheduler *scheduler, struct virtual_machine *vm){
+    vm->park_on_input = 1;
+    pthread_mutex_lock(&scheduler->lock);
+    scheduler->active_count++;
+    pthread_mutex_unlock(&scheduler->lock);
+    if(distribute_vm(scheduler, vm) != VM_OK){
+        pthread_mutex_lock(&scheduler->lock);
+        scheduler->active_count--;
+        pthread_mutex_unlock(&scheduler->lock);
+        return VM_MEMORY_ALLOCATION_FAILED;
+    }
+    return VM_OK;
+}
+
+int scheduler_run(struct scheduler *scheduler){
+    unsigned int started;
+
+    started = 0;
+    for(unsigned int i = 0; i < scheduler->workers_count; i++){
+        if(pthread_create(&scheduler->workers[i].thread, NULL, run_worker, &scheduler->workers[i]) != 0){
+            log_error("Failed to start worker %d.", i);
+            break;
+        }
+        started++;
+    }
+    if(started == 0){
+        return VM_ALLOCATION_FAILED;
+    }
+    // The VMs queued for workers that did not start are stolen by the others.
+    poll_parked_vms(scheduler);
+    for(unsigned int i = 0; i < started; i++){
+        pthread_join(scheduler->workers[i].thread, NULL);
+    }
+    return VM_OK;
+}
+
+void get_scheduler_statistics(struct scheduler *scheduler, struct scheduler_statistics *statistics){
+    memset(statistics, 0, sizeof(struct scheduler_statistics));
+    for(unsigned int i = 0; i < scheduler->workers_count; i++){
+        statistics->slices += scheduler->workers[i].slices;
+        statistics->steals += scheduler->workers[i].steals;
+    }
+    pthread_mutex_lock(&scheduler->lock);
+    statistics->parks = scheduler->parks;
+    statistics->stopped_vms = scheduler->stopped_vms;
+    pthread_mutex_unlock(&scheduler->lock);
+}
@@ -0,0 +1,136 @@
+#include "stats.h"
+#include "vm.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static char *primitive_names[] = {
+    "nope",
+    "fail",
+    "put_char",
+    "get_char",
+    "stop_vm",
+    "open_file",
+    "close_file",
+    "is_file_open",
+    "argc",
+    "argv_size_at_index",
+    "argv",
+    "add_addresses",
+    "substract_addresses",
+    "decrement_address",
+    "increment_address",
+    "checkpoint",
+    "read_block",
+    "write_block",
+    "read_until",
+    "copy_memory",
+    "fill_memory",
+    "compare_memory",
+    "find_byte",
+    "string_length",
+    "arithmetic",
+    "arithmetic_array",
+    "poll_stream"
+};
+
+#define PRIMITIVE_NAMES_COUNT (sizeof(primitive_names) / sizeof(char *))
+
+/* Implementation. -----------------------------------------------------------*/
+int enable_vm_stats(struct virtual_machine *vm){
+    if(vm->stats != NULL){
+        return VM_OK;
+    }
+    vm->stats = (struct vm_stats *)calloc(1, sizeof(struct vm_stats));
+    if(vm->stats == NULL){
+        return VM_ALLOCATION_FAILED;
+    }
+    return VM_OK;
+}
+
+void get_vm_stats(struct virtual_machine *vm, struct vm_stats *stats){
+    if(vm->stats != NULL){
+        memcpy(stats, vm->stats, sizeof(struct vm_stats));
+    } else{
+        memset(stats, 0, sizeof(struct vm_stats));
+    }
+    stats->instructions = vm->retired_instructions;
+    stats->primitives = vm->retired_primitives;
+}
+
+void add_vm_stats(struct vm_stats *total, struct virtual_machine *vm){
+    struct vm_stats stats;
+
+    get_vm_stats(vm, &stats);
+    total->instructions += stats.instructions;
+    total->primitives += stats.primitives;
+    for(unsigned int i = 0; i < VM_STATS_PRIMITIVES_COUNT; i++){
+        struct primitive_stats *sum = &total->primitives_by_id[i];
+        struct primitive_stats *added = &stats.primitives_by_id[i];
+        sum->calls += added->calls;
+        sum->failures += added->failures;
+        sum->total_time += added->total_time;
+        if(added->max_time > sum->max_time){
+            sum->max_time = added->max_time;
+        }
+        sum->bytes += added->bytes;
+    }
+}
+
+void count_primitive_call(struct virtual_machine *vm, unsigned int primitive_id,
+    unsigned long long time, int failed){
+    struct primitive_stats *stats = &vm->stats->primitives_by_id[primitive_id % VM_STATS_PRIMITIVES_COUNT];
+
+    stats->calls++;
+    stats->failures += failed ? 1 : 0;
+    stats->total_time += time;
+    if(time > stats->max_time){
+        stats->max_time = time;
+    }
+}
+
+void count_primitive_bytes(struct virtual_machine *vm, unsigned long long bytes){
+    if(vm->stats != NULL){
+        vm->stats->primitives_by_id[get_primitive_call_id(vm) % VM_STATS_PRIMITIVES_COUNT].bytes += bytes;
+    }
+}
+
+char *get_primitive_name(unsigned int primitive_id){
+    if(primitive_id < PRIMITIVE_NAMES_COUNT){
+        return primitive_names[primitive_id];
+    }
+    if(primitive_id == PRIMITIVE_ID_EXTENDED){
+        return "extended";
+    }
+    return NULL;
+}
+
+void print_vm_stats(struct vm_stats *stats, FILE *stream, unsigned long long elapsed_time){
+    unsigned long long primitives_time;
+
+    primitives_time = 0;
+    for(unsigned int i = 0; i < VM_STATS_PRIMITIVES_COUNT; i++){
+        primitives_time += stats->primitives_by_id[i].total_time;
+    }
+    fprintf(stream, "Statistics:\n");
+    fprintf(stream, "  %llu instructions, %llu primitives taking %llu us",
+        stats->instructions, stats->primitives, primitives_time / 1000);
+    if(elapsed_time != 0){
+        fprintf(stream, " (%.2f%% of %llu us)", 100.0 * primitives_time / elapsed_time,
+            elapsed_time / 1000);
+    }
+    fprintf(stream, "\n");
+    fprintf(stream, "  %3s %-20s %12s %10s %12s %10s %12s\n",
+        "id", "primitive", "calls", "failures", "total us", "max us", "bytes");
+    for(unsigned int i = 0; i < VM_STATS_PRIMITIVES_COUNT; i++){
+        struct primitive_stats *primitive = &stats->primitives_by_id[i];
+        char *name;
+        if(primitive->calls == 0){
+            continue;
+        }
+        name = get_primitive_name(i);
+        fprintf(stream, "  %3u %-20s %12llu %10llu %12llu %10llu %12llu\n",
+            i, name != NULL ? name : "?", primitive->calls, primitive->failures,
+            primitive->total_time / 1000, primitive->max_time / 1000, primitive->bytes);
+    }
+}
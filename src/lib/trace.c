@@ -0,0 +1,580 @@
+#include "trace.h"
+#include "vm.h"
+#include "primitives.h"
+#ifdef ENABLE_JIT
+#include "jit.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef ENABLE_LOGGING
+#include "log.h"
+#else
+#include "nolog.h"
+#endif
+
+// Initial number of slots of the program counters table, a power of 2.
+#define TRACE_ENTRIES_INITIAL_CAPACITY 1024
+
+// Size (in bytes) of a bitmap with one bit per memory byte.
+#define TRACE_BITMAP_SIZE (MAX_MEMORY_SIZE / 8 + 1)
+
+/**
+ * What the trace engine knows about a program counter.
+ */
+struct trace_entry{
+    unsigned int pc_address;
+    unsigned int hits;
+    struct trace *trace;
+    int used;
+    int uncompilable;
+};
+
+struct trace_cache{
+    /**
+     * Open addressing hash table of program counters.
+     */
+    struct trace_entry *entries;
+    unsigned int capacity;
+    unsigned int count;
+    /**
+     * One bit per memory byte: set when the byte was ever written by the
+     * program. Instruction operands made of such bytes are read when traces
+     * are executed rather than when they are compiled.
+     */
+    unsigned char *written;
+    /**
+     * One bit per memory byte: set when a compiled trace relies on the value
+     * of the byte.
+     */
+    unsigned char *protected;
+    /**
+     * Addresses of the instructions whose bytes are protected.
+     */
+    unsigned int *protected_pcs;
+    unsigned int protected_pcs_count;
+    unsigned int protected_pcs_capacity;
+    /**
+     * Set when a trace wrote a protected byte: compiled traces are dropped
+     * as soon as the running one returns.
+     */
+    int drop_pending;
+    struct trace_statistics statistics;
+};
+
+/* Helpers. ------------------------------------------------------------------*/
+static inline unsigned int decode_address(WORD *bytes){
+    return bytes[0] << DOUBLE_WORD_SIZE
+        | bytes[1] << WORD_SIZE
+        | bytes[2];
+}
+
+static inline int test_bit(unsigned char *bitmap, unsigned int address){
+    return bitmap[address >> 3] & (1 << (address & 7));
+}
+
+static inline void set_bit(unsigned char *bitmap, unsigned int address){
+    bitmap[address >> 3] |= 1 << (address & 7);
+}
+
+static inline void clear_bit(unsigned char *bitmap, unsigned int address){
+    bitmap[address >> 3] &= ~(1 << (address & 7));
+}
+
+/**
+ * Returns TRUE if one of the length bytes starting at address is set.
+ */
+static int test_bits(unsigned char *bitmap, unsigned int address, unsigned int length){
+    for(unsigned int i = 0; i < length; i++){
+        if(test_bit(bitmap, address + i)){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static inline unsigned int hash_pc(unsigned int pc_address, unsigned int capacity){
+    return (unsigned int)((pc_address * 0x9E3779B97F4A7C15ull) >> 40) & (capacity - 1);
+}
+
+/* Cache management. ---------------------------------------------------------*/
+static int allocate_trace_cache(struct virtual_machine *vm){
+    struct trace_cache *cache;
+
+    cache = (struct trace_cache *)calloc(1, sizeof(struct trace_cache));
+    if(cache == NULL){
+        return VM_MEMORY_ALLOCATION_FAILED;
+    }
+    vm->traces = cache;
+    cache->capacity = TRACE_ENTRIES_INITIAL_CAPACITY;
+    cache->entries = (struct trace_entry *)calloc(cache->capacity, sizeof(struct trace_entry));
+    cache->written = (unsigned char *)calloc(1, TRACE_BITMAP_SIZE);
+    cache->protected = (unsigned char *)calloc(1, TRACE_BITMAP_SIZE);
+    if(cache->entries == NULL || cache->written == NULL || cache->protected == NULL){
+        flush_traces(vm);
+        return VM_MEMORY_ALLOCATION_FAILED;
+    }
+    return VM_OK;
+}
+
+static void free_trace(struct trace *trace){
+#ifdef ENABLE_JIT
+    jit_free_trace(trace);
+#endif
+    free(trace->moves);
+    free(trace);
+}
+
+/**
+ * Drops every compiled trace, keeping what was learnt about written bytes.
+ */
+static void drop_traces(struct trace_cache *cache){
+    for(unsigned int i = 0; i < cache->capacity; i++){
+        struct trace_entry *entry = &cache->entries[i];
+        if(entry->trace != NULL){
+            free_trace(entry->trace);
+            entry->trace = NULL;
+        }
+        entry->hits = 0;
+        entry->uncompilable = 0;
+    }
+    for(unsigned int i = 0; i < cache->protected_pcs_count; i++){
+        for(unsigned int offset = 0; offset <= JUMP_ADDRESS_LOW_OFFSET; offset++){
+            clear_bit(cache->protected, cache->protected_pcs[i] + offset);
+        }
+    }
+    cache->protected_pcs_count = 0;
+    cache->drop_pending = 0;
+    cache->statistics.flushes++;
+}
+
+void flush_traces(struct virtual_machine *vm){
+    struct trace_cache *cache = vm->traces;
+
+    if(cache == NULL){
+        return;
+    }
+    if(cache->entries != NULL){
+        for(unsigned int i = 0; i < cache->capacity; i++){
+            if(cache->entries[i].trace != NULL){
+                free_trace(cache->entries[i].trace);
+            }
+        }
+    }
+    free(cache->entries);
+    free(cache->written);
+    free(cache->protected);
+    free(cache->protected_pcs);
+    free(cache);
+    vm->traces = NULL;
+}
+
+static int grow_entries(struct trace_cache *cache){
+    struct trace_entry *old_entries = cache->entries;
+    unsigned int old_capacity = cache->capacity;
+    struct trace_entry *entries;
+    unsigned int capacity = old_capacity * 2;
+
+    entries = (struct trace_entry *)calloc(capacity, sizeof(struct trace_entry));
+    if(entries == NULL){
+        return VM_MEMORY_ALLOCATION_FAILED;
+    }
+    for(unsigned int i = 0; i < old_capacity; i++){
+        if(old_entries[i].used){
+            unsigned int slot = hash_pc(old_entries[i].pc_address, capacity);
+            while(entries[slot].used){
+                slot = (slot + 1) & (capacity - 1);
+            }
+            entries[slot] = old_entries[i];
+        }
+    }
+    free(old_entries);
+    cache->entries = entries;
+    cache->capacity = capacity;
+    return VM_OK;
+}
+
+/**
+ * Returns the entry of pc_address, creating it if needed.
+ * Returns NULL if the table could not grow.
+ */
+static struct trace_entry *find_entry(struct trace_cache *cache, unsigned int pc_address){
+    unsigned int slot = hash_pc(pc_address, cache->capacity);
+
+    while(cache->entries[slot].used){
+        if(cache->entries[slot].pc_address == pc_address){
+            return &cache->entries[slot];
+        }
+        slot = (slot + 1) & (cache->capacity - 1);
+    }
+    // Keep the table at most half full.
+    if(2 * (cache->count + 1) > cache->capacity){
+        if(grow_entries(cache) != VM_OK){
+            return NULL;
+        }
+        return find_entry(cache, pc_address);
+    }
+    cache->entries[slot].used = 1;
+    cache->entries[slot].pc_address = pc_address;
+    cache->count++;
+    return &cache->entries[slot];
+}
+
+static int protect_instruction(struct trace_cache *cache, unsigned int pc_address,
+    unsigned int first_offset, unsigned int last_offset){
+    if(cache->protected_pcs_count == cache->protected_pcs_capacity){
+        unsigned int capacity = cache->protected_pcs_capacity ? 2 * cache->protected_pcs_capacity : 256;
+        unsigned int *pcs = (unsigned int *)realloc(cache->protected_pcs, capacity * sizeof(unsigned int));
+        if(pcs == NULL){
+            return VM_MEMORY_ALLOCATION_FAILED;
+        }
+        cache->protected_pcs = pcs;
+        cache->protected_pcs_capacity = capacity;
+    }
+    cache->protected_pcs[cache->protected_pcs_count++] = pc_address;
+    for(unsigned int offset = first_offset; offset <= last_offset; offset++){
+        set_bit(cache->protected, pc_address + offset);
+    }
+    return VM_OK;
+}
+
+/**
+ * Records a write at address done outside of a trace.
+ */
+static inline void record_write(struct trace_cache *cache, unsigned int address){
+    set_bit(cache->written, address);
+    if(test_bit(cache->protected, address)){
+        drop_traces(cache);
+    }
+}
+
+void notify_trace_write(struct virtual_machine *vm, unsigned int address, unsigned int length){
+    if(vm->traces == NULL){
+        return;
+    }
+    unsigned int end, i;
+
+    end = length > MAX_MEMORY_SIZE - address ? MAX_MEMORY_SIZE : address + length;
+    i = address;
+    while(i < end){
+        if((i & 7) == 0 && end - i >= 8){
+            // 8 bytes, a whole byte of the bitmaps, at once.
+            vm->traces->written[i >> 3] = 0xFF;
+            if(vm->traces->protected[i >> 3] != 0){
+                drop_traces(vm->traces);
+            }
+            i += 8;
+        } else{
+            record_write(vm->traces, i);
+            i++;
+        }
+    }
+}
+
+void get_trace_statistics(struct virtual_machine *vm, struct trace_statistics *statistics){
+    if(vm->traces == NULL){
+        memset(statistics, 0, sizeof(struct trace_statistics));
+        return;
+    }
+    *statistics = vm->traces->statistics;
+}
+
+/* Compilation. --------------------------------------------------------------*/
+/**
+ * Returns TRUE if address is one of the bytes of the instructions in pcs.
+ */
+static int is_in_chain(unsigned int *pcs, unsigned int count, unsigned int address){
+    for(unsigned int i = 0; i < count; i++){
+        if(address >= pcs[i] && address <= pcs[i] + JUMP_ADDRESS_LOW_OFFSET){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Follows the chain of instructions starting at pc_address and compiles it.
+ * Returns NULL if no instruction could be compiled.
+ */
+static struct trace *compile_trace(struct virtual_machine *vm, struct trace_cache *cache, unsigned int pc_address){
+    struct trace_move moves[TRACE_MAX_LENGTH];
+    unsigned int pcs[TRACE_MAX_LENGTH];
+    unsigned int count, pc, from_address, to_address, next_address;
+    int dynamic_exit, conflict;
+    struct trace *trace;
+    WORD *memory = vm->memory;
+
+    count = 0;
+    pc = pc_address;
+    next_address = pc_address;
+    dynamic_exit = 0;
+    conflict = 0;
+    while(count < TRACE_MAX_LENGTH){
+        // Back to an instruction of the chain: the next trace starts there.
+        if(is_in_chain(pcs, count, pc)){
+            break;
+        }
+        if(!test_bits(cache->written, pc, TO_ADDRESS_LOW_OFFSET + 1)){
+            from_address = decode_address(memory + pc + FROM_ADDRESS_HIGH_OFFSET);
+            to_address = decode_address(memory + pc + TO_ADDRESS_HIGH_OFFSET);
+            // The move would rewrite an instruction of the chain compiled
+            // with its current bytes: leave it to the next trace.
+            if(is_in_chain(pcs, count, to_address)){
+                break;
+            }
+            // The instruction rewrites itself: it is decoded when executed,
+            // and its jump address read after its move.
+            if(to_address >= pc && to_address <= pc + JUMP_ADDRESS_LOW_OFFSET){
+                moves[count].from_address = pc;
+                moves[count].to_address = TRACE_DYNAMIC_MOVE;
+                pcs[count++] = pc;
+                dynamic_exit = 1;
+                break;
+            }
+            moves[count].from_address = from_address;
+            moves[count].to_address = to_address;
+            // Instructions reading this byte will now decode it at
+            // execution time.
+            set_bit(cache->written, to_address);
+            conflict |= test_bit(cache->protected, to_address) != 0;
+        } else{
+            to_address = MAX_MEMORY_SIZE;
+            moves[count].from_address = pc;
+            moves[count].to_address = TRACE_DYNAMIC_MOVE;
+        }
+        pcs[count++] = pc;
+        if(test_bits(cache->written, pc + JUMP_ADDRESS_HIGH_OFFSET, 3)){
+            dynamic_exit = 1;
+            break;
+        }
+        next_address = decode_address(memory + pc + JUMP_ADDRESS_HIGH_OFFSET);
+        // Let the engine execute the primitive before the next instruction.
+        if(to_address == PRIMITIVE_IS_READY_ADDRESS){
+            break;
+        }
+        pc = next_address;
+    }
+    if(count == 0){
+        return NULL;
+    }
+
+    trace = (struct trace *)malloc(sizeof(struct trace));
+    if(trace == NULL){
+        return NULL;
+    }
+    trace->moves = (struct trace_move *)malloc(count * sizeof(struct trace_move));
+    if(trace->moves == NULL){
+        free(trace);
+        return NULL;
+    }
+    memcpy(trace->moves, moves, count * sizeof(struct trace_move));
+    trace->pc_address = pc_address;
+    trace->moves_count = count;
+    trace->last_address = pcs[count - 1];
+    trace->next_address = next_address;
+    trace->dynamic_exit = dynamic_exit;
+    trace->next_trace = NULL;
+    trace->native_code = NULL;
+    trace->native_code_size = 0;
+
+    // The trace writes bytes other traces rely on.
+    if(conflict){
+        drop_traces(cache);
+    }
+    for(unsigned int i = 0; i < count; i++){
+        unsigned int first, last;
+        first = moves[i].to_address & TRACE_DYNAMIC_MOVE
+            ? JUMP_ADDRESS_HIGH_OFFSET : FROM_ADDRESS_HIGH_OFFSET;
+        last = (dynamic_exit && i == count - 1)
+            ? TO_ADDRESS_LOW_OFFSET : JUMP_ADDRESS_LOW_OFFSET;
+        if(first <= last && protect_instruction(cache, pcs[i], first, last) != VM_OK){
+            free_trace(trace);
+            drop_traces(cache);
+            return NULL;
+        }
+    }
+    cache->statistics.traces_compiled++;
+#ifdef ENABLE_JIT
+    // Without native code, the moves are still executed by execute_trace.
+    if(jit_compile_trace(trace) == VM_OK){
+        cache->statistics.native_traces_compiled++;
+    }
+#endif
+    log_debug("Compiled trace at 0x%06X: %d instructions.", pc_address, count);
+    return trace;
+}
+
+/* Execution. ----------------------------------------------------------------*/
+/**
+ * Ends trace after its dynamic move at pc_address wrote to_address, when the
+ * rest of the trace may be stale or a primitive must run before the next
+ * instruction. Returns the address of the next instruction to execute.
+ */
+static inline unsigned int exit_trace(struct trace_cache *cache, WORD *memory,
+    unsigned int pc_address, unsigned int to_address){
+    if(test_bit(cache->protected, to_address)){
+        set_bit(cache->written, to_address);
+        cache->drop_pending = 1;
+    }
+    return decode_address(memory + pc_address + JUMP_ADDRESS_HIGH_OFFSET);
+}
+
+/**
+ * Returns the address of the instruction following trace, once all its moves
+ * were executed.
+ */
+static inline unsigned int trace_exit_address(WORD *memory, struct trace *trace){
+    if(trace->dynamic_exit){
+        return decode_address(memory + trace->last_address + JUMP_ADDRESS_HIGH_OFFSET);
+    }
+    return trace->next_address;
+}
+
+/**
+ * Executes trace and returns the address of the next instruction to execute.
+ */
+static inline unsigned int execute_trace(struct trace_cache *cache, WORD *memory, struct trace *trace){
+    struct trace_move *move = trace->moves;
+    struct trace_move *end = trace->moves + trace->moves_count;
+
+#ifdef ENABLE_JIT
+    if(trace->native_code != NULL){
+        unsigned long long result;
+        unsigned int executed_count;
+        result = ((jit_function)trace->native_code)(memory, cache->protected);
+        executed_count = result & ~JIT_EARLY_EXIT;
+        cache->statistics.traced_instructions += executed_count;
+        if(result & JIT_EARLY_EXIT){
+            return exit_trace(cache, memory,
+                trace->moves[executed_count - 1].from_address, result >> 32);
+        }
+        return trace_exit_address(memory, trace);
+    }
+#endif
+    for(; move < end; move++){
+        unsigned int pc, to_address;
+        if(!(move->to_address & TRACE_DYNAMIC_MOVE)){
+            memory[move->to_address] = memory[move->from_address];
+            continue;
+        }
+        pc = move->from_address;
+        to_address = decode_address(memory + pc + TO_ADDRESS_HIGH_OFFSET);
+        memory[to_address] = memory[decode_address(memory + pc + FROM_ADDRESS_HIGH_OFFSET)];
+        if(test_bit(cache->protected, to_address)
+            || to_address == PRIMITIVE_IS_READY_ADDRESS){
+            cache->statistics.traced_instructions += move - trace->moves + 1;
+            return exit_trace(cache, memory, pc, to_address);
+        }
+    }
+    cache->statistics.traced_instructions += trace->moves_count;
+    return trace_exit_address(memory, trace);
+}
+
+/**
+ * Executes the instruction at pc_address without trace and returns the
+ * address of the next instruction to execute.
+ */
+static unsigned int interpret_instruction(struct trace_cache *cache, WORD *memory, unsigned int pc_address){
+    unsigned int to_address;
+
+    to_address = decode_address(memory + pc_address + TO_ADDRESS_HIGH_OFFSET);
+    memory[to_address] = memory[decode_address(memory + pc_address + FROM_ADDRESS_HIGH_OFFSET)];
+    record_write(cache, to_address);
+    cache->statistics.interpreted_instructions++;
+    return decode_address(memory + pc_address + JUMP_ADDRESS_HIGH_OFFSET);
+}
+
+static inline unsigned long long get_executed_instructions(struct trace_cache *cache){
+    return cache->statistics.traced_instructions + cache->statistics.interpreted_instructions;
+}
+
+int run_trace(struct virtual_machine *vm){
+    struct trace_cache *cache;
+    struct trace_entry *entry;
+    struct trace *trace, *previous;
+    unsigned int pc_address;
+    unsigned long long retired_base;
+    WORD *memory;
+
+    if(vm->status != VIRTUAL_MACHINE_RUN){
+        return VM_OK;
+    }
+    // Writes done by traces are not reported to the decoded-instruction
+    // cache of the other engines.
+    flush_decoded_instructions(vm);
+    if(vm->traces == NULL && allocate_trace_cache(vm) != VM_OK){
+        return VM_MEMORY_ALLOCATION_FAILED;
+    }
+    cache = vm->traces;
+    memory = vm->memory;
+    pc_address = vm->pc - vm->memory;
+    previous = NULL;
+    // The retired instructions are counted by the statistics of the cache.
+    retired_base = get_executed_instructions(cache);
+
+    while(1){
+        if(memory[PRIMITIVE_IS_READY_ADDRESS] == PRIMITIVE_READY){
+            vm->pc = memory + pc_address;
+            vm->retired_instructions += get_executed_instructions(cache) - retired_base;
+            execute_primitive(vm);
+            // The primitive may have replaced the memory or the cache.
+            if(vm->traces == NULL && allocate_trace_cache(vm) != VM_OK){
+                return VM_MEMORY_ALLOCATION_FAILED;
+            }
+            cache = vm->traces;
+            retired_base = get_executed_instructions(cache);
+            memory = vm->memory;
+            pc_address = vm->pc - vm->memory;
+            previous = NULL;
+            if(vm->status != VIRTUAL_MACHINE_RUN){
+                // As with run, the instruction following the primitive that
+                // stopped the VM is still executed.
+                pc_address = interpret_instruction(cache, memory, pc_address);
+                break;
+            }
+        }
+
+        // Fast path: the previous trace already knows the next one.
+        if(previous != NULL && previous->next_trace != NULL
+            && previous->next_trace->pc_address == pc_address){
+            trace = previous->next_trace;
+        } else{
+            entry = find_entry(cache, pc_address);
+            if(entry == NULL){
+                pc_address = interpret_instruction(cache, memory, pc_address);
+                previous = NULL;
+                continue;
+            }
+            if(entry->trace == NULL){
+                if(entry->uncompilable || ++entry->hits < TRACE_HOT_THRESHOLD){
+                    pc_address = interpret_instruction(cache, memory, pc_address);
+                    previous = NULL;
+                    continue;
+                }
+                entry->trace = compile_trace(vm, cache, pc_address);
+                // Compiling may have dropped the previous trace.
+                previous = NULL;
+                if(entry->trace == NULL){
+                    entry->uncompilable = 1;
+                    pc_address = interpret_instruction(cache, memory, pc_address);
+                    continue;
+                }
+            }
+            trace = entry->trace;
+            if(previous != NULL){
+                previous->next_trace = trace;
+            }
+        }
+
+        pc_address = execute_trace(cache, memory, trace);
+        previous = trace;
+        if(cache->drop_pending){
+            drop_traces(cache);
+            previous = NULL;
+        }
+    }
+    vm->pc = memory + pc_address;
+    vm->retired_instructions += get_executed_instructions(cache) - retired_base;
+    return VM_OK;
+}
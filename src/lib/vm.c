@@ -1,8 +1,21 @@
 #include "vm.h"
 #include "primitives.h"
+#include "trace.h"
+#include "idioms.h"
+#include "image_format.h"
+#include "async_io.h"
+#include "stats.h"
+#include "history.h"
+#include "io_log.h"
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #ifdef ENABLE_LOGGING
 #include "log.h"
@@ -10,6 +23,9 @@
 #include "nolog.h"
 #endif
 
+// Number of words of decoded_owners notify_memory_write checks at once.
+#define NOTIFY_SKIPPED_WORDS 8
+
 /* Debug functions declarations. ---------------------------------------------*/
 void print_pc_address(struct virtual_machine *vm);
 void print_value_at_address(struct virtual_machine *vm, unsigned int address);
@@ -58,32 +74,100 @@ int new_vm(struct virtual_machine **vm){
     }
     (*vm)->status = VIRTUAL_MACHINE_RUN;
     (*vm)->memory = NULL_MEMORY;
+    (*vm)->memory_origin = VM_MEMORY_ALLOCATED;
+    (*vm)->image_descriptor = -1;
+    (*vm)->checkpoints_count = 0;
+    (*vm)->decoded_pages = NULL;
+    (*vm)->decoded_owners = NULL;
+    (*vm)->idioms = NULL;
+    (*vm)->traces = NULL;
+    (*vm)->retired_instructions = 0;
+    (*vm)->retired_primitives = 0;
+    (*vm)->interrupt_requested = 0;
+    (*vm)->park_on_input = 0;
+    (*vm)->async_io = 0;
+    (*vm)->async_request = NULL;
+    (*vm)->stats = NULL;
+    (*vm)->history = NULL;
+    (*vm)->io_log = NULL;
     return VM_OK;
 }
 
+/**
+ * Forgets the image the memory of vm was mapped from.
+ */
+static void close_image_descriptor(struct virtual_machine *vm){
+    if(vm->image_descriptor != -1){
+        close(vm->image_descriptor);
+        vm->image_descriptor = -1;
+    }
+    // The memory does not hold the last checkpoint anymore.
+    vm->checkpoints_count = 0;
+}
+
+/**
+ * Maps MAX_MEMORY_SIZE bytes of anonymous memory, which read as zero and only
+ * cost memory once written.
+ * Returns NULL_MEMORY if the mapping failed.
+ */
+static WORD *map_empty_memory(void){
+    void *memory;
+
+    memory = mmap(NULL, MAX_MEMORY_SIZE, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(memory == MAP_FAILED){
+        return NULL_MEMORY;
+    }
+    return (WORD *)memory;
+}
+
+/**
+ * Frees the memory of vm according to its origin.
+ */
+static void release_memory(struct virtual_machine *vm){
+    if(vm->memory != NULL_MEMORY){
+        if(vm->memory_origin == VM_MEMORY_MAPPED){
+            munmap(vm->memory, MAX_MEMORY_SIZE);
+        } else{
+            free(vm->memory);
+        }
+    }
+    close_image_descriptor(vm);
+}
+
 int set_memory(struct virtual_machine* vm, WORD *memory){
     if(memory == NULL_MEMORY){
         return VM_INVALID_MEMORY;
     }
     vm->memory = memory;
+    vm->memory_origin = VM_MEMORY_ALLOCATED;
+    close_image_descriptor(vm);
+    flush_decoded_instructions(vm);
+    flush_traces(vm);
     load_pc(vm);
     return VM_OK;
 }
 
 int create_empty_memory(struct virtual_machine* vm){
     WORD *memory;
-    memory = (WORD *)calloc(1, MAX_MEMORY_SIZE);
+    memory = map_empty_memory();
     if(memory == NULL_MEMORY){
         return VM_MEMORY_ALLOCATION_FAILED;
     }
-    return set_memory(vm, memory);
+    set_memory(vm, memory);
+    vm->memory_origin = VM_MEMORY_MAPPED;
+    return VM_OK;
 }
 
 void free_vm(struct virtual_machine *vm){
+    finalize_async_io(vm);
     finalize_primitives_data(vm);
-    if(vm->memory != NULL_MEMORY){
-        free(vm->memory);
-    }
+    flush_decoded_instructions(vm);
+    flush_traces(vm);
+    release_memory(vm);
+    free(vm->stats);
+    disable_vm_history(vm);
+    close_io_log(vm);
     free(vm);
 }
 
@@ -113,11 +197,10 @@ int serialize_pc(struct virtual_machine *vm){
     return VM_OK;
 }
 
-int execute_primitive(struct virtual_machine *vm){
-    WORD primitive_id;
-    // Retrieve the id of the primitive to be executed.
-    primitive_id = get_primitive_call_id(vm);
-    log_debug("Execute primitive %d", primitive_id);
+/**
+ * Executes the primitive primitive_id.
+ */
+static void call_primitive(struct virtual_machine *vm, WORD primitive_id){
     switch(primitive_id){
         case(PRIMITIVE_ID_NOPE):
             primitive_nop(vm);
@@ -164,14 +247,76 @@ int execute_primitive(struct virtual_machine *vm){
         case(PRIMITIVE_ID_INCREMENT_ADDRESS):
             primitive_increment_address(vm);
             break;
+        case(PRIMITIVE_ID_CHECKPOINT):
+            primitive_checkpoint(vm);
+            break;
+        case(PRIMITIVE_ID_READ_BLOCK):
+            primitive_read_block(vm);
+            break;
+        case(PRIMITIVE_ID_WRITE_BLOCK):
+            primitive_write_block(vm);
+            break;
+        case(PRIMITIVE_ID_READ_UNTIL):
+            primitive_read_until(vm);
+            break;
+        case(PRIMITIVE_ID_COPY_MEMORY):
+            primitive_copy_memory(vm);
+            break;
+        case(PRIMITIVE_ID_FILL_MEMORY):
+            primitive_fill_memory(vm);
+            break;
+        case(PRIMITIVE_ID_COMPARE_MEMORY):
+            primitive_compare_memory(vm);
+            break;
+        case(PRIMITIVE_ID_FIND_BYTE):
+            primitive_find_byte(vm);
+            break;
+        case(PRIMITIVE_ID_STRING_LENGTH):
+            primitive_string_length(vm);
+            break;
+        case(PRIMITIVE_ID_ARITHMETIC):
+            primitive_arithmetic(vm);
+            break;
+        case(PRIMITIVE_ID_ARITHMETIC_ARRAY):
+            primitive_arithmetic_array(vm);
+            break;
+        case(PRIMITIVE_ID_POLL_STREAM):
+            primitive_poll_stream(vm);
+            break;
+        case(PRIMITIVE_ID_EXTENDED):
+            primitive_extended(vm);
+            break;
         default: // In case no primitive is associated to an id, the call fails.
             primitive_fail(vm);
             break;
     }
+}
+
+int execute_primitive(struct virtual_machine *vm){
+    WORD primitive_id;
+    unsigned long long start_time;
+    // Retrieve the id of the primitive to be executed.
+    primitive_id = get_primitive_call_id(vm);
+    start_time = vm->stats != NULL ? get_monotonic_time() : 0;
+    log_debug("Execute primitive %d", primitive_id);
+    vm->retired_primitives++;
+    if(vm->io_log == NULL || !is_logged_primitive(primitive_id)){
+        call_primitive(vm, primitive_id);
+    } else if(vm->io_log->mode == IO_LOG_REPLAY){
+        replay_logged_primitive(vm, primitive_id);
+    } else{
+        begin_logged_primitive(vm);
+        call_primitive(vm, primitive_id);
+        end_logged_primitive(vm, primitive_id);
+    }
 
     if (did_primitive_failed(vm)){
         log_error("Primitive %d failed.\n", primitive_id);
     }
+    if(vm->stats != NULL){
+        count_primitive_call(vm, primitive_id, get_monotonic_time() - start_time,
+            did_primitive_failed(vm));
+    }
 
     // Set the value of primitive to execute to PRIMITIVE_ID_NOPE
     // like that, if the code sets activate the primitive handler by accident,
@@ -180,10 +325,283 @@ int execute_primitive(struct virtual_machine *vm){
 
     // Set back the primitive trigger to PRIMITIVE_NOT_READY.
     set_primitive_is_ready(vm, PRIMITIVE_NOT_READY);
+
+    // The primitive and the lines above wrote in the VM-reserved bytes.
+    notify_memory_write(vm, PC_HIGH_ADDRESS, PRIMITIVE_RESULT_POINTER_LOW_ADDRESS+1);
     return 0;
 }
 
-int execute_instruction(struct virtual_machine *vm){
+/* Decoded-instruction cache. -----------------------------------------------*/
+// Page of invalid entries shared by the pages of the caches nothing was
+// decoded in. Never written: fetch_decoded_instruction allocates a page
+// before decoding into it.
+static struct decoded_instruction empty_decoded_page[DECODED_PAGE_SIZE];
+
+static int allocate_decoded_instructions(struct virtual_machine *vm){
+    vm->decoded_pages = (struct decoded_instruction **)malloc(
+        DECODED_PAGES_COUNT * sizeof(struct decoded_instruction *));
+    vm->decoded_owners = (unsigned char *)calloc(1, MAX_MEMORY_SIZE);
+    if(vm->decoded_pages == NULL || vm->decoded_owners == NULL){
+        free(vm->decoded_pages);
+        free(vm->decoded_owners);
+        vm->decoded_pages = NULL;
+        vm->decoded_owners = NULL;
+        return VM_MEMORY_ALLOCATION_FAILED;
+    }
+    for(unsigned int page = 0; page < DECODED_PAGES_COUNT; page++){
+        vm->decoded_pages[page] = empty_decoded_page;
+    }
+    // Writing the primitive trigger takes the same path as writing code, so
+    // that engines notice it without checking it before every instruction.
+    vm->decoded_owners[PRIMITIVE_IS_READY_ADDRESS] = DECODED_OWNER_CONTROL;
+    return VM_OK;
+}
+
+/**
+ * Returns the entry of the cache for the instruction at pc_address, in the
+ * shared empty page if its page was not allocated.
+ */
+static inline struct decoded_instruction *find_decoded_instruction(struct virtual_machine *vm, unsigned int pc_address){
+    return vm->decoded_pages[pc_address / DECODED_PAGE_SIZE] + pc_address % DECODED_PAGE_SIZE;
+}
+
+struct decoded_instruction *get_decoded_instruction(struct virtual_machine *vm, unsigned int pc_address){
+    struct decoded_instruction **page;
+
+    page = &vm->decoded_pages[(pc_address / DECODED_PAGE_SIZE) % DECODED_PAGES_COUNT];
+    if(*page == empty_decoded_page){
+        // Zeroed entries are DECODED_INVALID.
+        *page = (struct decoded_instruction *)calloc(DECODED_PAGE_SIZE, sizeof(struct decoded_instruction));
+        if(*page == NULL){
+            *page = empty_decoded_page;
+            return NULL;
+        }
+    }
+    return *page + pc_address % DECODED_PAGE_SIZE;
+}
+
+void flush_decoded_instructions(struct virtual_machine *vm){
+    flush_idioms(vm);
+    // The tables are lazily reallocated, which gives back zeroed pages
+    // instead of clearing them.
+    if(vm->decoded_pages != NULL){
+        for(unsigned int page = 0; page < DECODED_PAGES_COUNT; page++){
+            if(vm->decoded_pages[page] != empty_decoded_page){
+                free(vm->decoded_pages[page]);
+            }
+        }
+    }
+    free(vm->decoded_pages);
+    free(vm->decoded_owners);
+    vm->decoded_pages = NULL;
+    vm->decoded_owners = NULL;
+}
+
+/**
+ * Drops every cached instruction that covers the byte at address.
+ */
+static void drop_decoded_instructions_at(struct virtual_machine *vm, unsigned int address){
+    struct decoded_instruction *instruction;
+    unsigned int owner, first;
+
+    owner = vm->decoded_owners[address];
+    if(owner == DECODED_OWNER_IDIOM){
+        // Gives the bytes of the idioms back to the instructions.
+        drop_idioms_at(vm, address);
+        owner = vm->decoded_owners[address];
+    }
+    // Owned bytes belong to decoded instructions, whose pages are allocated.
+    if(owner != DECODED_OWNER_SHARED && owner != DECODED_OWNER_CONTROL){
+        find_decoded_instruction(vm, address - (owner - 1))->valid = DECODED_INVALID;
+        return;
+    }
+    // Overlapping instructions: any instruction starting at most 8 bytes
+    // before address covers it. They may start in the previous page.
+    first = address >= JUMP_ADDRESS_LOW_OFFSET ? address - JUMP_ADDRESS_LOW_OFFSET : 0;
+    for(unsigned int pc = first; pc <= address && pc < DECODED_INSTRUCTIONS_SIZE; pc++){
+        instruction = find_decoded_instruction(vm, pc);
+        if(instruction->valid != DECODED_INVALID){
+            instruction->valid = DECODED_INVALID;
+        }
+    }
+}
+
+void notify_memory_write(struct virtual_machine *vm, unsigned int address, unsigned int length){
+    unsigned long long owners[NOTIFY_SKIPPED_WORDS], any_owner;
+    unsigned int end;
+
+    if(vm->history != NULL){
+        record_memory_write(vm, address, length);
+    }
+    if(vm->io_log != NULL && vm->io_log->capturing){
+        add_logged_write(vm, address, length);
+    }
+    notify_trace_write(vm, address, length);
+    if(vm->decoded_owners == NULL){
+        return;
+    }
+    end = length > MAX_MEMORY_SIZE - address ? MAX_MEMORY_SIZE : address + length;
+    for(unsigned int i = address; i < end; i++){
+        // Most bytes written by primitives hold data: skip the bytes no
+        // instruction owns several words at a time.
+        if(end - i >= sizeof(owners)){
+            memcpy(owners, vm->decoded_owners + i, sizeof(owners));
+            any_owner = 0;
+            for(unsigned int word = 0; word < NOTIFY_SKIPPED_WORDS; word++){
+                any_owner |= owners[word];
+            }
+            if(any_owner == DECODED_OWNER_NONE){
+                i += sizeof(owners) - 1;
+                continue;
+            }
+        }
+        if(vm->decoded_owners[i] != DECODED_OWNER_NONE){
+            drop_decoded_instructions_at(vm, i);
+        }
+    }
+}
+
+static inline unsigned int decode_address(WORD *bytes){
+    return bytes[0] << DOUBLE_WORD_SIZE
+        | bytes[1] << WORD_SIZE
+        | bytes[2];
+}
+
+/**
+ * Records that the 9 bytes of the instruction at pc_address are cached, so
+ * that writing any of them drops the entry.
+ */
+static void own_instruction_bytes(struct virtual_machine *vm, unsigned int pc_address){
+    unsigned char *owners;
+
+    owners = vm->decoded_owners + pc_address;
+    for(unsigned int offset = 0; offset <= JUMP_ADDRESS_LOW_OFFSET; offset++){
+        if(owners[offset] == DECODED_OWNER_NONE || owners[offset] == offset + 1){
+            owners[offset] = offset + 1;
+        } else if(owners[offset] <= JUMP_ADDRESS_LOW_OFFSET + 1){
+            // Owned by another instruction. Other values are kept, they
+            // already make writes drop every instruction covering the byte.
+            owners[offset] = DECODED_OWNER_SHARED;
+        }
+    }
+}
+
+/**
+ * Returns the decoded instruction located at pc_address, decoding it and
+ * caching it first if needed.
+ * Returns NULL if the page of the cache holding it could not be allocated.
+ */
+static inline struct decoded_instruction *fetch_decoded_instruction(struct virtual_machine *vm, unsigned int pc_address){
+    struct decoded_instruction *page, *instruction;
+    WORD *pc;
+
+    page = vm->decoded_pages[pc_address / DECODED_PAGE_SIZE];
+    instruction = page + pc_address % DECODED_PAGE_SIZE;
+    if(instruction->valid == DECODED_VALID){
+        return instruction;
+    }
+    if(page == empty_decoded_page){
+        instruction = get_decoded_instruction(vm, pc_address);
+        if(instruction == NULL){
+            return NULL;
+        }
+    }
+    pc = vm->memory + pc_address;
+    instruction->from_address = decode_address(pc + FROM_ADDRESS_HIGH_OFFSET);
+    instruction->to_address = decode_address(pc + TO_ADDRESS_HIGH_OFFSET);
+    instruction->jump_address = decode_address(pc + JUMP_ADDRESS_HIGH_OFFSET);
+    instruction->valid = DECODED_VALID;
+    // Allocates the page of the next instruction, which usually runs next.
+    get_decoded_instruction(vm, instruction->jump_address);
+    instruction->jump_instruction = find_decoded_instruction(vm, instruction->jump_address);
+    // Bytes of an instruction decoded before stay owned when it is dropped.
+    if(vm->decoded_owners[pc_address] != FROM_ADDRESS_HIGH_OFFSET + 1
+        || vm->decoded_owners[pc_address + JUMP_ADDRESS_LOW_OFFSET] != JUMP_ADDRESS_LOW_OFFSET + 1){
+        own_instruction_bytes(vm, pc_address);
+    }
+    return instruction;
+}
+
+/**
+ * Returns TRUE if the write of an instruction at to_address made a primitive
+ * ready.
+ */
+static inline int triggers_primitive(WORD *memory, unsigned int to_address){
+    return to_address == PRIMITIVE_IS_READY_ADDRESS
+        && memory[PRIMITIVE_IS_READY_ADDRESS] == PRIMITIVE_READY;
+}
+
+/**
+ * Executes the instruction pointed by the program counter without caching
+ * it, when the page of the cache holding it could not be allocated, or as a
+ * single move where an idiom starts. The cached instructions it writes into
+ * are dropped all the same.
+ * Returns TRUE if the instruction made a primitive ready.
+ */
+static int execute_undecoded_instruction(struct virtual_machine *vm){
+    unsigned int to_address;
+    int pending;
+
+    to_address = decode_address(vm->pc + TO_ADDRESS_HIGH_OFFSET);
+    vm->memory[to_address] = vm->memory[decode_address(vm->pc + FROM_ADDRESS_HIGH_OFFSET)];
+    pending = 0;
+    if(vm->decoded_owners[to_address] != DECODED_OWNER_NONE){
+        pending = triggers_primitive(vm->memory, to_address);
+        drop_decoded_instructions_at(vm, to_address);
+    }
+    vm->pc = vm->memory + decode_address(vm->pc + JUMP_ADDRESS_HIGH_OFFSET);
+    return pending;
+}
+
+/**
+ * Executes the instruction pointed by the program counter using the
+ * decoded-instruction cache, which must be allocated. *next is the entry of
+ * this instruction, or NULL to look it up, and is set to the entry of the
+ * next one, so that loops do not look up the page of each instruction.
+ * Returns TRUE if the instruction made a primitive ready, which must then run
+ * before the next instruction.
+ */
+static inline int execute_decoded_instruction(struct virtual_machine *vm, struct decoded_instruction **next){
+    struct decoded_instruction *instruction;
+    unsigned int to_address, jump_address;
+    int pending;
+
+    instruction = *next;
+    if(instruction == NULL || instruction->valid != DECODED_VALID){
+        instruction = fetch_decoded_instruction(vm, vm->pc - vm->memory);
+        if(instruction == NULL){
+            *next = NULL;
+            return execute_undecoded_instruction(vm);
+        }
+    }
+    *next = instruction->jump_instruction;
+    to_address = instruction->to_address;
+    jump_address = instruction->jump_address;
+
+    // Copy word pointed by from_address to to_address.
+    vm->memory[to_address] = vm->memory[instruction->from_address];
+
+    // Self-modifying code: drop the cached instructions the copy wrote into.
+    // If this one was dropped, its jump address is read again from memory,
+    // as it is done when the instruction is not cached.
+    // The primitive trigger is owned as well, so this is also where a write
+    // making a primitive ready is noticed.
+    pending = 0;
+    if(vm->decoded_owners[to_address] != DECODED_OWNER_NONE){
+        pending = triggers_primitive(vm->memory, to_address);
+        drop_decoded_instructions_at(vm, to_address);
+        if(instruction->valid != DECODED_VALID){
+            jump_address = decode_address(vm->pc + JUMP_ADDRESS_HIGH_OFFSET);
+            *next = NULL;
+        }
+    }
+
+    // Update program counter according to jump_address (absolute jump).
+    vm->pc = vm->memory + jump_address;
+    return pending;
+}
+
+static int execute_uncached_instruction(struct virtual_machine *vm){
     unsigned int from_address, to_address, jump_address;
     // Checks if vm needs to execute a primitive before executing an
     // instruction.
@@ -214,34 +632,453 @@ int execute_instruction(struct virtual_machine *vm){
     return VM_OK;
 }
 
+int execute_instruction(struct virtual_machine *vm){
+    struct decoded_instruction *next = NULL;
+
+    // Traces are not told about the writes of this engine.
+    if(vm->traces != NULL){
+        flush_traces(vm);
+    }
+    if(vm->decoded_pages == NULL
+        && allocate_decoded_instructions(vm) != VM_OK){
+        // Not enough memory for the cache, decode on every execution.
+        vm->retired_instructions++;
+        return execute_uncached_instruction(vm);
+    }
+    // The memory may have been written by anything since the previous call.
+    if(is_primitive_ready(vm)){
+        execute_primitive(vm);
+    }
+    execute_decoded_instruction(vm, &next);
+    vm->retired_instructions++;
+    return VM_OK;
+}
+
 int run(struct virtual_machine *vm){
-    while(vm->status == VIRTUAL_MACHINE_RUN){
-        execute_instruction(vm);
+    struct decoded_instruction *next;
+    unsigned long long retired;
+    int pending;
+
+    if(vm->traces != NULL){
+        flush_traces(vm);
+    }
+    if(vm->decoded_pages == NULL
+        && allocate_decoded_instructions(vm) != VM_OK){
+        while(vm->status == VIRTUAL_MACHINE_RUN){
+            execute_uncached_instruction(vm);
+            vm->retired_instructions++;
+        }
+        return VM_OK;
+    }
+    if(vm->status != VIRTUAL_MACHINE_RUN){
+        return VM_OK;
     }
+    pending = is_primitive_ready(vm);
+    retired = 0;
+    next = NULL;
+    while(1){
+        if(pending){
+            execute_primitive(vm);
+            // A primitive may replace the memory or flush the cache.
+            next = NULL;
+            if(vm->decoded_pages == NULL
+                && allocate_decoded_instructions(vm) != VM_OK){
+                vm->retired_instructions += retired;
+                while(vm->status == VIRTUAL_MACHINE_RUN){
+                    execute_uncached_instruction(vm);
+                    vm->retired_instructions++;
+                }
+                return VM_OK;
+            }
+            // Only primitives change the status. As before, the instruction
+            // following the primitive that stopped the VM is still executed.
+            pending = execute_decoded_instruction(vm, &next);
+            retired++;
+            if(vm->status != VIRTUAL_MACHINE_RUN){
+                break;
+            }
+        }
+        // Primitives are ready only after an instruction wrote the trigger.
+        while(!pending){
+            pending = execute_decoded_instruction(vm, &next);
+            retired++;
+        }
+    }
+    vm->retired_instructions += retired;
     return VM_OK;
 }
 
-int load_image(struct virtual_machine *vm, char *filename){
-    long length;
-    FILE * f = fopen (filename, "rb");
-
-    if (f){
-        fseek(f, 0, SEEK_END);
-        length = ftell(f);
-        fseek(f, 0, SEEK_SET);
-        vm->memory = (WORD *)malloc(MAX_MEMORY_SIZE);
-        if (vm->memory)
-        {
-            fread(vm->memory, 1, length, f);
+/**
+ * Executes at most count instructions with the decoded-instruction cache,
+ * running the primitives made ready on the way. pending tells if a primitive
+ * is ready before the first one, and is updated.
+ * Returns earlier, after the instruction following the primitive, when a
+ * primitive stops vm, and before a primitive when vm->park_on_input or
+ * vm->async_io is set, so that run_for checks whether it would block.
+ *
+ * Returns the number of instructions executed.
+ */
+static unsigned long long execute_instructions(struct virtual_machine *vm, unsigned long long count, int *pending){
+    struct decoded_instruction *next;
+    unsigned long long executed;
+
+    executed = 0;
+    next = NULL;
+    if(vm->decoded_pages == NULL
+        && allocate_decoded_instructions(vm) != VM_OK){
+        // The uncached instructions check the trigger themselves.
+        while(executed < count && vm->status == VIRTUAL_MACHINE_RUN){
+            execute_uncached_instruction(vm);
+            executed++;
         }
-        fclose (f);
-    } else{
+        *pending = is_primitive_ready(vm);
+        return executed;
+    }
+    while(executed < count){
+        if(*pending){
+            if((vm->park_on_input || vm->async_io) && executed > 0){
+                return executed;
+            }
+            execute_primitive(vm);
+            *pending = 0;
+            next = NULL;
+            if(vm->decoded_pages == NULL){
+                // The next call allocates the cache again.
+                return executed;
+            }
+            if(vm->status != VIRTUAL_MACHINE_RUN){
+                *pending = execute_decoded_instruction(vm, &next);
+                return executed + 1;
+            }
+        }
+        *pending = execute_decoded_instruction(vm, &next);
+        executed++;
+    }
+    return executed;
+}
+
+enum run_for_status run_for(struct virtual_machine *vm, unsigned long long max_instructions, unsigned long long deadline){
+    enum run_for_status status;
+    unsigned long long executed, count;
+    int pending;
+
+    if(resume_async_primitive(vm) == ASYNC_IO_SUBMITTED){
+        return RUN_FOR_BLOCKED;
+    }
+    if(vm->traces != NULL){
+        flush_traces(vm);
+    }
+    pending = is_primitive_ready(vm);
+    executed = 0;
+    while(1){
+        if(vm->status != VIRTUAL_MACHINE_RUN){
+            status = RUN_FOR_STOPPED;
+            break;
+        }
+        if(vm->interrupt_requested){
+            vm->interrupt_requested = 0;
+            status = RUN_FOR_INTERRUPTED;
+            break;
+        }
+        if(deadline != RUN_FOR_UNLIMITED && get_monotonic_time() >= deadline){
+            status = RUN_FOR_DEADLINE_REACHED;
+            break;
+        }
+        if(pending && vm->async_io && is_async_primitive(vm)
+            && submit_async_primitive(vm) == VM_OK){
+            status = RUN_FOR_BLOCKED;
+            break;
+        }
+        if(pending && vm->park_on_input && get_blocking_input_descriptor(vm) != -1){
+            status = RUN_FOR_BLOCKED;
+            break;
+        }
+        count = RUN_FOR_CHECK_INTERVAL;
+        if(max_instructions != RUN_FOR_UNLIMITED){
+            if(executed == max_instructions){
+                status = RUN_FOR_BUDGET_EXHAUSTED;
+                break;
+            }
+            if(max_instructions - executed < count){
+                count = max_instructions - executed;
+            }
+        }
+        executed += execute_instructions(vm, count, &pending);
+    }
+    vm->retired_instructions += executed;
+    return status;
+}
+
+void vm_interrupt(struct virtual_machine *vm){
+    vm->interrupt_requested = 1;
+}
+
+unsigned long long get_monotonic_time(void){
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * Executes the idiom installed in the decoded instruction: the patch of the
+ * lookup instruction, then the lookup itself.
+ * Returns the address of the instruction following the lookup and sets
+ * pending if the lookup made a primitive ready.
+ */
+static inline unsigned int execute_idiom(struct virtual_machine *vm, struct decoded_instruction *instruction, int *pending){
+    struct idiom *idiom;
+    WORD *memory;
+    unsigned int from_address, jump_address;
+
+    memory = vm->memory;
+    idiom = &vm->idioms->idioms[instruction->jump_address];
+    idiom->hits++;
+
+    memory[instruction->to_address] = memory[instruction->from_address];
+    if(vm->decoded_owners[instruction->to_address] != DECODED_OWNER_NONE){
+        drop_decoded_instructions_at(vm, instruction->to_address);
+    }
+
+    from_address = decode_address(memory + idiom->lookup_address + FROM_ADDRESS_HIGH_OFFSET);
+    jump_address = idiom->jump_address;
+    memory[idiom->to_address] = memory[from_address];
+    if(vm->decoded_owners[idiom->to_address] != DECODED_OWNER_NONE){
+        *pending = triggers_primitive(memory, idiom->to_address);
+        drop_decoded_instructions_at(vm, idiom->to_address);
+        // The lookup may have rewritten its own jump address.
+        if(!idiom->active){
+            jump_address = decode_address(memory + idiom->lookup_address + JUMP_ADDRESS_HIGH_OFFSET);
+        }
+    }
+    return jump_address;
+}
+
+/**
+ * Same as fetch_decoded_instruction, but installs the idiom the instruction
+ * starts, if any: the entry is then a DECODED_IDIOM one.
+ */
+static struct decoded_instruction *fetch_fast_instruction(struct virtual_machine *vm, unsigned int pc_address){
+    struct decoded_instruction *instruction;
+
+    instruction = fetch_decoded_instruction(vm, pc_address);
+    if(instruction != NULL && vm->idioms != NULL){
+        install_idiom_at(vm, pc_address);
+    }
+    return instruction;
+}
+
+/**
+ * Executes the instruction at pc_address of the memory of vm without caching
+ * it, see execute_undecoded_instruction.
+ * Returns the address of the next instruction and sets pending if the
+ * instruction made a primitive ready.
+ */
+static unsigned int execute_undecoded_instruction_at(struct virtual_machine *vm, unsigned int pc_address, int *pending){
+    vm->pc = vm->memory + pc_address;
+    *pending = execute_undecoded_instruction(vm);
+    return vm->pc - vm->memory;
+}
+
+/**
+ * Body of run_fast for one instruction. Expects memory, decoded, owners,
+ * instruction, next, to_address, jump_address, pc_address, pending and
+ * retired locals, next being the entry of the instruction at pc_address.
+ * Sets pending when the instruction makes a primitive ready.
+ */
+#define FAST_EXECUTE_INSTRUCTION() \
+    instruction = next; \
+    retired++; \
+    if(instruction->valid != DECODED_VALID && instruction->valid != DECODED_IDIOM \
+        && (instruction = fetch_fast_instruction(vm, pc_address)) == NULL){ \
+        pc_address = execute_undecoded_instruction_at(vm, pc_address, &pending); \
+        next = decoded[pc_address / DECODED_PAGE_SIZE] + pc_address % DECODED_PAGE_SIZE; \
+    } else if(instruction->valid == DECODED_IDIOM){ \
+        pc_address = execute_idiom(vm, instruction, &pending); \
+        next = decoded[pc_address / DECODED_PAGE_SIZE] + pc_address % DECODED_PAGE_SIZE; \
+        retired++; \
+    } else{ \
+        to_address = instruction->to_address; \
+        jump_address = instruction->jump_address; \
+        next = instruction->jump_instruction; \
+        memory[to_address] = memory[instruction->from_address]; \
+        if(owners[to_address] != DECODED_OWNER_NONE){ \
+            pending = triggers_primitive(memory, to_address); \
+            drop_decoded_instructions_at(vm, to_address); \
+            if(instruction->valid != DECODED_VALID){ \
+                jump_address = decode_address(memory + pc_address + JUMP_ADDRESS_HIGH_OFFSET); \
+                next = decoded[jump_address / DECODED_PAGE_SIZE] + jump_address % DECODED_PAGE_SIZE; \
+            } \
+        } \
+        pc_address = jump_address; \
+    }
+
+int run_fast(struct virtual_machine *vm){
+    WORD *memory;
+    struct decoded_instruction **decoded, *instruction, *next;
+    unsigned char *owners;
+    unsigned int pc_address, to_address, jump_address;
+    unsigned long long retired;
+    int pending;
+
+    if(vm->status != VIRTUAL_MACHINE_RUN){
+        return VM_OK;
+    }
+    if(vm->traces != NULL){
+        flush_traces(vm);
+    }
+    if(vm->decoded_pages == NULL
+        && allocate_decoded_instructions(vm) != VM_OK){
+        return run(vm);
+    }
+    if(vm->idioms == NULL && enable_idioms(vm) != VM_OK){
+        log_error("Not enough memory to store idioms, running without them.");
+    }
+    memory = vm->memory;
+    decoded = vm->decoded_pages;
+    owners = vm->decoded_owners;
+    pc_address = vm->pc - vm->memory;
+    next = decoded[pc_address / DECODED_PAGE_SIZE] + pc_address % DECODED_PAGE_SIZE;
+    pending = memory[PRIMITIVE_IS_READY_ADDRESS] == PRIMITIVE_READY;
+    retired = 0;
+
+#if defined(__GNUC__)
+    // Direct threading: the pending flag, only set when an instruction wrote
+    // the primitive trigger, selects the code to run next without going back
+    // to a loop header.
+    static void *const dispatch_table[] = { &&execute, &&primitive };
+#define FAST_DISPATCH() \
+    goto *dispatch_table[pending]
+
+    FAST_DISPATCH();
+
+execute:
+    FAST_EXECUTE_INSTRUCTION();
+    FAST_DISPATCH();
+
+primitive:
+    vm->pc = memory + pc_address;
+    execute_primitive(vm);
+    pending = 0;
+    // A primitive may replace the memory or flush the cache.
+    if(vm->decoded_pages == NULL
+        && allocate_decoded_instructions(vm) != VM_OK){
+        vm->retired_instructions += retired;
+        return run(vm);
+    }
+    memory = vm->memory;
+    decoded = vm->decoded_pages;
+    owners = vm->decoded_owners;
+    pc_address = vm->pc - vm->memory;
+    next = decoded[pc_address / DECODED_PAGE_SIZE] + pc_address % DECODED_PAGE_SIZE;
+    if(vm->status == VIRTUAL_MACHINE_RUN){
+        goto execute;
+    }
+    // As in run(), the instruction following the primitive that stopped the
+    // VM is still executed, alone even if it starts an idiom.
+    pc_address = execute_undecoded_instruction_at(vm, pc_address, &pending);
+    retired++;
+#undef FAST_DISPATCH
+#else
+    while(1){
+        if(pending){
+            vm->pc = memory + pc_address;
+            execute_primitive(vm);
+            pending = 0;
+            if(vm->decoded_pages == NULL
+                && allocate_decoded_instructions(vm) != VM_OK){
+                vm->retired_instructions += retired;
+                return run(vm);
+            }
+            memory = vm->memory;
+            decoded = vm->decoded_pages;
+            owners = vm->decoded_owners;
+            pc_address = vm->pc - vm->memory;
+            next = decoded[pc_address / DECODED_PAGE_SIZE] + pc_address % DECODED_PAGE_SIZE;
+            if(vm->status != VIRTUAL_MACHINE_RUN){
+                pc_address = execute_undecoded_instruction_at(vm, pc_address, &pending);
+                retired++;
+                break;
+            }
+        }
+        FAST_EXECUTE_INSTRUCTION();
+    }
+#endif
+    vm->pc = memory + pc_address;
+    vm->retired_instructions += retired;
+    return VM_OK;
+}
+
+#undef FAST_EXECUTE_INSTRUCTION
+
+/**
+ * Reads the raw image of length bytes open as descriptor into memory.
+ */
+static int read_raw_image(int descriptor, WORD *memory, size_t length){
+    size_t loaded;
+    ssize_t count;
+
+    // Read rather than mapped from the file: a mapping of it would fault
+    // once the file is truncated.
+    loaded = 0;
+    while(loaded < length){
+        count = read(descriptor, memory + loaded, length - loaded);
+        if(count <= 0){
+            return VM_IMAGE_LOAD_FAILED;
+        }
+        loaded += count;
+    }
+    return VM_OK;
+}
+
+int load_image(struct virtual_machine *vm, char *filename){
+    WORD magic[IMAGE_FORMAT_MAGIC_SIZE];
+    struct stat status;
+    WORD *memory;
+    FILE *file;
+    int descriptor, result;
+
+    descriptor = open(filename, O_RDONLY);
+    if(descriptor == -1 || fstat(descriptor, &status) != 0){
         log_error("File does not exist %s", filename);
+        if(descriptor != -1){
+            close(descriptor);
+        }
+        return VM_IMAGE_LOAD_FAILED;
     }
 
-    if (! vm->memory){
+    // The memory past the image is free and deterministic.
+    memory = map_empty_memory();
+    if(memory == NULL_MEMORY){
+        close(descriptor);
         return VM_MEMORY_ALLOCATION_FAILED;
     }
+    if(pread(descriptor, magic, IMAGE_FORMAT_MAGIC_SIZE, 0) == IMAGE_FORMAT_MAGIC_SIZE
+        && is_segmented_image(magic)){
+        file = fdopen(descriptor, "rb");
+        if(file == NULL){
+            close(descriptor);
+            result = VM_IMAGE_LOAD_FAILED;
+        } else{
+            result = read_segmented_image(file, memory);
+            fclose(file);
+        }
+    } else{
+        result = read_raw_image(descriptor, memory,
+            status.st_size < MAX_MEMORY_SIZE ? status.st_size : MAX_MEMORY_SIZE);
+        close(descriptor);
+    }
+    if(result != VM_OK){
+        log_error("Failed to read %s", filename);
+        munmap(memory, MAX_MEMORY_SIZE);
+        return result;
+    }
+
+    release_memory(vm);
+    vm->memory = memory;
+    vm->memory_origin = VM_MEMORY_MAPPED;
+    flush_decoded_instructions(vm);
+    flush_traces(vm);
     return VM_OK;
 }
 
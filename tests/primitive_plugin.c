@@ -0,0 +1,18 @@
+/**
+ * Plugin loaded by primitives_tests: registers, under
+ * PRIMITIVE_PLUGIN_TEST_ID, an extended primitive that stores 42 in the
+ * byte following its id.
+ */
+#include <primitives.h>
+
+#define PRIMITIVE_PLUGIN_TEST_ID 0x1234
+
+static void primitive_store_42(struct virtual_machine *vm, void *user_data){
+    unsigned int address = extract_result_address(vm) + PRIMITIVE_EXTENDED_ARGUMENTS_OFFSET;
+    vm->memory[address] = 42;
+    notify_memory_write(vm, address, 1);
+}
+
+int jolly_register_primitives(void){
+    return vm_register_primitive(PRIMITIVE_PLUGIN_TEST_ID, primitive_store_42, NULL);
+}
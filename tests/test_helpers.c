@@ -0,0 +1,11 @@
+#include "test_helpers.h"
+
+void write_instruction(WORD *memory, unsigned int address,
+    unsigned int from, unsigned int to, unsigned int jump){
+    unsigned int addresses[3] = { from, to, jump };
+    for(int i = 0; i < 3; i++){
+        memory[address+3*i] = (addresses[i] >> DOUBLE_WORD_SIZE) & WORD_BIT_MASK;
+        memory[address+3*i+1] = (addresses[i] >> WORD_SIZE) & WORD_BIT_MASK;
+        memory[address+3*i+2] = addresses[i] & WORD_BIT_MASK;
+    }
+}
@@ -0,0 +1,18 @@
+#ifndef TEST_HELPERS_H
+
+#define TEST_HELPERS_H
+
+#include "memory.h"
+
+/**
+ * Helpers shared by the test suites and the benchmarks, built as the
+ * test_helpers library.
+ */
+
+/**
+ * Writes the instruction (from, to, jump) at address in memory.
+ */
+void write_instruction(WORD *memory, unsigned int address,
+    unsigned int from, unsigned int to, unsigned int jump);
+
+#endif